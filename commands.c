@@ -4,11 +4,14 @@
 #include <readline/readline.h>
 
 #include "filesystem.h"
+#include "filehandle.h"
+#include "nameindex.h"
 #include "hashmap.h"
 #include "terminal.h"
 #include "commands.h"
 
 void private_commandDoesntExist( char* attemptedCommand );
+int private_isReadOnly();
 
 hashmapStruct* commandHashmap;
 
@@ -32,21 +35,37 @@ void private_commandDoesntExist( char* attemptedCommand ) {
     printf("Command '%s' doesn't exist\n", attemptedCommand );
 }
 
-char* convertToAbsolutePath( char* path ) {
-    char* argumentPath = path;
-    char* currentFilePath = getCurrentFilePath();
-    char* absolutePath = malloc( 1025 * sizeof( char ) );
+/* Used by the commands that change the volume, which can't run while a
+ * snapshot is mounted. Returns 1 and says so if one is. */
+int private_isReadOnly() {
+    if( isSnapshotMounted() ) {
+        printf( "A snapshot is mounted, the volume is read only. Use 'snapshot unmount' first\n" );
+        return 1;
+    }
+    return 0;
+}
 
-    if( strncmp( argumentPath, ROOTNAME, 4 ) == 0 ) {
-        strcpy( absolutePath, argumentPath );
+/* Writes the absolute form of path into absolutePath, which has room for
+ * PATH_BUFFER_SIZE characters, so commands can keep paths on the stack.
+ * Returns 0 if successful, -1 if the path is too long. */
+int convertToAbsolutePath( char* path, char* absolutePath ) {
+    int length;
+    size_t rootLength = strlen( ROOTNAME );
+
+    // only root itself or a path through it is absolute, not rootfoo
+    if( strncmp( path, ROOTNAME, rootLength ) == 0 &&
+        ( path[rootLength] == '\0' || path[rootLength] == '/' ) ) {
+        length = snprintf( absolutePath, PATH_BUFFER_SIZE, "%s", path );
     }
     else {
-        strcpy( absolutePath, currentFilePath );
-        strcat( absolutePath, "/" );
-        strcat( absolutePath, argumentPath );
+        length = snprintf( absolutePath, PATH_BUFFER_SIZE, "%s/%s", peekCurrentFilePath(), path );
     }
-    free( currentFilePath );
-    return absolutePath;
+
+    if( length >= PATH_BUFFER_SIZE ) {
+        printf( "Path is too long\n" );
+        return -1;
+    }
+    return 0;
 }
 
 /* MAKE SURE YOUR FUNCTION IS THE SAME FORM AS THE REST
@@ -56,17 +75,22 @@ char* convertToAbsolutePath( char* path ) {
  * The first argument you need to parse is at argumentList[1] */
 
 void ls( char** argumentList ) {
-    char* currentFilePath = getCurrentFilePath();
-    listChildrenFromPath( currentFilePath );
-    free( currentFilePath );
+    directoryHandle* currentDirectory = getCurrentDirectory();
+    if( !isValidDirectoryHandle( currentDirectory ) ) {
+        printf( "The current directory no longer exists\n" );
+        return;
+    }
+    listChildren( currentDirectory->blockLocation );
 }
 
 void mkdir( char** argumentList ) {
-    char* absolutePath;
-    absolutePath = convertToAbsolutePath( argumentList[1] );
+    if( private_isReadOnly() ) {
+        return;
+    }
+    directoryHandle* currentDirectory = getCurrentDirectory();
 
-    if( getBlockLocationFromPath( absolutePath ) == 0 ) {
-        unsigned long returnValue = makeDirectory( absolutePath );
+    if( getBlockLocationAt( currentDirectory, argumentList[1] ) == 0 ) {
+        unsigned long returnValue = makeDirectoryAt( currentDirectory, argumentList[1] );
         if( returnValue == 0 ) {
             printf( "Invalid path\n");
         }
@@ -74,8 +98,6 @@ void mkdir( char** argumentList ) {
     else {
         printf( "Directory already exists\n");
     }
-    
-    free( absolutePath );
 }
 
 void cd( char** argumentList ) {
@@ -88,105 +110,189 @@ void cd( char** argumentList ) {
     char* path = argumentList[1];
 
     if( strcmp( path, ".." ) == 0 ) {
-        path = getCurrentFilePath();
-        char *pLastBackslash = strrchr( path, '/' );
-        *(pLastBackslash) = '\0';
-        setCurrentFilePath( path );
-        free( path );
+        if( changeToParentDirectory() != 0 ) {
+            printf( "The current directory no longer exists\n" );
+        }
         return;
     }
 
-    char* absolutePath;
-    absolutePath = convertToAbsolutePath( path );
-
-    if( isFile_pathVersion( absolutePath ) ) {
-        printf( "Cannot cd to a file. Only directories.\n" );
+    // the path is only looked up below the current directory, the
+    // absolute form is kept for the prompt
+    char absolutePath[PATH_BUFFER_SIZE];
+    if( convertToAbsolutePath( path, absolutePath ) != 0 ) {
         return;
     }
 
-    if( getBlockLocationFromPath( absolutePath ) != 0 ) {
-        setCurrentFilePath( absolutePath );
+    directoryHandle* currentDirectory = getCurrentDirectory();
+    directoryHandle newDirectory;
+    if( openDirectoryHandle( currentDirectory, path, &newDirectory ) == 0 ) {
+        setCurrentDirectory( absolutePath, &newDirectory );
+    }
+    else if( getBlockLocationAt( currentDirectory, path ) != 0 ) {
+        printf( "Cannot cd to a file. Only directories.\n" );
     }
     else {
         printf( "No such file or directory\n" );
     }
-
-    free( absolutePath );
 }
 
 /* Remove: The argument should be a path to the file being removed.
  * If the path points to a directory then the directory along with all
  * of its contents are removed. */
 void rm( char** argumentList ) {
-    char* path = argumentList[1];
-    char* absolutePath;
-    absolutePath = convertToAbsolutePath( path );
-    deleteFilePath( absolutePath );
-    free( absolutePath );
+    if( private_isReadOnly() ) {
+        return;
+    }
+    deleteFileAt( getCurrentDirectory(), argumentList[1] );
 }
 
 void cp( char** argumentList ) {
-    char* fromDirectory = convertToAbsolutePath( argumentList[1] );
-    char* toDirectory = convertToAbsolutePath( argumentList[2] );
-
-    copyFile( fromDirectory, toDirectory );
+    if( private_isReadOnly() ) {
+        return;
+    }
+    if( argumentList[1] == NULL || argumentList[2] == NULL ) {
+        printf( "Cp needs a source and a destination\n" );
+        return;
+    }
+    copyFileAt( getCurrentDirectory(), argumentList[1], argumentList[2] );
 }
 
 void mv( char** argumentList ) {
-    char* fromDirectory = convertToAbsolutePath( argumentList[1] );
-    char* toDirectory = convertToAbsolutePath( argumentList[2] );
-
-    moveFile( fromDirectory, toDirectory );
+    if( private_isReadOnly() ) {
+        return;
+    }
+    if( argumentList[1] == NULL || argumentList[2] == NULL ) {
+        printf( "Mv needs a source and a destination\n" );
+        return;
+    }
+    // the move may have renamed a directory the prompt shows
+    if( moveFileAt( getCurrentDirectory(), argumentList[1], argumentList[2] ) == 0 ) {
+        refreshCurrentFilePath();
+    }
 }
 
 void stat( char** argumentList ) {
-    char* path = argumentList[1];
-    char* absolutePath = convertToAbsolutePath( path );
-    printMetadata( absolutePath );
-    free( absolutePath );
+    if( argumentList[1] == NULL ) {
+        printf( "Stat needs a file\n" );
+        return;
+    }
+    printMetadataAt( getCurrentDirectory(), argumentList[1] );
 }
 
 void linuxtoalpha( char** argumentList ) {
-    char* linuxPath = argumentList[1];
-    char* alphaPath = argumentList[2];
-    alphaPath = convertToAbsolutePath( alphaPath );
-
-    copyFromLinuxToVolume( linuxPath, alphaPath );
-
-    free( alphaPath );
+    if( private_isReadOnly() ) {
+        return;
+    }
+    if( argumentList[1] == NULL || argumentList[2] == NULL ) {
+        printf( "Linuxtoalpha needs a linux file and a volume file\n" );
+        return;
+    }
+    copyFromLinuxToVolumeAt( getCurrentDirectory(), argumentList[1], argumentList[2] );
 }
 
 void alphatolinux( char** argumentList ) {
-    char* alphaPath = argumentList[1];
-    char* linuxPath = argumentList[2];
-    alphaPath = convertToAbsolutePath( alphaPath );
+    if( argumentList[1] == NULL || argumentList[2] == NULL ) {
+        printf( "Alphatolinux needs a volume file and a linux file\n" );
+        return;
+    }
+    copyFromVolumeToLinuxAt( getCurrentDirectory(), argumentList[1], argumentList[2] );
+}
+
+void cat( char** argumentList ) {
+    if( argumentList[1] == NULL ) {
+        printf( "Cat needs a file\n" );
+        return;
+    }
+    int fileDescriptor = openFileAt( getCurrentDirectory(), argumentList[1], OPEN_READ );
+    if( fileDescriptor < 0 ) {
+        return;
+    }
 
-    copyFromVolumeToLinux( alphaPath, linuxPath );
+    // the file is streamed so it never has to fit in memory
+    char buffer[512];
+    long amountRead;
+    while( ( amountRead = readFile( fileDescriptor, buffer, sizeof( buffer ) ) ) > 0 ) {
+        fwrite( buffer, amountRead, 1, stdout );
+    }
+    printf( "\n" );
 
-    free( alphaPath );
+    closeFile( fileDescriptor );
 }
 
 
+/* Locate: locate PATTERN lists every file on the volume whose name matches */
+void locate( char** argumentList ) {
+    if( argumentList[1] == NULL ) {
+        printf( "Locate needs a name or a pattern\n" );
+        return;
+    }
+    locateFiles( argumentList[1] );
+}
+
+/* Snapshot: snapshot create NAME [BLOCKS], snapshot list,
+ * snapshot delete NAME, snapshot mount-readonly NAME or snapshot unmount */
+void snapshotCommand( char** argumentList ) {
+    char* action = argumentList[1];
+    char* name = action != NULL ? argumentList[2] : NULL;
+
+    if( action != NULL && strcmp( action, "list" ) == 0 ) {
+        listSnapshots();
+    }
+    else if( action != NULL && strcmp( action, "unmount" ) == 0 ) {
+        if( unmountSnapshot() == 0 ) {
+            setCurrentFilePath( ROOTNAME );
+        }
+    }
+    else if( name == NULL ) {
+        printf( "Usage: snapshot create NAME [BLOCKS] | list | delete NAME |"
+                " mount-readonly NAME | unmount\n" );
+    }
+    else if( strcmp( action, "create" ) == 0 ) {
+        // by default the store can hold an eighth of the volume changing
+        unsigned long storeBlocks =
+            mainSystemInfo->volumeSize / mainSystemInfo->lbaSize / 8;
+        if( argumentList[3] != NULL ) {
+            storeBlocks = strtoul( argumentList[3], NULL, 10 );
+        }
+        createSnapshot( name, storeBlocks );
+    }
+    else if( strcmp( action, "delete" ) == 0 ) {
+        deleteSnapshot( name );
+    }
+    else if( strcmp( action, "mount-readonly" ) == 0 ) {
+        if( mountSnapshot( name ) == 0 ) {
+            setCurrentFilePath( ROOTNAME );
+        }
+    }
+    else {
+        printf( "Unknown snapshot action '%s'\n", action );
+    }
+}
+
 void textedit( char** argumentList ) {
+    if( private_isReadOnly() ) {
+        return;
+    }
     if( argumentList[1] == NULL ) {
         printf( "Textedit needs a name\n" );
         return;
     }
+    directoryHandle* currentDirectory = getCurrentDirectory();
     char* path = argumentList[1];
-    path = convertToAbsolutePath( path );
-    char* content = getContent( path );
+    char* content = getContentAt( currentDirectory, path );
     
 
     if( content == NULL ) {
         content = calloc( 1, 1);
         printf( "Creating file\n");
-        if( makeFile( path ) == 0 ) {
+        if( makeFileAt( currentDirectory, path ) == 0 ) {
             printf( "Couldn't make file\n" );
+            free( content );
             return;
         }
     }
     
-    unsigned long parentLocation = getBlockLocationFromPath( path );
+    unsigned long parentLocation = getBlockLocationAt( currentDirectory, path );
 
     int readlineRunning;
     char* newContent;
@@ -207,14 +313,14 @@ void textedit( char** argumentList ) {
     }
     printf("\n");
     
-    int contentActualSize = strlen( newContent ) + 1;
-    int blockSize = ( contentActualSize / mainSystemInfo->lbaSize ) + 1;
-    int bufferMallocSize = blockSize * mainSystemInfo->lbaSize;
+    unsigned long contentActualSize = strlen( newContent ) + 1;
+    unsigned long blockSize = ( contentActualSize / mainSystemInfo->lbaSize ) + 1;
+    unsigned long bufferMallocSize = blockSize * mainSystemInfo->lbaSize;
 
     void* contentBuffer = calloc( bufferMallocSize, 1 );
     memcpy( contentBuffer, (void*)newContent, contentActualSize );
 
-    writeFileData( parentLocation, blockSize, contentBuffer, contentActualSize );
+    writeFileData( parentLocation, contentBuffer, contentActualSize );
 
     if( content != NULL ) {
         free( content );
@@ -258,6 +364,17 @@ void help( char** argumentList ) {
             "alphatolinux ALPHAFILE LINUXFILE\n"
             "    Well what do you know... this guy copies a file from the\n"
             "    alpha system to the linux machine.\n\n"
+            "cat FILE\n"
+            "    Prints the contents of a file.\n\n"
+            "locate PATTERN\n"
+            "    Lists every file whose name contains PATTERN, or matches it\n"
+            "    if it has *, ? or [ in it, with no need to search the tree.\n\n"
+            "snapshot create NAME [BLOCKS] | list | delete NAME |\n"
+            "         mount-readonly NAME | unmount\n"
+            "    Takes, lists and deletes snapshots of the whole volume.\n"
+            "    BLOCKS is how much of the volume can change before the\n"
+            "    snapshot fills up. A mounted snapshot is read only until it\n"
+            "    is unmounted.\n\n"
             "textedit FILE\n"
             "    Allows you to edit the contents of a file. If the file\n"
             "    doesn't exist then one is created and you will be"
@@ -285,6 +402,9 @@ void initializeHashmap() {
     hashMapInsert( commandHashmap, "stat", &stat );
     hashMapInsert( commandHashmap, "linuxtoalpha", &linuxtoalpha );
     hashMapInsert( commandHashmap, "alphatolinux", &alphatolinux );
+    hashMapInsert( commandHashmap, "cat", &cat );
+    hashMapInsert( commandHashmap, "locate", &locate );
+    hashMapInsert( commandHashmap, "snapshot", &snapshotCommand );
     hashMapInsert( commandHashmap, "textedit", &textedit );
     hashMapInsert( commandHashmap, "quit", &quit );
     hashMapInsert( commandHashmap, "help", &help );
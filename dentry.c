@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "systemstructs.h"
+#include "directoryhash.h"
+#include "dentry.h"
+
+/* The dentry cache. Path steps are hashed on the parent's location and the
+ * child's name and kept on an LRU list (most recently used at the head), so
+ * walking a path that was walked before reads nothing from the volume. The
+ * cache only holds copies, so the oldest entry can always be dropped. */
+dentry* dentryCacheBuckets[DENTRY_CACHE_BUCKETS];
+dentry* dentryLruHead = NULL;
+dentry* dentryLruTail = NULL;
+int dentryCacheCount = 0;
+
+/* Held by every entry point, lookups move entries on the LRU list too */
+pthread_mutex_t dentryCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+dentry** private_dentryCacheFind( unsigned long parentLocation, char* fileName );
+void private_freeDentry( dentry** slot );
+void private_dentryLruRemove( dentry* cachedEntry );
+void private_dentryLruPushFront( dentry* cachedEntry );
+
+/* Looks up fileName in the parent directory without touching the volume.
+ * Returns 1 and fills entry if the step is cached, where a childLocation of
+ * 0 means the name is known not to exist. Returns 0 if it isn't cached. */
+int lookupDentry( unsigned long parentLocation, char* fileName, directoryEntry* entry ) {
+    pthread_mutex_lock( &dentryCacheLock );
+    dentry* cachedEntry = *private_dentryCacheFind( parentLocation, fileName );
+    if( cachedEntry == NULL ) {
+        pthread_mutex_unlock( &dentryCacheLock );
+        return 0;
+    }
+
+    private_dentryLruRemove( cachedEntry );
+    private_dentryLruPushFront( cachedEntry );
+    memcpy( (void*)entry, (void*)&cachedEntry->entry, sizeof( directoryEntry ) );
+    pthread_mutex_unlock( &dentryCacheLock );
+    return 1;
+}
+
+/* Records what is under fileName in the parent directory, replacing
+ * anything cached for it before. A NULL entry records that there is
+ * nothing. The parent's own entries must be dropped with
+ * invalidateDentryDirectory() before its header is freed. */
+void addDentry( unsigned long parentLocation, char* fileName, directoryEntry* entry ) {
+    // a name that long can't be in any directory, nothing to remember
+    if( strlen( fileName ) >= sizeof( ((directoryEntry*)0)->fileName ) ) {
+        return;
+    }
+
+    pthread_mutex_lock( &dentryCacheLock );
+    dentry** slot = private_dentryCacheFind( parentLocation, fileName );
+    dentry* cachedEntry = *slot;
+
+    if( cachedEntry == NULL ) {
+        cachedEntry = calloc( 1, sizeof( dentry ) );
+        cachedEntry->parentLocation = parentLocation;
+        *slot = cachedEntry;
+        dentryCacheCount++;
+    }
+    else {
+        private_dentryLruRemove( cachedEntry );
+    }
+    private_dentryLruPushFront( cachedEntry );
+
+    if( entry != NULL ) {
+        memcpy( (void*)&cachedEntry->entry, (void*)entry, sizeof( directoryEntry ) );
+    }
+    else {
+        memset( (void*)&cachedEntry->entry, 0, sizeof( directoryEntry ) );
+    }
+    strcpy( cachedEntry->entry.fileName, fileName );
+
+    while( dentryCacheCount > DENTRY_CACHE_CAPACITY ) {
+        private_freeDentry( private_dentryCacheFind( dentryLruTail->parentLocation,
+                                                     dentryLruTail->entry.fileName ) );
+    }
+    pthread_mutex_unlock( &dentryCacheLock );
+}
+
+/* Drops every step out of a directory that is going away, including the
+ * negative ones, so a directory later made at the same location starts
+ * out with nothing cached */
+void invalidateDentryDirectory( unsigned long parentLocation ) {
+    pthread_mutex_lock( &dentryCacheLock );
+    dentry* cachedEntry = dentryLruHead;
+    dentry* nextEntry;
+
+    while( cachedEntry != NULL ) {
+        nextEntry = cachedEntry->lruNext;
+        if( cachedEntry->parentLocation == parentLocation ) {
+            private_freeDentry( private_dentryCacheFind( parentLocation,
+                                                         cachedEntry->entry.fileName ) );
+        }
+        cachedEntry = nextEntry;
+    }
+    pthread_mutex_unlock( &dentryCacheLock );
+}
+
+/* Empties the cache, for when the volume underneath changes as a whole */
+void freeDentryCache() {
+    pthread_mutex_lock( &dentryCacheLock );
+    while( dentryLruHead != NULL ) {
+        private_freeDentry( private_dentryCacheFind( dentryLruHead->parentLocation,
+                                                     dentryLruHead->entry.fileName ) );
+    }
+    pthread_mutex_unlock( &dentryCacheLock );
+}
+
+/* Finds the hash chain slot holding the step, or the empty slot at the end
+ * of the chain if it isn't cached */
+dentry** private_dentryCacheFind( unsigned long parentLocation, char* fileName ) {
+    unsigned int bucket = ( hashFileName( fileName ) ^ parentLocation ) % DENTRY_CACHE_BUCKETS;
+    dentry** slot = dentryCacheBuckets + bucket;
+
+    while( *slot != NULL ) {
+        if( (*slot)->parentLocation == parentLocation &&
+            strcmp( (*slot)->entry.fileName, fileName ) == 0 ) {
+            return slot;
+        }
+        slot = &((*slot)->hashNext);
+    }
+
+    return slot;
+}
+
+/* Unlinks the entry in slot from its chain and the LRU list and frees it */
+void private_freeDentry( dentry** slot ) {
+    dentry* cachedEntry = *slot;
+    *slot = cachedEntry->hashNext;
+    private_dentryLruRemove( cachedEntry );
+    dentryCacheCount--;
+    free( cachedEntry );
+}
+
+void private_dentryLruRemove( dentry* cachedEntry ) {
+    if( cachedEntry->lruPrev != NULL ) {
+        cachedEntry->lruPrev->lruNext = cachedEntry->lruNext;
+    }
+    else {
+        dentryLruHead = cachedEntry->lruNext;
+    }
+
+    if( cachedEntry->lruNext != NULL ) {
+        cachedEntry->lruNext->lruPrev = cachedEntry->lruPrev;
+    }
+    else {
+        dentryLruTail = cachedEntry->lruPrev;
+    }
+
+    cachedEntry->lruPrev = NULL;
+    cachedEntry->lruNext = NULL;
+}
+
+void private_dentryLruPushFront( dentry* cachedEntry ) {
+    cachedEntry->lruPrev = NULL;
+    cachedEntry->lruNext = dentryLruHead;
+    if( dentryLruHead != NULL ) {
+        dentryLruHead->lruPrev = cachedEntry;
+    }
+    dentryLruHead = cachedEntry;
+    if( dentryLruTail == NULL ) {
+        dentryLruTail = cachedEntry;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef DENTRY_H
+#define DENTRY_H
+
+#include "systemstructs.h"
+
+#define DENTRY_CACHE_BUCKETS 512
+#define DENTRY_CACHE_CAPACITY 1024
+
+/* A cached path step: the directory entry found under a name in a parent
+ * directory. A negative entry remembers that the name isn't there and has
+ * an entry.childLocation of 0. */
+typedef struct dentry {
+    unsigned long parentLocation;
+    directoryEntry entry;
+    struct dentry* hashNext;
+    struct dentry* lruPrev;
+    struct dentry* lruNext;
+} dentry;
+
+int lookupDentry( unsigned long parentLocation, char* fileName, directoryEntry* entry );
+void addDentry( unsigned long parentLocation, char* fileName, directoryEntry* entry );
+void invalidateDentryDirectory( unsigned long parentLocation );
+void freeDentryCache();
+
+#endif /* DENTRY_H end guard */
@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fsLow.h"
+#include "systemstructs.h"
+#include "filesystem.h"
+#include "inode.h"
+#include "directory.h"
+
+void private_initializeDirectoryBlock( directoryBlock* block, unsigned long prev );
+
+/* Adds the entry to the end of the directory's block chain. Only the last
+ * block is touched, plus the one before it when a new block has to be
+ * chained on, so the cost does not depend on the size of the directory.
+ * The caller puts the directory handle, which writes the updated header.
+ * position is filled in with where the entry ended up.
+ * Returns 0 if successful, -1 if no space was left for a new block. */
+int appendDirectoryEntry( inodeHandle* directory, directoryEntry* entry, directoryPosition* position ) {
+    return appendDirectoryEntries( directory, entry, 1, position ) == 1 ? 0 : -1;
+}
+
+/* Same as appendDirectoryEntry() for count entries at once. Each directory
+ * block they land in is read and written once rather than once per entry.
+ * positions[i] is filled in with where entries[i] ended up.
+ * Returns how many were added, fewer than count if no space was left for
+ * a new block. */
+unsigned int appendDirectoryEntries( inodeHandle* directory, directoryEntry* entries, unsigned int count,
+                                     directoryPosition* positions ) {
+    file* directoryFile = directory->inode;
+    directoryBlock* block = calloc( directory_mallocSize, 1 );
+    unsigned long blockLocation = directoryFile->lastDirectoryBlock;
+    int isBlockLoaded = 0;
+    unsigned int added = 0;
+
+    while( added < count ) {
+        // every block but the last is full, so the child count alone tells
+        // us whether the last block has room
+        if( blockLocation == 0 || directoryFile->childCount % directory_childrenPerBlock == 0 ) {
+            unsigned long newBlockLocation = getFreeBlocks( directory_lbaSize );
+            if( newBlockLocation == 0 ) {
+                break;
+            }
+
+            if( blockLocation != 0 ) {
+                if( !isBlockLoaded ) {
+                    volumeRead( (void*)block, directory_lbaSize, blockLocation );
+                }
+                block->next = newBlockLocation;
+                volumeWrite( (void*)block, directory_lbaSize, blockLocation );
+            }
+            else {
+                directoryFile->firstDirectoryBlock = newBlockLocation;
+            }
+
+            private_initializeDirectoryBlock( block, blockLocation );
+            blockLocation = newBlockLocation;
+            directoryFile->lastDirectoryBlock = newBlockLocation;
+            isBlockLoaded = 1;
+        }
+        else if( !isBlockLoaded ) {
+            volumeRead( (void*)block, directory_lbaSize, blockLocation );
+            isBlockLoaded = 1;
+        }
+
+        positions[added].blockLocation = blockLocation;
+        positions[added].slot = block->count;
+
+        block->children[block->count] = entries[added];
+        block->count++;
+        directoryFile->childCount++;
+        added++;
+    }
+
+    // a full block was written when the next one was chained on, only the
+    // last one is left
+    if( isBlockLoaded ) {
+        volumeWrite( (void*)block, directory_lbaSize, blockLocation );
+    }
+    if( added > 0 ) {
+        markInodeDirty( directory );
+    }
+
+    free( block );
+    return added;
+}
+
+/* Removes the entry at position. The hole it leaves is filled with the very
+ * last entry so every block but the last stays full. If that empties the
+ * last block, the block is freed.
+ * Returns 1 and copies the entry that was moved into position to
+ * movedEntry, or returns 0 if nothing had to move. */
+int removeDirectoryEntry( inodeHandle* directory, directoryPosition* position, directoryEntry* movedEntry ) {
+    file* directoryFile = directory->inode;
+    int wasMoved = 0;
+
+    directoryBlock* foundBlock = calloc( directory_mallocSize, 1 );
+    volumeRead( (void*)foundBlock, directory_lbaSize, position->blockLocation );
+
+    directoryBlock* lastBlock = foundBlock;
+    if( position->blockLocation != directoryFile->lastDirectoryBlock ) {
+        lastBlock = calloc( directory_mallocSize, 1 );
+        volumeRead( (void*)lastBlock, directory_lbaSize, directoryFile->lastDirectoryBlock );
+    }
+
+    lastBlock->count--;
+    if( lastBlock != foundBlock || position->slot != lastBlock->count ) {
+        *movedEntry = lastBlock->children[lastBlock->count];
+        wasMoved = 1;
+    }
+    foundBlock->children[position->slot] = lastBlock->children[lastBlock->count];
+    memset( (void*)( lastBlock->children + lastBlock->count ), 0, sizeof( directoryEntry ) );
+
+    if( lastBlock != foundBlock ) {
+        volumeWrite( (void*)foundBlock, directory_lbaSize, position->blockLocation );
+    }
+
+    if( lastBlock->count == 0 ) {
+        unsigned long previousLocation = lastBlock->prev;
+        delete( directoryFile->lastDirectoryBlock, directory_lbaSize );
+        directoryFile->lastDirectoryBlock = previousLocation;
+
+        if( previousLocation == 0 ) {
+            directoryFile->firstDirectoryBlock = 0;
+        }
+        else {
+            directoryBlock* previousBlock = calloc( directory_mallocSize, 1 );
+            volumeRead( (void*)previousBlock, directory_lbaSize, previousLocation );
+            previousBlock->next = 0;
+            volumeWrite( (void*)previousBlock, directory_lbaSize, previousLocation );
+            free( previousBlock );
+        }
+    }
+    else {
+        volumeWrite( (void*)lastBlock, directory_lbaSize, directoryFile->lastDirectoryBlock );
+    }
+
+    if( lastBlock != foundBlock ) {
+        free( lastBlock );
+    }
+    free( foundBlock );
+
+    directoryFile->childCount--;
+    markInodeDirty( directory );
+
+    return wasMoved;
+}
+
+/* Gives every block in the directory's chain back to the free list. This
+ * does not touch the children themselves. */
+int freeDirectoryBlocks( inodeHandle* directory ) {
+    file* directoryFile = directory->inode;
+    directoryBlock* block = calloc( directory_mallocSize, 1 );
+    unsigned long blockLocation = directoryFile->firstDirectoryBlock;
+    unsigned long nextLocation;
+
+    while( blockLocation != 0 ) {
+        volumeRead( (void*)block, directory_lbaSize, blockLocation );
+        if( !isValidDirectoryBlock( block ) ) {
+            break;
+        }
+        nextLocation = block->next;
+        delete( blockLocation, directory_lbaSize );
+        blockLocation = nextLocation;
+    }
+
+    directoryFile->firstDirectoryBlock = 0;
+    directoryFile->lastDirectoryBlock = 0;
+    directoryFile->childCount = 0;
+    markInodeDirty( directory );
+
+    free( block );
+    return 0;
+}
+
+/* Reads the entry at position into entry.
+ * Returns 0 if successful, -1 if position isn't a valid entry. */
+int readDirectoryEntry( directoryPosition* position, directoryEntry* entry ) {
+    directoryBlock* block = calloc( directory_mallocSize, 1 );
+    int returnValue = -1;
+
+    volumeRead( (void*)block, directory_lbaSize, position->blockLocation );
+    if( isValidDirectoryBlock( block ) && position->slot < block->count ) {
+        *entry = block->children[position->slot];
+        returnValue = 0;
+    }
+
+    free( block );
+    return returnValue;
+}
+
+/* Starts a walk over the children of the directory. Call
+ * nextDirectoryEntry() until it returns NULL, then closeDirectory(). */
+directoryIterator* openDirectory( inodeHandle* directory ) {
+    directoryIterator* iterator = malloc( sizeof( directoryIterator ) );
+    iterator->block = calloc( directory_mallocSize, 1 );
+    iterator->blockLocation = directory->inode->firstDirectoryBlock;
+    iterator->index = 0;
+
+    if( iterator->blockLocation != 0 ) {
+        volumeRead( (void*)iterator->block, directory_lbaSize, iterator->blockLocation );
+    }
+
+    return iterator;
+}
+
+/* Returns the next child's entry, or NULL once every child has been
+ * returned. The entry is only good until the next call. */
+directoryEntry* nextDirectoryEntry( directoryIterator* iterator ) {
+    while( iterator->blockLocation != 0 ) {
+        if( !isValidDirectoryBlock( iterator->block ) ) {
+            printf( "WARNING DIRECTORY CHAIN POINTS TO A BLOCK THAT IS\n"
+                    "NOT A DIRECTORY BLOCK\n" );
+            iterator->blockLocation = 0;
+            break;
+        }
+
+        if( iterator->index < iterator->block->count ) {
+            directoryEntry* entry = iterator->block->children + iterator->index;
+            iterator->index++;
+            return entry;
+        }
+
+        iterator->blockLocation = iterator->block->next;
+        iterator->index = 0;
+        if( iterator->blockLocation != 0 ) {
+            volumeRead( (void*)iterator->block, directory_lbaSize, iterator->blockLocation );
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns the next block of children as a whole, or NULL once the chain
+ * ends, for callers that work on a block's worth of children at once. The
+ * block is only good until the next call. Not to be mixed with
+ * nextDirectoryEntry() on the same iterator. */
+directoryBlock* nextDirectoryBlock( directoryIterator* iterator ) {
+    // index only marks that the loaded block was returned already
+    if( iterator->index > 0 && iterator->blockLocation != 0 ) {
+        iterator->blockLocation = iterator->block->next;
+        if( iterator->blockLocation != 0 ) {
+            volumeRead( (void*)iterator->block, directory_lbaSize, iterator->blockLocation );
+        }
+    }
+    if( iterator->blockLocation == 0 ) {
+        return NULL;
+    }
+
+    if( !isValidDirectoryBlock( iterator->block ) ) {
+        printf( "WARNING DIRECTORY CHAIN POINTS TO A BLOCK THAT IS\n"
+                "NOT A DIRECTORY BLOCK\n" );
+        iterator->blockLocation = 0;
+        return NULL;
+    }
+
+    iterator->index = 1;
+    return iterator->block;
+}
+
+void closeDirectory( directoryIterator* iterator ) {
+    free( iterator->block );
+    free( iterator );
+}
+
+int isValidDirectoryBlock( directoryBlock* directoryBlockToCheck ) {
+    return ( directoryBlockToCheck->signature1 == DIRECTORYSIGNATURE1 ) &&
+           ( directoryBlockToCheck->signature2 == DIRECTORYSIGNATURE2 );
+}
+
+/* Clears the block and sets it up as the new last block of a chain */
+void private_initializeDirectoryBlock( directoryBlock* block, unsigned long prev ) {
+    memset( (void*)block, 0, directory_mallocSize );
+    block->signature1 = DIRECTORYSIGNATURE1;
+    block->signature2 = DIRECTORYSIGNATURE2;
+    block->prev = prev;
+    block->next = 0;
+    block->count = 0;
+}
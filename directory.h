@@ -0,0 +1,32 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include "systemstructs.h"
+#include "inode.h"
+
+/* Where a child sits in the directory block chain */
+typedef struct directoryPosition {
+    unsigned long blockLocation;
+    unsigned int slot;
+} directoryPosition;
+
+/* Walks the children of a directory one directory block at a time */
+typedef struct directoryIterator {
+    unsigned long blockLocation;
+    directoryBlock* block;
+    unsigned int index;
+} directoryIterator;
+
+int appendDirectoryEntry( inodeHandle* directory, directoryEntry* entry, directoryPosition* position );
+unsigned int appendDirectoryEntries( inodeHandle* directory, directoryEntry* entries, unsigned int count,
+                                     directoryPosition* positions );
+int removeDirectoryEntry( inodeHandle* directory, directoryPosition* position, directoryEntry* movedEntry );
+int readDirectoryEntry( directoryPosition* position, directoryEntry* entry );
+int freeDirectoryBlocks( inodeHandle* directory );
+directoryIterator* openDirectory( inodeHandle* directory );
+directoryEntry* nextDirectoryEntry( directoryIterator* iterator );
+directoryBlock* nextDirectoryBlock( directoryIterator* iterator );
+void closeDirectory( directoryIterator* iterator );
+int isValidDirectoryBlock( directoryBlock* directoryBlockToCheck );
+
+#endif /* DIRECTORY_H end guard */
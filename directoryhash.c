@@ -0,0 +1,635 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fsLow.h"
+#include "systemstructs.h"
+#include "filesystem.h"
+#include "inode.h"
+#include "directory.h"
+#include "directoryhash.h"
+
+// a bucket is split once the index is on average 3/4 full
+#define HASH_SPLIT_NUMERATOR 3
+#define HASH_SPLIT_DENOMINATOR 4
+
+/* An entry of an insertHashEntries() batch and the bucket it goes in */
+typedef struct bucketSlot {
+    unsigned long bucketNumber;
+    unsigned int index;
+} bucketSlot;
+
+int private_createHashIndex( inodeHandle* directory );
+int private_isOverfull( file* directoryFile );
+int private_compareBucketSlots( const void* first, const void* second );
+unsigned long private_bucketCount( file* directoryFile );
+unsigned long private_bucketNumber( file* directoryFile, unsigned int nameHash );
+int private_segmentOf( unsigned long bucketNumber );
+unsigned long private_segmentBuckets( int segment );
+unsigned long private_bucketLocation( file* directoryFile, unsigned long bucketNumber );
+void private_initializeBucket( hashBucket* bucket );
+void private_splitBucket( inodeHandle* directory );
+void private_writeBucketEntries( unsigned long bucketLocation, hashEntry* entries, unsigned int count,
+                                 unsigned long* spareBlocks, int* spareCount );
+
+/* 32 bit FNV-1a hash of the name */
+unsigned int hashFileName( char* fileName ) {
+    unsigned int hash = 2166136261u;
+    for( unsigned char* character = (unsigned char*)fileName; *character != '\0'; character++ ) {
+        hash ^= *character;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Adds the child to the directory's name index. position is where the child
+ * was put in the directory block chain. The first child creates the index
+ * and every insert splits at most one bucket, so growth is incremental.
+ * Returns 0 if successful, -1 if no space was left. */
+int insertHashEntry( inodeHandle* directory, char* fileName, unsigned long childLocation, directoryPosition* position ) {
+    file* directoryFile = directory->inode;
+    hashBucket* bucket = calloc( directory_mallocSize, 1 );
+
+    if( directoryFile->hashSegments[0] == 0 && private_createHashIndex( directory ) != 0 ) {
+        free( bucket );
+        return -1;
+    }
+
+    unsigned int nameHash = hashFileName( fileName );
+    unsigned long bucketLocation = private_bucketLocation( directoryFile,
+        private_bucketNumber( directoryFile, nameHash ) );
+    volumeRead( (void*)bucket, directory_lbaSize, bucketLocation );
+
+    // find a block in the bucket's chain with room, or chain on a new one
+    while( bucket->count == directory_entriesPerBucket && bucket->overflow != 0 ) {
+        bucketLocation = bucket->overflow;
+        volumeRead( (void*)bucket, directory_lbaSize, bucketLocation );
+    }
+
+    if( bucket->count == directory_entriesPerBucket ) {
+        unsigned long overflowLocation = getFreeBlocks( directory_lbaSize );
+        if( overflowLocation == 0 ) {
+            free( bucket );
+            return -1;
+        }
+        bucket->overflow = overflowLocation;
+        volumeWrite( (void*)bucket, directory_lbaSize, bucketLocation );
+        private_initializeBucket( bucket );
+        bucketLocation = overflowLocation;
+    }
+
+    hashEntry* entry = bucket->entries + bucket->count;
+    entry->nameHash = nameHash;
+    entry->childLocation = childLocation;
+    entry->directoryBlock = position->blockLocation;
+    entry->slot = position->slot;
+    bucket->count++;
+    volumeWrite( (void*)bucket, directory_lbaSize, bucketLocation );
+
+    free( bucket );
+
+    if( private_isOverfull( directoryFile ) ) {
+        private_splitBucket( directory );
+    }
+
+    return 0;
+}
+
+/* Adds count children to the directory's name index at once, see
+ * insertHashEntry(). positions are where they were put in the directory
+ * block chain, which has to hold them already. The buckets are split
+ * first, as many times as the inserts one by one would, and the entries
+ * then go in bucket by bucket so every bucket block is written once for
+ * the batch.
+ * Returns how many were added, always the first ones of entries. */
+unsigned int insertHashEntries( inodeHandle* directory, directoryEntry* entries, unsigned int count,
+                                directoryPosition* positions ) {
+    file* directoryFile = directory->inode;
+
+    if( count == 0 || ( directoryFile->hashSegments[0] == 0 && private_createHashIndex( directory ) != 0 ) ) {
+        return 0;
+    }
+
+    for( unsigned int i = 0; i < count && private_isOverfull( directoryFile ); i++ ) {
+        unsigned long bucketCount = private_bucketCount( directoryFile );
+        private_splitBucket( directory );
+        if( private_bucketCount( directoryFile ) == bucketCount ) {
+            // no room to grow, the buckets keep chaining instead
+            break;
+        }
+    }
+
+    bucketSlot* slots = malloc( count * sizeof( bucketSlot ) );
+    unsigned int* hashes = malloc( count * sizeof( unsigned int ) );
+    char* isAdded = calloc( count, 1 );
+    for( unsigned int i = 0; i < count; i++ ) {
+        hashes[i] = hashFileName( entries[i].fileName );
+        slots[i].bucketNumber = private_bucketNumber( directoryFile, hashes[i] );
+        slots[i].index = i;
+    }
+    qsort( slots, count, sizeof( bucketSlot ), private_compareBucketSlots );
+
+    hashBucket* bucket = calloc( directory_mallocSize, 1 );
+    unsigned long bucketLocation = 0;
+    int isChanged = 0;
+    int isOutOfSpace = 0;
+
+    for( unsigned int i = 0; i < count && !isOutOfSpace; i++ ) {
+        unsigned int index = slots[i].index;
+
+        if( i == 0 || slots[i].bucketNumber != slots[i - 1].bucketNumber ) {
+            if( isChanged ) {
+                volumeWrite( (void*)bucket, directory_lbaSize, bucketLocation );
+                isChanged = 0;
+            }
+            bucketLocation = private_bucketLocation( directoryFile, slots[i].bucketNumber );
+            volumeRead( (void*)bucket, directory_lbaSize, bucketLocation );
+        }
+
+        // same as insertHashEntry(), the first block of the chain with room
+        while( bucket->count == directory_entriesPerBucket && bucket->overflow != 0 ) {
+            if( isChanged ) {
+                volumeWrite( (void*)bucket, directory_lbaSize, bucketLocation );
+                isChanged = 0;
+            }
+            bucketLocation = bucket->overflow;
+            volumeRead( (void*)bucket, directory_lbaSize, bucketLocation );
+        }
+
+        if( bucket->count == directory_entriesPerBucket ) {
+            unsigned long overflowLocation = getFreeBlocks( directory_lbaSize );
+            if( overflowLocation == 0 ) {
+                isOutOfSpace = 1;
+                break;
+            }
+            bucket->overflow = overflowLocation;
+            volumeWrite( (void*)bucket, directory_lbaSize, bucketLocation );
+            private_initializeBucket( bucket );
+            bucketLocation = overflowLocation;
+        }
+
+        hashEntry* entry = bucket->entries + bucket->count;
+        entry->nameHash = hashes[index];
+        entry->childLocation = entries[index].childLocation;
+        entry->directoryBlock = positions[index].blockLocation;
+        entry->slot = positions[index].slot;
+        bucket->count++;
+        isChanged = 1;
+        isAdded[index] = 1;
+    }
+
+    if( isChanged ) {
+        volumeWrite( (void*)bucket, directory_lbaSize, bucketLocation );
+    }
+
+    // out of space, take back the ones past the first that didn't make it
+    unsigned int added = 0;
+    while( added < count && isAdded[added] ) {
+        added++;
+    }
+    for( unsigned int i = added + 1; isOutOfSpace && i < count; i++ ) {
+        if( isAdded[i] ) {
+            directoryPosition position;
+            removeHashEntry( directory, entries[i].fileName, entries[i].childLocation, &position );
+        }
+    }
+
+    free( bucket );
+    free( isAdded );
+    free( hashes );
+    free( slots );
+
+    return added;
+}
+
+/* Looks the name up in the directory's index. Entries whose hash matches
+ * are confirmed against the name in the directory block the entry points
+ * at, so the children's headers are never read. If entry or position
+ * aren't NULL they are filled with the child's directory entry and where it
+ * sits in the directory block chain. bucket and block are the caller's
+ * directory_mallocSize buffers to read into, so a lookup allocates nothing.
+ * Returns the child's location or 0 if there is no such child. */
+unsigned long findHashEntry( inodeHandle* directory, char* fileName, directoryEntry* entry, directoryPosition* position,
+                             hashBucket* bucket, directoryBlock* block ) {
+    file* directoryFile = directory->inode;
+    unsigned long childLocation = 0;
+
+    if( directoryFile->hashSegments[0] == 0 ) {
+        return 0;
+    }
+
+    unsigned int nameHash = hashFileName( fileName );
+    unsigned long bucketLocation = private_bucketLocation( directoryFile,
+        private_bucketNumber( directoryFile, nameHash ) );
+    unsigned long blockLocation = 0;
+
+    while( bucketLocation != 0 && childLocation == 0 ) {
+        volumeRead( (void*)bucket, directory_lbaSize, bucketLocation );
+        if( !isValidHashBucket( bucket ) ) {
+            break;
+        }
+
+        for( unsigned int i = 0; i < bucket->count; i++ ) {
+            hashEntry* candidate = bucket->entries + i;
+            if( candidate->nameHash != nameHash ) {
+                continue;
+            }
+
+            if( blockLocation != candidate->directoryBlock ) {
+                blockLocation = candidate->directoryBlock;
+                volumeRead( (void*)block, directory_lbaSize, blockLocation );
+            }
+
+            directoryEntry* childEntry = block->children + candidate->slot;
+            if( isValidDirectoryBlock( block ) && candidate->slot < block->count &&
+                strcmp( childEntry->fileName, fileName ) == 0 ) {
+                childLocation = candidate->childLocation;
+                if( entry != NULL ) {
+                    *entry = *childEntry;
+                }
+                if( position != NULL ) {
+                    position->blockLocation = candidate->directoryBlock;
+                    position->slot = candidate->slot;
+                }
+                break;
+            }
+        }
+
+        bucketLocation = bucket->overflow;
+    }
+
+    return childLocation;
+}
+
+/* Takes the child out of the directory's index. The hole is filled with the
+ * last entry of the bucket's chain, and an overflow block that empties is
+ * freed. position is filled with where the child sat in the directory
+ * block chain. Returns 0 if successful, -1 if the child wasn't found. */
+int removeHashEntry( inodeHandle* directory, char* fileName, unsigned long childLocation, directoryPosition* position ) {
+    file* directoryFile = directory->inode;
+
+    if( directoryFile->hashSegments[0] == 0 ) {
+        return -1;
+    }
+
+    unsigned int nameHash = hashFileName( fileName );
+    unsigned long bucketLocation = private_bucketLocation( directoryFile,
+        private_bucketNumber( directoryFile, nameHash ) );
+    unsigned long previousLocation = 0;
+    unsigned long foundLocation = 0;
+    unsigned int foundIndex = 0;
+    hashBucket* foundBucket = NULL;
+    hashBucket* bucket = calloc( directory_mallocSize, 1 );
+
+    // walk the whole chain, remembering where the entry is and ending on the
+    // last block of the chain
+    while( 1 ) {
+        volumeRead( (void*)bucket, directory_lbaSize, bucketLocation );
+
+        if( foundBucket == NULL ) {
+            for( unsigned int i = 0; i < bucket->count; i++ ) {
+                if( bucket->entries[i].childLocation == childLocation ) {
+                    foundBucket = bucket;
+                    foundLocation = bucketLocation;
+                    foundIndex = i;
+                    break;
+                }
+            }
+        }
+
+        if( bucket->overflow == 0 ) {
+            break;
+        }
+
+        unsigned long nextLocation = bucket->overflow;
+        if( bucket == foundBucket ) {
+            bucket = calloc( directory_mallocSize, 1 );
+        }
+        previousLocation = bucketLocation;
+        bucketLocation = nextLocation;
+    }
+
+    if( foundBucket == NULL ) {
+        free( bucket );
+        return -1;
+    }
+
+    hashBucket* lastBucket = bucket;
+    position->blockLocation = foundBucket->entries[foundIndex].directoryBlock;
+    position->slot = foundBucket->entries[foundIndex].slot;
+
+    lastBucket->count--;
+    foundBucket->entries[foundIndex] = lastBucket->entries[lastBucket->count];
+    memset( (void*)( lastBucket->entries + lastBucket->count ), 0, sizeof( hashEntry ) );
+
+    if( lastBucket != foundBucket ) {
+        volumeWrite( (void*)foundBucket, directory_lbaSize, foundLocation );
+    }
+
+    if( lastBucket->count == 0 && previousLocation != 0 ) {
+        // an empty overflow block, unlink it from the chain
+        delete( bucketLocation, directory_lbaSize );
+        if( previousLocation == foundLocation ) {
+            foundBucket->overflow = 0;
+            volumeWrite( (void*)foundBucket, directory_lbaSize, foundLocation );
+        }
+        else {
+            volumeRead( (void*)lastBucket, directory_lbaSize, previousLocation );
+            lastBucket->overflow = 0;
+            volumeWrite( (void*)lastBucket, directory_lbaSize, previousLocation );
+        }
+    }
+    else {
+        volumeWrite( (void*)lastBucket, directory_lbaSize, bucketLocation );
+    }
+
+    if( lastBucket != foundBucket ) {
+        free( lastBucket );
+    }
+    free( foundBucket );
+
+    return 0;
+}
+
+/* Records that the child now sits at position in the directory block
+ * chain. Used when removing a sibling moves the child.
+ * Returns 0 if successful, -1 if the child wasn't found. */
+int moveHashEntry( inodeHandle* directory, char* fileName, unsigned long childLocation, directoryPosition* position ) {
+    file* directoryFile = directory->inode;
+    int returnValue = -1;
+
+    if( directoryFile->hashSegments[0] == 0 ) {
+        return -1;
+    }
+
+    unsigned int nameHash = hashFileName( fileName );
+    unsigned long bucketLocation = private_bucketLocation( directoryFile,
+        private_bucketNumber( directoryFile, nameHash ) );
+    hashBucket* bucket = calloc( directory_mallocSize, 1 );
+
+    while( bucketLocation != 0 && returnValue != 0 ) {
+        volumeRead( (void*)bucket, directory_lbaSize, bucketLocation );
+
+        for( unsigned int i = 0; i < bucket->count; i++ ) {
+            if( bucket->entries[i].childLocation == childLocation ) {
+                bucket->entries[i].directoryBlock = position->blockLocation;
+                bucket->entries[i].slot = position->slot;
+                volumeWrite( (void*)bucket, directory_lbaSize, bucketLocation );
+                returnValue = 0;
+                break;
+            }
+        }
+
+        bucketLocation = bucket->overflow;
+    }
+
+    free( bucket );
+    return returnValue;
+}
+
+/* Gives every block of the directory's index back to the free list */
+int freeHashIndex( inodeHandle* directory ) {
+    file* directoryFile = directory->inode;
+
+    if( directoryFile->hashSegments[0] == 0 ) {
+        return 0;
+    }
+
+    hashBucket* bucket = calloc( directory_mallocSize, 1 );
+    unsigned long bucketCount = private_bucketCount( directoryFile );
+
+    // overflow blocks were allocated one at a time
+    for( unsigned long i = 0; i < bucketCount; i++ ) {
+        volumeRead( (void*)bucket, directory_lbaSize, private_bucketLocation( directoryFile, i ) );
+        unsigned long overflowLocation = bucket->overflow;
+        while( overflowLocation != 0 ) {
+            volumeRead( (void*)bucket, directory_lbaSize, overflowLocation );
+            unsigned long nextLocation = bucket->overflow;
+            delete( overflowLocation, directory_lbaSize );
+            overflowLocation = nextLocation;
+        }
+    }
+
+    // while the buckets themselves were allocated a segment at a time
+    for( int segment = 0; segment < HASH_SEGMENTS; segment++ ) {
+        if( directoryFile->hashSegments[segment] != 0 ) {
+            delete( directoryFile->hashSegments[segment],
+                    private_segmentBuckets( segment ) * directory_lbaSize );
+            directoryFile->hashSegments[segment] = 0;
+        }
+    }
+
+    directoryFile->hashLevel = 0;
+    directoryFile->hashSplit = 0;
+    markInodeDirty( directory );
+
+    free( bucket );
+    return 0;
+}
+
+int isValidHashBucket( hashBucket* hashBucketToCheck ) {
+    return ( hashBucketToCheck->signature1 == HASHSIGNATURE1 ) &&
+           ( hashBucketToCheck->signature2 == HASHSIGNATURE2 );
+}
+
+/* Gives the directory its first bucket.
+ * Returns 0 if successful, -1 if no space was left. */
+int private_createHashIndex( inodeHandle* directory ) {
+    file* directoryFile = directory->inode;
+    unsigned long firstBucketLocation = getFreeBlocks( directory_lbaSize );
+    if( firstBucketLocation == 0 ) {
+        return -1;
+    }
+
+    hashBucket* bucket = calloc( directory_mallocSize, 1 );
+    private_initializeBucket( bucket );
+    volumeWrite( (void*)bucket, directory_lbaSize, firstBucketLocation );
+    free( bucket );
+
+    directoryFile->hashSegments[0] = firstBucketLocation;
+    directoryFile->hashLevel = 0;
+    directoryFile->hashSplit = 0;
+    markInodeDirty( directory );
+    return 0;
+}
+
+int private_isOverfull( file* directoryFile ) {
+    return directoryFile->childCount * HASH_SPLIT_DENOMINATOR >
+           private_bucketCount( directoryFile ) * directory_entriesPerBucket * HASH_SPLIT_NUMERATOR;
+}
+
+/* qsort() order for an insertHashEntries() batch: by bucket, then in the
+ * order the entries were given */
+int private_compareBucketSlots( const void* first, const void* second ) {
+    const bucketSlot* firstSlot = first;
+    const bucketSlot* secondSlot = second;
+
+    if( firstSlot->bucketNumber != secondSlot->bucketNumber ) {
+        return firstSlot->bucketNumber < secondSlot->bucketNumber ? -1 : 1;
+    }
+    return ( firstSlot->index > secondSlot->index ) - ( firstSlot->index < secondSlot->index );
+}
+
+unsigned long private_bucketCount( file* directoryFile ) {
+    return ( 1UL << directoryFile->hashLevel ) + directoryFile->hashSplit;
+}
+
+/* Linear hashing: buckets before the split pointer have already been split
+ * and use one more bit of the hash */
+unsigned long private_bucketNumber( file* directoryFile, unsigned int nameHash ) {
+    unsigned long bucketNumber = nameHash & ( ( 1UL << directoryFile->hashLevel ) - 1 );
+    if( bucketNumber < directoryFile->hashSplit ) {
+        bucketNumber = nameHash & ( ( 1UL << ( directoryFile->hashLevel + 1 ) ) - 1 );
+    }
+    return bucketNumber;
+}
+
+int private_segmentOf( unsigned long bucketNumber ) {
+    if( bucketNumber == 0 ) {
+        return 0;
+    }
+    return 64 - __builtin_clzl( bucketNumber );
+}
+
+unsigned long private_segmentBuckets( int segment ) {
+    if( segment == 0 ) {
+        return 1;
+    }
+    return 1UL << ( segment - 1 );
+}
+
+unsigned long private_bucketLocation( file* directoryFile, unsigned long bucketNumber ) {
+    int segment = private_segmentOf( bucketNumber );
+    unsigned long firstBucketInSegment = ( segment == 0 ) ? 0 : 1UL << ( segment - 1 );
+    return directoryFile->hashSegments[segment] +
+           ( bucketNumber - firstBucketInSegment ) * directory_lbaSize;
+}
+
+void private_initializeBucket( hashBucket* bucket ) {
+    memset( (void*)bucket, 0, directory_mallocSize );
+    bucket->signature1 = HASHSIGNATURE1;
+    bucket->signature2 = HASHSIGNATURE2;
+}
+
+/* Splits the bucket at the split pointer into itself and a new bucket at
+ * the end of the table. The new bucket's segment is allocated when the
+ * first bucket in it is needed. If there is no room for it the split is
+ * skipped and the buckets just keep chaining overflow blocks. */
+void private_splitBucket( inodeHandle* directory ) {
+    file* directoryFile = directory->inode;
+    unsigned long oldBucketNumber = directoryFile->hashSplit;
+    unsigned long newBucketNumber = oldBucketNumber + ( 1UL << directoryFile->hashLevel );
+    int segment = private_segmentOf( newBucketNumber );
+
+    if( segment >= HASH_SEGMENTS ) {
+        return;
+    }
+
+    if( directoryFile->hashSegments[segment] == 0 ) {
+        unsigned long segmentLocation =
+            getFreeBlocks( private_segmentBuckets( segment ) * directory_lbaSize );
+        if( segmentLocation == 0 ) {
+            return;
+        }
+        directoryFile->hashSegments[segment] = segmentLocation;
+        markInodeDirty( directory );
+    }
+
+    unsigned long oldBucketLocation = private_bucketLocation( directoryFile, oldBucketNumber );
+    unsigned long newBucketLocation = private_bucketLocation( directoryFile, newBucketNumber );
+
+    // gather every entry of the old bucket's chain, keeping its overflow
+    // blocks around to be reused by the two new chains
+    unsigned int entryCapacity = directory_entriesPerBucket;
+    unsigned int entryCount = 0;
+    hashEntry* entries = malloc( entryCapacity * sizeof( hashEntry ) );
+    int spareCapacity = 4;
+    int spareCount = 0;
+    unsigned long* spareBlocks = malloc( spareCapacity * sizeof( unsigned long ) );
+    hashBucket* bucket = calloc( directory_mallocSize, 1 );
+    unsigned long bucketLocation = oldBucketLocation;
+
+    while( bucketLocation != 0 ) {
+        volumeRead( (void*)bucket, directory_lbaSize, bucketLocation );
+        if( bucketLocation != oldBucketLocation ) {
+            if( spareCount == spareCapacity ) {
+                spareCapacity = spareCapacity * 2;
+                spareBlocks = realloc( spareBlocks, spareCapacity * sizeof( unsigned long ) );
+            }
+            spareBlocks[spareCount++] = bucketLocation;
+        }
+        if( entryCount + bucket->count > entryCapacity ) {
+            entryCapacity = ( entryCount + bucket->count ) * 2;
+            entries = realloc( entries, entryCapacity * sizeof( hashEntry ) );
+        }
+        memcpy( entries + entryCount, bucket->entries, bucket->count * sizeof( hashEntry ) );
+        entryCount += bucket->count;
+        bucketLocation = bucket->overflow;
+    }
+
+    // entries keep their order, the ones that now hash to the new bucket
+    // are moved to the back
+    unsigned long newBit = 1UL << directoryFile->hashLevel;
+    hashEntry* movedEntries = malloc( ( entryCount + 1 ) * sizeof( hashEntry ) );
+    unsigned int keptCount = 0;
+    unsigned int movedCount = 0;
+    for( unsigned int i = 0; i < entryCount; i++ ) {
+        if( entries[i].nameHash & newBit ) {
+            movedEntries[movedCount++] = entries[i];
+        }
+        else {
+            entries[keptCount++] = entries[i];
+        }
+    }
+
+    private_writeBucketEntries( oldBucketLocation, entries, keptCount, spareBlocks, &spareCount );
+    private_writeBucketEntries( newBucketLocation, movedEntries, movedCount, spareBlocks, &spareCount );
+
+    for( int i = 0; i < spareCount; i++ ) {
+        delete( spareBlocks[i], directory_lbaSize );
+    }
+
+    directoryFile->hashSplit++;
+    if( directoryFile->hashSplit == ( 1UL << directoryFile->hashLevel ) ) {
+        directoryFile->hashLevel++;
+        directoryFile->hashSplit = 0;
+    }
+    markInodeDirty( directory );
+
+    free( entries );
+    free( movedEntries );
+    free( spareBlocks );
+    free( bucket );
+}
+
+/* Writes the entries as a bucket chain starting at bucketLocation. Overflow
+ * blocks are taken from the spare blocks left over from the split. */
+void private_writeBucketEntries( unsigned long bucketLocation, hashEntry* entries, unsigned int count,
+                                 unsigned long* spareBlocks, int* spareCount ) {
+    hashBucket* bucket = calloc( directory_mallocSize, 1 );
+    unsigned int written = 0;
+
+    do {
+        unsigned int blockCount = count - written;
+        if( blockCount > directory_entriesPerBucket ) {
+            blockCount = directory_entriesPerBucket;
+        }
+
+        private_initializeBucket( bucket );
+        memcpy( bucket->entries, entries + written, blockCount * sizeof( hashEntry ) );
+        bucket->count = blockCount;
+        written += blockCount;
+
+        unsigned long nextLocation = 0;
+        if( written < count ) {
+            ( *spareCount )--;
+            nextLocation = spareBlocks[*spareCount];
+        }
+        bucket->overflow = nextLocation;
+
+        volumeWrite( (void*)bucket, directory_lbaSize, bucketLocation );
+        bucketLocation = nextLocation;
+    } while( written < count );
+
+    free( bucket );
+}
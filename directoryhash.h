@@ -0,0 +1,19 @@
+#ifndef DIRECTORY_HASH_H
+#define DIRECTORY_HASH_H
+
+#include "systemstructs.h"
+#include "inode.h"
+#include "directory.h"
+
+unsigned int hashFileName( char* fileName );
+int insertHashEntry( inodeHandle* directory, char* fileName, unsigned long childLocation, directoryPosition* position );
+unsigned int insertHashEntries( inodeHandle* directory, directoryEntry* entries, unsigned int count,
+                                directoryPosition* positions );
+unsigned long findHashEntry( inodeHandle* directory, char* fileName, directoryEntry* entry, directoryPosition* position,
+                             hashBucket* bucket, directoryBlock* block );
+int removeHashEntry( inodeHandle* directory, char* fileName, unsigned long childLocation, directoryPosition* position );
+int moveHashEntry( inodeHandle* directory, char* fileName, unsigned long childLocation, directoryPosition* position );
+int freeHashIndex( inodeHandle* directory );
+int isValidHashBucket( hashBucket* hashBucketToCheck );
+
+#endif /* DIRECTORY_HASH_H end guard */
@@ -0,0 +1,768 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fsLow.h"
+#include "systemstructs.h"
+#include "filesystem.h"
+#include "inode.h"
+#include "extent.h"
+#include "refcount.h"
+
+extent* private_lastExtent( file* inode, extentBlock* block );
+void private_initializeExtentBlock( extentBlock* block, unsigned long prev );
+unsigned long private_allocateRun( unsigned long wanted, unsigned long* allocated );
+unsigned long private_nextBlockOfKind( inodeHandle* handle, unsigned long fileBlock, int wantHole );
+int private_rebuildExtents( inodeHandle* handle, extent* extents, unsigned int count, unsigned int firstChanged );
+int private_loadExtentBlock( extentIterator* iterator, unsigned long blockLocation );
+int private_loadExtentMap( extentIterator* iterator );
+void private_forgetExtentMap( inodeHandle* handle );
+
+/* Adds blockCount blocks starting at blockLocation to the end of the file's
+ * data, or a hole of blockCount blocks if blockLocation is 0. If they follow
+ * straight on from the last extent that extent just grows, otherwise a new
+ * extent is added. The caller puts the handle, which writes the updated
+ * header.
+ * Returns 0 if successful, -1 if no space was left for an extent block. */
+int appendExtent( inodeHandle* handle, unsigned long blockLocation, unsigned long blockCount ) {
+    file* inode = handle->inode;
+    extentBlock* block = calloc( extent_mallocSize, 1 );
+
+    if( inode->extentCount > 0 ) {
+        extent* lastExtent = private_lastExtent( inode, block );
+        int isContinued = ( blockLocation == 0 ) ?
+            isHole( lastExtent ) :
+            !isHole( lastExtent ) && lastExtent->startBlock + lastExtent->count == blockLocation;
+        if( isContinued ) {
+            lastExtent->count += blockCount;
+            if( inode->extentCount > INLINE_EXTENTS ) {
+                volumeWrite( (void*)block, extent_lbaSize, inode->lastExtentBlock );
+            }
+            inode->blockCount += blockCount;
+            markInodeDirty( handle );
+            free( block );
+            return 0;
+        }
+    }
+
+    if( inode->extentCount < INLINE_EXTENTS ) {
+        inode->extents[inode->extentCount].startBlock = blockLocation;
+        inode->extents[inode->extentCount].count = blockCount;
+    }
+    else {
+        unsigned int slot = ( inode->extentCount - INLINE_EXTENTS ) % extent_extentsPerBlock;
+
+        // the last block is full (or there is none yet), chain on a new one
+        if( slot == 0 ) {
+            unsigned long newBlockLocation = getFreeBlocks( extent_lbaSize );
+            if( newBlockLocation == 0 ) {
+                free( block );
+                return -1;
+            }
+
+            if( inode->lastExtentBlock != 0 ) {
+                volumeRead( (void*)block, extent_lbaSize, inode->lastExtentBlock );
+                block->next = newBlockLocation;
+                volumeWrite( (void*)block, extent_lbaSize, inode->lastExtentBlock );
+            }
+            else {
+                inode->firstExtentBlock = newBlockLocation;
+            }
+
+            private_initializeExtentBlock( block, inode->lastExtentBlock );
+            inode->lastExtentBlock = newBlockLocation;
+
+            if( handle->extentMap != NULL ) {
+                handle->extentMap = realloc( handle->extentMap,
+                    ( handle->extentMapCount + 1 ) * sizeof( extentBlockPosition ) );
+                handle->extentMap[handle->extentMapCount].blockLocation = newBlockLocation;
+                handle->extentMap[handle->extentMapCount].fileBlock = inode->blockCount;
+                handle->extentMapCount++;
+            }
+        }
+        else {
+            volumeRead( (void*)block, extent_lbaSize, inode->lastExtentBlock );
+        }
+
+        block->extents[slot].startBlock = blockLocation;
+        block->extents[slot].count = blockCount;
+        block->count++;
+        volumeWrite( (void*)block, extent_lbaSize, inode->lastExtentBlock );
+    }
+
+    inode->extentCount++;
+    inode->blockCount += blockCount;
+    markInodeDirty( handle );
+
+    free( block );
+    return 0;
+}
+
+/* Grows the file by blockCount data blocks. One contiguous run is tried
+ * first; if the free list has no run that big the request is split in
+ * halves, so a file can still grow on a fragmented volume.
+ * Returns 0 if successful, -1 if the volume is out of space, in which case
+ * the file is left at its old size. */
+int allocateExtents( inodeHandle* handle, unsigned long blockCount ) {
+    unsigned long oldBlockCount = handle->inode->blockCount;
+    unsigned long remaining = blockCount;
+
+    while( remaining > 0 ) {
+        unsigned long allocated;
+        unsigned long blockLocation = private_allocateRun( remaining, &allocated );
+        if( blockLocation == 0 ) {
+            truncateExtents( handle, oldBlockCount );
+            return -1;
+        }
+
+        if( appendExtent( handle, blockLocation, allocated ) != 0 ) {
+            delete( blockLocation, allocated );
+            truncateExtents( handle, oldBlockCount );
+            return -1;
+        }
+        remaining -= allocated;
+    }
+
+    return 0;
+}
+
+/* Makes fileBlock to fileBlock + blockCount safe to write in place. Parts
+ * of the range that are holes get blocks, and data shared with another
+ * file is moved to blocks of this file's own. The new blocks hold whatever
+ * was on the volume, so the caller has to overwrite them, except that with
+ * partialEnds set a new block at either end of the range is zeroed, or
+ * given the shared block's data, for writes that only cover part of it.
+ * Returns 0 if successful, -1 if the volume is out of space, in which case
+ * the file is unchanged. */
+int makeBlocksWritable( inodeHandle* handle, unsigned long fileBlock, unsigned long blockCount, int partialEnds ) {
+    unsigned long endBlock = fileBlock + blockCount;
+    int needsBlocks = 0;
+
+    // usually the range is already the file's own, which only takes a look
+    // at the extents holding it
+    extentIterator* iterator = openExtents( handle );
+    extent* currentExtent;
+    seekExtents( iterator, fileBlock );
+    while( !needsBlocks && ( currentExtent = nextExtent( iterator ) ) != NULL &&
+           iterator->fileBlock < endBlock ) {
+        unsigned long overlapStart = iterator->fileBlock > fileBlock ? iterator->fileBlock : fileBlock;
+        unsigned long overlapEnd = iterator->fileBlock + currentExtent->count;
+        if( overlapEnd > endBlock ) {
+            overlapEnd = endBlock;
+        }
+        if( isHole( currentExtent ) ||
+            hasSharedBlocks( currentExtent->startBlock + overlapStart - iterator->fileBlock,
+                             overlapEnd - overlapStart ) ) {
+            needsBlocks = 1;
+        }
+    }
+    closeExtents( iterator );
+
+    if( !needsBlocks ) {
+        return 0;
+    }
+
+    unsigned int count = 0;
+    extent* extents = malloc( ( handle->inode->extentCount + 1 ) * sizeof( extent ) );
+    iterator = openExtents( handle );
+    while( ( currentExtent = nextExtent( iterator ) ) != NULL ) {
+        extents[count++] = *currentExtent;
+    }
+    closeExtents( iterator );
+
+    // every hole or shared extent in the range is split into the part
+    // before the range, newly allocated runs and the part after it. The
+    // extents before the first one split are left where they are.
+    unsigned int newCapacity = count + 8;
+    unsigned int newCount = 0;
+    unsigned int firstChanged = count;
+    extent* newExtents = malloc( newCapacity * sizeof( extent ) );
+    unsigned int replacedCount = 0;
+    extent* replaced = malloc( ( count + 1 ) * sizeof( extent ) );
+    unsigned long currentBlock = 0;
+    int returnValue = 0;
+    char* blockBuffer = malloc( mainSystemInfo->lbaSize );
+
+    for( unsigned int i = 0; i < count && returnValue == 0; i++ ) {
+        unsigned long extentStart = currentBlock;
+        unsigned long extentEnd = currentBlock + extents[i].count;
+        currentBlock = extentEnd;
+
+        unsigned long fillStart = extentStart > fileBlock ? extentStart : fileBlock;
+        unsigned long fillEnd = extentEnd < endBlock ? extentEnd : endBlock;
+        int isData = !isHole( extents + i );
+        unsigned long oldStart = extents[i].startBlock + fillStart - extentStart;
+
+        if( extentEnd <= fileBlock || extentStart >= endBlock ||
+            ( isData && !hasSharedBlocks( oldStart, fillEnd - fillStart ) ) ) {
+            newExtents[newCount++] = extents[i];
+        }
+        else {
+            if( firstChanged == count ) {
+                firstChanged = i;
+            }
+            if( fillStart > extentStart ) {
+                newExtents[newCount].startBlock = isData ? extents[i].startBlock : 0;
+                newExtents[newCount++].count = fillStart - extentStart;
+            }
+
+            unsigned long position = fillStart;
+            while( position < fillEnd ) {
+                unsigned long allocated;
+                unsigned long blockLocation = private_allocateRun( fillEnd - position, &allocated );
+                if( blockLocation == 0 ) {
+                    returnValue = -1;
+                    break;
+                }
+
+                // the ends take the old contents, zeros for a hole
+                if( partialEnds && position == fileBlock ) {
+                    if( isData ) {
+                        volumeRead( (void*)blockBuffer, 1, oldStart + position - fillStart );
+                    }
+                    else {
+                        memset( (void*)blockBuffer, 0, mainSystemInfo->lbaSize );
+                    }
+                    volumeWrite( (void*)blockBuffer, 1, blockLocation );
+                }
+                if( partialEnds && position + allocated == endBlock ) {
+                    if( isData ) {
+                        volumeRead( (void*)blockBuffer, 1, oldStart + endBlock - 1 - fillStart );
+                    }
+                    else {
+                        memset( (void*)blockBuffer, 0, mainSystemInfo->lbaSize );
+                    }
+                    volumeWrite( (void*)blockBuffer, 1, blockLocation + allocated - 1 );
+                }
+
+                if( newCount + 2 >= newCapacity ) {
+                    newCapacity *= 2;
+                    newExtents = realloc( newExtents, newCapacity * sizeof( extent ) );
+                }
+                newExtents[newCount].startBlock = blockLocation;
+                newExtents[newCount++].count = allocated;
+                position += allocated;
+            }
+
+            if( returnValue == 0 && extentEnd > fillEnd ) {
+                newExtents[newCount].startBlock = isData ? oldStart + fillEnd - fillStart : 0;
+                newExtents[newCount++].count = extentEnd - fillEnd;
+            }
+            if( isData ) {
+                replaced[replacedCount].startBlock = oldStart;
+                replaced[replacedCount++].count = fillEnd - fillStart;
+            }
+        }
+
+        if( newCount + 2 >= newCapacity ) {
+            newCapacity *= 2;
+            newExtents = realloc( newExtents, newCapacity * sizeof( extent ) );
+        }
+    }
+
+    if( returnValue == 0 ) {
+        // neighbours that ended up contiguous are joined, as appendExtent()
+        // would have done
+        extent* joined = malloc( newCount * sizeof( extent ) );
+        unsigned int joinedCount = 0;
+        for( unsigned int i = 0; i < newCount; i++ ) {
+            extent* previous = joinedCount > 0 ? joined + joinedCount - 1 : NULL;
+            if( joinedCount > 0 &&
+                ( isHole( newExtents + i ) ? isHole( previous ) :
+                  !isHole( previous ) && previous->startBlock + previous->count == newExtents[i].startBlock ) ) {
+                previous->count += newExtents[i].count;
+                if( joinedCount - 1 < firstChanged ) {
+                    firstChanged = joinedCount - 1;
+                }
+            }
+            else {
+                joined[joinedCount++] = newExtents[i];
+            }
+        }
+        returnValue = private_rebuildExtents( handle, joined, joinedCount, firstChanged );
+        free( joined );
+    }
+
+    if( returnValue == 0 ) {
+        // this file no longer uses the shared blocks it had in the range
+        for( unsigned int i = 0; i < replacedCount; i++ ) {
+            releaseBlocks( replaced[i].startBlock, replaced[i].count );
+        }
+    }
+    else {
+        // the extent list is untouched, give back what was allocated before
+        // running out, which is every data extent that was not in the file
+        // before
+        for( unsigned int i = 0; i < newCount; i++ ) {
+            int isNew = !isHole( newExtents + i );
+            for( unsigned int j = 0; j < count && isNew; j++ ) {
+                if( !isHole( extents + j ) &&
+                    newExtents[i].startBlock >= extents[j].startBlock &&
+                    newExtents[i].startBlock < extents[j].startBlock + extents[j].count ) {
+                    isNew = 0;
+                }
+            }
+            if( isNew ) {
+                delete( newExtents[i].startBlock, newExtents[i].count );
+            }
+        }
+    }
+
+    free( blockBuffer );
+    free( replaced );
+    free( newExtents );
+    free( extents );
+    return returnValue;
+}
+
+/* Gives the file at dest the same data as the file at source by sharing
+ * source's blocks rather than copying them. dest must have no data yet.
+ * A later write to either file moves the blocks it touches, see
+ * makeBlocksWritable().
+ * Returns 0 if successful, -1 if a block has too many sharers or there was
+ * no space for dest's extent list, in which case dest is left empty. */
+int cloneExtents( inodeHandle* source, inodeHandle* dest ) {
+    int returnValue = 0;
+    extentIterator* iterator = openExtents( source );
+    extent* currentExtent;
+
+    while( ( currentExtent = nextExtent( iterator ) ) != NULL ) {
+        if( !isHole( currentExtent ) &&
+            shareBlocks( currentExtent->startBlock, currentExtent->count ) != 0 ) {
+            returnValue = -1;
+            break;
+        }
+        if( appendExtent( dest, currentExtent->startBlock, currentExtent->count ) != 0 ) {
+            if( !isHole( currentExtent ) ) {
+                releaseBlocks( currentExtent->startBlock, currentExtent->count );
+            }
+            returnValue = -1;
+            break;
+        }
+    }
+    closeExtents( iterator );
+
+    if( returnValue != 0 ) {
+        truncateExtents( dest, 0 );
+    }
+    return returnValue;
+}
+
+/* Shrinks the file's data to its first blockCount blocks, giving the rest
+ * back to the free list unless another file still shares them. Only the
+ * extents being dropped are touched. */
+int truncateExtents( inodeHandle* handle, unsigned long blockCount ) {
+    file* inode = handle->inode;
+    extentBlock* block = calloc( extent_mallocSize, 1 );
+    beginFreeBatch();
+
+    while( inode->blockCount > blockCount ) {
+        extent* lastExtent = private_lastExtent( inode, block );
+        int isInBlock = inode->extentCount > INLINE_EXTENTS;
+        unsigned long excess = inode->blockCount - blockCount;
+
+        if( lastExtent->count > excess ) {
+            // only the tail of the last extent goes
+            if( !isHole( lastExtent ) ) {
+                releaseBlocks( lastExtent->startBlock + lastExtent->count - excess, excess );
+            }
+            lastExtent->count -= excess;
+            inode->blockCount = blockCount;
+            if( isInBlock ) {
+                volumeWrite( (void*)block, extent_lbaSize, inode->lastExtentBlock );
+            }
+        }
+        else {
+            if( !isHole( lastExtent ) ) {
+                releaseBlocks( lastExtent->startBlock, lastExtent->count );
+            }
+            inode->blockCount -= lastExtent->count;
+            memset( (void*)lastExtent, 0, sizeof( extent ) );
+            inode->extentCount--;
+
+            if( isInBlock ) {
+                block->count--;
+                if( block->count == 0 ) {
+                    unsigned long previousLocation = block->prev;
+                    private_forgetExtentMap( handle );
+                    delete( inode->lastExtentBlock, extent_lbaSize );
+                    inode->lastExtentBlock = previousLocation;
+
+                    if( previousLocation == 0 ) {
+                        inode->firstExtentBlock = 0;
+                    }
+                    else {
+                        volumeRead( (void*)block, extent_lbaSize, previousLocation );
+                        block->next = 0;
+                        volumeWrite( (void*)block, extent_lbaSize, previousLocation );
+                    }
+                }
+                else {
+                    volumeWrite( (void*)block, extent_lbaSize, inode->lastExtentBlock );
+                }
+            }
+        }
+
+        markInodeDirty( handle );
+    }
+
+    endFreeBatch();
+    free( block );
+    return 0;
+}
+
+/* Gives all of the file's data blocks and extent blocks back to the free
+ * list */
+int freeExtents( inodeHandle* handle ) {
+    return truncateExtents( handle, 0 );
+}
+
+/* Maps a block of the file to where it is on the volume.
+ * Returns 0 if the file has no such block or it is in a hole. */
+unsigned long getVolumeBlock( inodeHandle* handle, unsigned long fileBlock ) {
+    unsigned long volumeBlock = 0;
+    extentIterator* iterator = openExtents( handle );
+    seekExtents( iterator, fileBlock );
+
+    extent* currentExtent = nextExtent( iterator );
+    if( currentExtent != NULL && !isHole( currentExtent ) ) {
+        volumeBlock = currentExtent->startBlock + ( fileBlock - iterator->fileBlock );
+    }
+
+    closeExtents( iterator );
+    return volumeBlock;
+}
+
+/* Returns the first block at or after fileBlock that holds data, or the
+ * file's block count if there is none */
+unsigned long nextDataBlock( inodeHandle* handle, unsigned long fileBlock ) {
+    return private_nextBlockOfKind( handle, fileBlock, 0 );
+}
+
+/* Returns the first block at or after fileBlock that is in a hole, or the
+ * file's block count if there is none */
+unsigned long nextHoleBlock( inodeHandle* handle, unsigned long fileBlock ) {
+    return private_nextBlockOfKind( handle, fileBlock, 1 );
+}
+
+/* A hole is a run of blocks that reads as zeros but has nothing on the
+ * volume. Block 0 holds the system info, so it can never be file data. */
+int isHole( extent* extentToCheck ) {
+    return extentToCheck->startBlock == 0;
+}
+
+/* Starts a walk over the file's extents. Call nextExtent() until it
+ * returns NULL, then closeExtents(). */
+extentIterator* openExtents( inodeHandle* handle ) {
+    extentIterator* iterator = malloc( sizeof( extentIterator ) );
+    iterator->handle = handle;
+    iterator->inode = handle->inode;
+    iterator->index = 0;
+    iterator->fileBlock = 0;
+    iterator->nextFileBlock = 0;
+    iterator->blockLocation = 0;
+    iterator->blockStart = 0;
+    iterator->block = calloc( extent_mallocSize, 1 );
+    return iterator;
+}
+
+/* Moves the iterator so the next call to nextExtent() returns the extent
+ * holding fileBlock, or NULL if the file is shorter. The handle keeps a
+ * map of the extent block chain, loaded the first time it is needed, so
+ * finding the extent reads one extent block however long the chain is. */
+void seekExtents( extentIterator* iterator, unsigned long fileBlock ) {
+    inodeHandle* handle = iterator->handle;
+    file* inode = iterator->inode;
+
+    iterator->index = 0;
+    iterator->nextFileBlock = 0;
+    while( iterator->index < inode->extentCount && iterator->index < INLINE_EXTENTS ) {
+        if( fileBlock < iterator->nextFileBlock + inode->extents[iterator->index].count ) {
+            return;
+        }
+        iterator->nextFileBlock += inode->extents[iterator->index].count;
+        iterator->index++;
+    }
+    if( iterator->index >= inode->extentCount ) {
+        return;
+    }
+
+    if( handle->extentMap == NULL && private_loadExtentMap( iterator ) != 0 ) {
+        return;
+    }
+
+    // the last block starting at or before fileBlock
+    unsigned int low = 0;
+    unsigned int high = handle->extentMapCount - 1;
+    while( low < high ) {
+        unsigned int middle = ( low + high + 1 ) / 2;
+        if( handle->extentMap[middle].fileBlock <= fileBlock ) {
+            low = middle;
+        }
+        else {
+            high = middle - 1;
+        }
+    }
+
+    iterator->index = INLINE_EXTENTS + low * extent_extentsPerBlock;
+    iterator->nextFileBlock = handle->extentMap[low].fileBlock;
+    if( private_loadExtentBlock( iterator, handle->extentMap[low].blockLocation ) != 0 ) {
+        return;
+    }
+    for( unsigned int slot = 0; slot < iterator->block->count; slot++ ) {
+        if( fileBlock < iterator->nextFileBlock + iterator->block->extents[slot].count ) {
+            break;
+        }
+        iterator->nextFileBlock += iterator->block->extents[slot].count;
+        iterator->index++;
+    }
+}
+
+/* Returns the next extent, or NULL once every extent has been returned.
+ * The extent is only good until the next call. */
+extent* nextExtent( extentIterator* iterator ) {
+    file* inode = iterator->inode;
+    extent* currentExtent;
+
+    if( iterator->index >= inode->extentCount ) {
+        return NULL;
+    }
+
+    if( iterator->index < INLINE_EXTENTS ) {
+        currentExtent = inode->extents + iterator->index;
+    }
+    else {
+        unsigned int slot = ( iterator->index - INLINE_EXTENTS ) % extent_extentsPerBlock;
+        if( slot == 0 && iterator->blockStart != iterator->index ) {
+            unsigned long blockLocation = ( iterator->blockLocation == 0 ) ?
+                inode->firstExtentBlock : iterator->block->next;
+            if( private_loadExtentBlock( iterator, blockLocation ) != 0 ) {
+                return NULL;
+            }
+        }
+        currentExtent = iterator->block->extents + slot;
+    }
+
+    iterator->index++;
+    iterator->fileBlock = iterator->nextFileBlock;
+    iterator->nextFileBlock += currentExtent->count;
+    return currentExtent;
+}
+
+void closeExtents( extentIterator* iterator ) {
+    free( iterator->block );
+    free( iterator );
+}
+
+int isValidExtentBlock( extentBlock* extentBlockToCheck ) {
+    return ( extentBlockToCheck->signature1 == EXTENTSIGNATURE1 ) &&
+           ( extentBlockToCheck->signature2 == EXTENTSIGNATURE2 );
+}
+
+/* Returns the file's last extent. If it is in the extent chain the last
+ * extent block is read into block, and the caller writes it back after
+ * changing the extent. */
+extent* private_lastExtent( file* inode, extentBlock* block ) {
+    unsigned int index = inode->extentCount - 1;
+
+    if( index < INLINE_EXTENTS ) {
+        return inode->extents + index;
+    }
+
+    volumeRead( (void*)block, extent_lbaSize, inode->lastExtentBlock );
+    return block->extents + ( ( index - INLINE_EXTENTS ) % extent_extentsPerBlock );
+}
+
+unsigned long private_nextBlockOfKind( inodeHandle* handle, unsigned long fileBlock, int wantHole ) {
+    unsigned long foundBlock = handle->inode->blockCount;
+    extentIterator* iterator = openExtents( handle );
+    extent* currentExtent;
+    seekExtents( iterator, fileBlock );
+
+    while( ( currentExtent = nextExtent( iterator ) ) != NULL ) {
+        if( iterator->fileBlock + currentExtent->count > fileBlock &&
+            isHole( currentExtent ) == wantHole ) {
+            foundBlock = iterator->fileBlock > fileBlock ? iterator->fileBlock : fileBlock;
+            break;
+        }
+    }
+
+    closeExtents( iterator );
+    return foundBlock;
+}
+
+/* Takes up to wanted free blocks in one run. If the free list has no run
+ * that big the request is halved until it fits, so it can still be met
+ * piece by piece on a fragmented volume.
+ * Returns the run's location and sets allocated, or returns 0 if there
+ * are no free blocks left. */
+unsigned long private_allocateRun( unsigned long wanted, unsigned long* allocated ) {
+    unsigned long blockLocation;
+
+    while( ( blockLocation = getFreeBlocks( wanted ) ) == 0 ) {
+        if( wanted == 1 ) {
+            return 0;
+        }
+        wanted = ( wanted + 1 ) / 2;
+    }
+
+    *allocated = wanted;
+    return blockLocation;
+}
+
+/* Replaces the file's extent list with extents, which has to be the same
+ * as the old list up to firstChanged. The chain
+ * blocks from the one holding firstChanged on are rewritten into new
+ * blocks, which are only linked in once all of them could be allocated.
+ * Only the old extent blocks are given back, the data blocks are carried
+ * over by the new list.
+ * Returns 0 if successful, -1 if no space was left for the extent blocks,
+ * in which case the file is unchanged. */
+int private_rebuildExtents( inodeHandle* handle, extent* extents, unsigned int count, unsigned int firstChanged ) {
+    file* inode = handle->inode;
+    unsigned int keptBlocks = firstChanged > INLINE_EXTENTS ?
+        ( firstChanged - INLINE_EXTENTS ) / extent_extentsPerBlock : 0;
+    unsigned int oldBlocks = inode->extentCount > INLINE_EXTENTS ?
+        ( inode->extentCount - INLINE_EXTENTS + extent_extentsPerBlock - 1 ) / extent_extentsPerBlock : 0;
+    unsigned int neededBlocks = count > INLINE_EXTENTS ?
+        ( count - INLINE_EXTENTS + extent_extentsPerBlock - 1 ) / extent_extentsPerBlock : 0;
+    unsigned int replacedCount = oldBlocks - keptBlocks;
+    unsigned int newBlockCount = neededBlocks - keptBlocks;
+    unsigned long* replaced = malloc( ( replacedCount + 1 ) * sizeof( unsigned long ) );
+    unsigned long* newBlocks = malloc( ( newBlockCount + 1 ) * sizeof( unsigned long ) );
+    extentBlock* block = calloc( extent_mallocSize, 1 );
+
+    for( unsigned int i = 0; i < newBlockCount; i++ ) {
+        newBlocks[i] = getFreeBlocks( extent_lbaSize );
+        if( newBlocks[i] == 0 ) {
+            printf( "ERROR: NO SPACE LEFT FOR THE FILE'S EXTENT LIST\n" );
+            while( i > 0 ) {
+                delete( newBlocks[--i], extent_lbaSize );
+            }
+            free( block );
+            free( newBlocks );
+            free( replaced );
+            return -1;
+        }
+    }
+
+    // the blocks being replaced are the last ones of the chain, walk back
+    // to the last one that is kept
+    unsigned long keptLocation = inode->lastExtentBlock;
+    for( unsigned int i = replacedCount; i > 0; i-- ) {
+        replaced[i - 1] = keptLocation;
+        volumeRead( (void*)block, extent_lbaSize, keptLocation );
+        keptLocation = block->prev;
+    }
+
+    for( unsigned int i = 0; i < newBlockCount; i++ ) {
+        unsigned int first = INLINE_EXTENTS + ( keptBlocks + i ) * extent_extentsPerBlock;
+        private_initializeExtentBlock( block, i == 0 ? keptLocation : newBlocks[i - 1] );
+        block->next = ( i + 1 < newBlockCount ) ? newBlocks[i + 1] : 0;
+        while( first + block->count < count && block->count < extent_extentsPerBlock ) {
+            block->extents[block->count] = extents[first + block->count];
+            block->count++;
+        }
+        volumeWrite( (void*)block, extent_lbaSize, newBlocks[i] );
+    }
+
+    // link the new blocks in after the kept ones
+    unsigned long firstNewBlock = newBlockCount > 0 ? newBlocks[0] : 0;
+    if( keptLocation != 0 ) {
+        volumeRead( (void*)block, extent_lbaSize, keptLocation );
+        block->next = firstNewBlock;
+        volumeWrite( (void*)block, extent_lbaSize, keptLocation );
+    }
+    else {
+        inode->firstExtentBlock = firstNewBlock;
+    }
+    inode->lastExtentBlock = newBlockCount > 0 ? newBlocks[newBlockCount - 1] : keptLocation;
+
+    for( unsigned int i = firstChanged; i < INLINE_EXTENTS; i++ ) {
+        if( i < count ) {
+            inode->extents[i] = extents[i];
+        }
+        else {
+            memset( (void*)( inode->extents + i ), 0, sizeof( extent ) );
+        }
+    }
+    inode->extentCount = count;
+    markInodeDirty( handle );
+
+    private_forgetExtentMap( handle );
+    for( unsigned int i = 0; i < replacedCount; i++ ) {
+        delete( replaced[i], extent_lbaSize );
+    }
+
+    free( block );
+    free( newBlocks );
+    free( replaced );
+    return 0;
+}
+
+/* Reads the extent block at blockLocation into the iterator as the block
+ * starting at its current index. Returns 0 if successful, -1 if it isn't
+ * an extent block, in which case the iteration ends. */
+int private_loadExtentBlock( extentIterator* iterator, unsigned long blockLocation ) {
+    volumeRead( (void*)iterator->block, extent_lbaSize, blockLocation );
+    if( !isValidExtentBlock( iterator->block ) ) {
+        printf( "WARNING EXTENT CHAIN POINTS TO A BLOCK THAT IS\n"
+                "NOT AN EXTENT BLOCK\n" );
+        iterator->index = iterator->inode->extentCount;
+        return -1;
+    }
+    iterator->blockLocation = blockLocation;
+    iterator->blockStart = iterator->index;
+    return 0;
+}
+
+/* Walks the extent block chain once to fill in the handle's map of it.
+ * Returns 0 if successful, -1 if the chain is broken, in which case the
+ * iteration ends. */
+int private_loadExtentMap( extentIterator* iterator ) {
+    inodeHandle* handle = iterator->handle;
+    file* inode = handle->inode;
+    unsigned int blockCount = ( inode->extentCount - INLINE_EXTENTS + extent_extentsPerBlock - 1 ) /
+                              extent_extentsPerBlock;
+    extentBlockPosition* map = malloc( blockCount * sizeof( extentBlockPosition ) );
+    unsigned long blockLocation = inode->firstExtentBlock;
+    unsigned long fileBlock = 0;
+
+    for( unsigned int i = 0; i < INLINE_EXTENTS; i++ ) {
+        fileBlock += inode->extents[i].count;
+    }
+    for( unsigned int i = 0; i < blockCount; i++ ) {
+        if( private_loadExtentBlock( iterator, blockLocation ) != 0 ) {
+            free( map );
+            return -1;
+        }
+        map[i].blockLocation = blockLocation;
+        map[i].fileBlock = fileBlock;
+        for( unsigned int slot = 0; slot < iterator->block->count; slot++ ) {
+            fileBlock += iterator->block->extents[slot].count;
+        }
+        blockLocation = iterator->block->next;
+    }
+
+    handle->extentMap = map;
+    handle->extentMapCount = blockCount;
+    return 0;
+}
+
+/* Drops the handle's map of the extent chain, for when blocks of the chain
+ * are replaced or given back. The next seek loads it again. */
+void private_forgetExtentMap( inodeHandle* handle ) {
+    free( handle->extentMap );
+    handle->extentMap = NULL;
+    handle->extentMapCount = 0;
+}
+
+/* Clears the block and sets it up as the new last block of a chain */
+void private_initializeExtentBlock( extentBlock* block, unsigned long prev ) {
+    memset( (void*)block, 0, extent_mallocSize );
+    block->signature1 = EXTENTSIGNATURE1;
+    block->signature2 = EXTENTSIGNATURE2;
+    block->prev = prev;
+    block->next = 0;
+    block->count = 0;
+}
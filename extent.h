@@ -0,0 +1,37 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include "systemstructs.h"
+#include "inode.h"
+
+/* Walks the extents of a file in order, first the ones in the header and
+ * then the extent block chain. fileBlock is the block of the file that the
+ * last returned extent starts at. */
+typedef struct extentIterator {
+    inodeHandle* handle;
+    file* inode;
+    unsigned int index;
+    unsigned long fileBlock;
+    unsigned long nextFileBlock;
+    unsigned long blockLocation;
+    unsigned int blockStart;      // index of the first extent in block
+    extentBlock* block;
+} extentIterator;
+
+int appendExtent( inodeHandle* handle, unsigned long blockLocation, unsigned long blockCount );
+int allocateExtents( inodeHandle* handle, unsigned long blockCount );
+int makeBlocksWritable( inodeHandle* handle, unsigned long fileBlock, unsigned long blockCount, int partialEnds );
+int cloneExtents( inodeHandle* source, inodeHandle* dest );
+int truncateExtents( inodeHandle* handle, unsigned long blockCount );
+int freeExtents( inodeHandle* handle );
+unsigned long getVolumeBlock( inodeHandle* handle, unsigned long fileBlock );
+unsigned long nextDataBlock( inodeHandle* handle, unsigned long fileBlock );
+unsigned long nextHoleBlock( inodeHandle* handle, unsigned long fileBlock );
+int isHole( extent* extentToCheck );
+extentIterator* openExtents( inodeHandle* handle );
+void seekExtents( extentIterator* iterator, unsigned long fileBlock );
+extent* nextExtent( extentIterator* iterator );
+void closeExtents( extentIterator* iterator );
+int isValidExtentBlock( extentBlock* extentBlockToCheck );
+
+#endif /* EXTENT_H end guard */
@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "systemstructs.h"
+#include "filesystem.h"
+#include "inode.h"
+#include "filehandle.h"
+#include "orphan.h"
+
+/* The open file table. A file descriptor is an index into it, and an entry
+ * with no handle is free. */
+openFileEntry openFileTable[MAX_OPEN_FILES];
+
+int private_openLocation( unsigned long blockLocation, int flags );
+openFileEntry* private_getOpenFile( int fileDescriptor );
+unsigned long private_bufferSize();
+unsigned long private_openFileSize( openFileEntry* entry );
+int private_flushBuffer( openFileEntry* entry );
+int private_fillBuffer( openFileEntry* entry, unsigned long offset );
+long private_writeThrough( openFileEntry* entry, void* buffer, unsigned long offset, unsigned long length );
+
+/* Opens the file at filePath and returns its file descriptor, or -1 if it
+ * can't be opened. OPEN_CREATE makes the file if it doesn't exist,
+ * OPEN_TRUNCATE empties it and OPEN_APPEND makes every write go to the
+ * end. */
+int openFile( char* filePath, int flags ) {
+    return openFileAt( NULL, filePath, flags );
+}
+
+/* Same as openFile() for a path relative to directory, see
+ * getDirectoryEntryAt() */
+int openFileAt( directoryHandle* directory, char* filePath, int flags ) {
+    unsigned long blockLocation = getBlockLocationAt( directory, filePath );
+    if( blockLocation == 0 && ( flags & OPEN_CREATE ) ) {
+        blockLocation = makeFileAt( directory, filePath );
+    }
+    if( blockLocation == 0 ) {
+        printf( "Invalid file path\n" );
+        return -1;
+    }
+
+    return private_openLocation( blockLocation, flags );
+}
+
+/* Opens the file with the given inode number, which stays the same when the
+ * file is moved, without walking a path. Takes the same flags as
+ * openFile() except OPEN_CREATE. */
+int openFileById( unsigned long inodeNumber, int flags ) {
+    unsigned long blockLocation = getBlockLocationFromInodeNumber( inodeNumber );
+    if( blockLocation == 0 ) {
+        printf( "No file with inode number %lu\n", inodeNumber );
+        return -1;
+    }
+
+    return private_openLocation( blockLocation, flags & ~OPEN_CREATE );
+}
+
+/* Reads up to length bytes at the file's position and moves the position
+ * past them. Small reads are served from the buffer, reads of a whole
+ * buffer or more go straight to the volume.
+ * Returns the number of bytes read, 0 at the end of the file, or -1. */
+long readFile( int fileDescriptor, void* buffer, unsigned long length ) {
+    openFileEntry* entry = private_getOpenFile( fileDescriptor );
+    if( entry == NULL ) {
+        return -1;
+    }
+    if( !( entry->flags & OPEN_READ ) ) {
+        printf( "ERROR: FILE NOT OPEN FOR READING\n" );
+        return -1;
+    }
+
+    unsigned long fileSize = private_openFileSize( entry );
+    if( entry->position >= fileSize ) {
+        return 0;
+    }
+    if( length > fileSize - entry->position ) {
+        length = fileSize - entry->position;
+    }
+
+    unsigned long bytesRead = 0;
+    while( bytesRead < length ) {
+        unsigned long remaining = length - bytesRead;
+        char* destination = (char*)buffer + bytesRead;
+
+        if( entry->isBuffered && entry->position >= entry->bufferOffset &&
+            entry->position < entry->bufferOffset + entry->bufferLength ) {
+            unsigned long amount = entry->bufferOffset + entry->bufferLength - entry->position;
+            if( amount > remaining ) {
+                amount = remaining;
+            }
+            memcpy( (void*)destination,
+                    (void*)( entry->buffer + entry->position - entry->bufferOffset ), amount );
+            entry->position += amount;
+            bytesRead += amount;
+        }
+        else if( remaining >= private_bufferSize() ) {
+            // big reads skip the buffer, anything not yet written out has
+            // to reach the volume first
+            if( private_flushBuffer( entry ) != 0 ) {
+                return -1;
+            }
+            long amount = readInodeAt( entry->handle, (void*)destination, entry->position, remaining );
+            if( amount <= 0 ) {
+                break;
+            }
+            entry->position += amount;
+            bytesRead += amount;
+        }
+        else {
+            if( private_fillBuffer( entry, entry->position ) != 0 ) {
+                return -1;
+            }
+            if( entry->position >= entry->bufferOffset + entry->bufferLength ) {
+                break;
+            }
+        }
+    }
+
+    return bytesRead;
+}
+
+/* Writes length bytes at the file's position and moves the position past
+ * them. Small writes collect in the buffer until it moves to another part
+ * of the file or the file is synced or closed.
+ * Returns the number of bytes written or -1. */
+long writeFile( int fileDescriptor, void* buffer, unsigned long length ) {
+    openFileEntry* entry = private_getOpenFile( fileDescriptor );
+    if( entry == NULL ) {
+        return -1;
+    }
+    if( !( entry->flags & OPEN_WRITE ) ) {
+        printf( "ERROR: FILE NOT OPEN FOR WRITING\n" );
+        return -1;
+    }
+
+    if( entry->flags & OPEN_APPEND ) {
+        entry->position = private_openFileSize( entry );
+    }
+
+    unsigned long bufferSize = private_bufferSize();
+    unsigned long bytesWritten = 0;
+    while( bytesWritten < length ) {
+        unsigned long remaining = length - bytesWritten;
+        char* source = (char*)buffer + bytesWritten;
+        int isInWindow = entry->isBuffered && entry->position >= entry->bufferOffset &&
+                         entry->position < entry->bufferOffset + bufferSize;
+
+        if( !isInWindow && remaining >= bufferSize ) {
+            // big writes skip the buffer, which is then out of date
+            if( private_flushBuffer( entry ) != 0 ) {
+                return -1;
+            }
+            entry->isBuffered = 0;
+            if( private_writeThrough( entry, (void*)source, entry->position, remaining ) < 0 ) {
+                return -1;
+            }
+            entry->position += remaining;
+            bytesWritten += remaining;
+            continue;
+        }
+
+        if( !isInWindow && private_fillBuffer( entry, entry->position ) != 0 ) {
+            return -1;
+        }
+
+        unsigned long windowPosition = entry->position - entry->bufferOffset;
+        unsigned long amount = bufferSize - windowPosition;
+        if( amount > remaining ) {
+            amount = remaining;
+        }
+        memcpy( (void*)( entry->buffer + windowPosition ), (void*)source, amount );
+
+        if( entry->dirtyEnd == entry->dirtyStart ) {
+            entry->dirtyStart = entry->position;
+            entry->dirtyEnd = entry->position + amount;
+        }
+        else {
+            if( entry->position < entry->dirtyStart ) {
+                entry->dirtyStart = entry->position;
+            }
+            if( entry->position + amount > entry->dirtyEnd ) {
+                entry->dirtyEnd = entry->position + amount;
+            }
+        }
+        if( windowPosition + amount > entry->bufferLength ) {
+            entry->bufferLength = windowPosition + amount;
+        }
+
+        entry->position += amount;
+        bytesWritten += amount;
+    }
+
+    return bytesWritten;
+}
+
+/* Moves the file's position like lseek(), whence is SEEK_SET, SEEK_CUR,
+ * SEEK_END, or SEEK_DATA / SEEK_HOLE to move to the next data or hole at
+ * or after offset. Seeking past the end is allowed, a write there leaves a
+ * hole. Returns the new position or -1, which SEEK_DATA also returns when
+ * there is no more data. */
+long seekFile( int fileDescriptor, long offset, int whence ) {
+    openFileEntry* entry = private_getOpenFile( fileDescriptor );
+    if( entry == NULL ) {
+        return -1;
+    }
+
+    long newPosition;
+    switch( whence ) {
+        case SEEK_SET: newPosition = offset; break;
+        case SEEK_CUR: newPosition = (long)entry->position + offset; break;
+        case SEEK_END: newPosition = (long)private_openFileSize( entry ) + offset; break;
+        case SEEK_DATA:
+        case SEEK_HOLE:
+            // holes change as buffered writes land, so write them first
+            if( private_flushBuffer( entry ) != 0 ) {
+                return -1;
+            }
+            if( offset < 0 || (unsigned long)offset >= entry->handle->inode->fileSize ) {
+                return -1;
+            }
+            newPosition = ( whence == SEEK_DATA ) ?
+                (long)seekInodeData( entry->handle, offset ) :
+                (long)seekInodeHole( entry->handle, offset );
+            if( whence == SEEK_DATA && (unsigned long)newPosition >= entry->handle->inode->fileSize ) {
+                return -1;
+            }
+            break;
+        default:
+            printf( "Invalid seek\n" );
+            return -1;
+    }
+
+    if( newPosition < 0 ) {
+        printf( "Invalid seek\n" );
+        return -1;
+    }
+
+    entry->position = newPosition;
+    return newPosition;
+}
+
+/* Writes out the buffered data and the file's header */
+int syncFile( int fileDescriptor ) {
+    openFileEntry* entry = private_getOpenFile( fileDescriptor );
+    if( entry == NULL ) {
+        return -1;
+    }
+
+    int returnValue = private_flushBuffer( entry );
+    syncInode( entry->handle );
+    return returnValue;
+}
+
+/* Writes out the buffered data, gives back the file's header and frees the
+ * file descriptor */
+int closeFile( int fileDescriptor ) {
+    if( fileDescriptor < 0 || fileDescriptor >= MAX_OPEN_FILES ||
+        openFileTable[fileDescriptor].handle == NULL ) {
+        printf( "ERROR: BAD FILE DESCRIPTOR\n" );
+        return -1;
+    }
+    openFileEntry* entry = openFileTable + fileDescriptor;
+
+    // a stale file's buffer has nowhere to go
+    int returnValue = entry->handle->isStale ? -1 : private_flushBuffer( entry );
+    putInode( entry->handle );
+    free( entry->buffer );
+    memset( (void*)entry, 0, sizeof( openFileEntry ) );
+    return returnValue;
+}
+
+/* Writes out the buffers of every open file, so what is on the volume is
+ * what the files hold, used before a snapshot is taken */
+void syncAllFiles() {
+    for( int fileDescriptor = 0; fileDescriptor < MAX_OPEN_FILES; fileDescriptor++ ) {
+        if( openFileTable[fileDescriptor].handle != NULL ) {
+            syncFile( fileDescriptor );
+        }
+    }
+}
+
+/* Returns 1 if a file descriptor still has the header at blockLocation
+ * open. A deleted file stays on the orphan list until this is 0, so its
+ * blocks can't be freed under an open descriptor, see reclaimOrphans(). */
+int isFileOpen( unsigned long blockLocation ) {
+    for( int fileDescriptor = 0; fileDescriptor < MAX_OPEN_FILES; fileDescriptor++ ) {
+        inodeHandle* handle = openFileTable[fileDescriptor].handle;
+        if( handle != NULL && handle->blockLocation == blockLocation ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Closes every file still open, used when the volume is closed */
+void closeAllFiles() {
+    for( int fileDescriptor = 0; fileDescriptor < MAX_OPEN_FILES; fileDescriptor++ ) {
+        if( openFileTable[fileDescriptor].handle != NULL ) {
+            closeFile( fileDescriptor );
+        }
+    }
+}
+
+/* Opens the header at blockLocation in the first free slot of the table */
+int private_openLocation( unsigned long blockLocation, int flags ) {
+    int fileDescriptor = 0;
+    while( fileDescriptor < MAX_OPEN_FILES && openFileTable[fileDescriptor].handle != NULL ) {
+        fileDescriptor++;
+    }
+    if( fileDescriptor == MAX_OPEN_FILES ) {
+        printf( "ERROR: TOO MANY OPEN FILES\n" );
+        return -1;
+    }
+
+    inodeHandle* handle = getInode( blockLocation );
+    file* fileToOpen = handle->inode;
+
+    if( !isValidInode( handle ) || !isFile( fileToOpen ) ) {
+        printf( "Not a valid file\n" );
+        putInode( handle );
+        return -1;
+    }
+    if( ( ( flags & OPEN_READ ) && !isReadable( fileToOpen ) ) ||
+        ( ( flags & OPEN_WRITE ) && !isWritable( fileToOpen ) ) ) {
+        printf( "ERROR: PERMISSION DENIED\n" );
+        putInode( handle );
+        return -1;
+    }
+
+    if( ( flags & OPEN_TRUNCATE ) && ( flags & OPEN_WRITE ) ) {
+        truncateInode( handle, 0 );
+    }
+
+    openFileEntry* entry = openFileTable + fileDescriptor;
+    memset( (void*)entry, 0, sizeof( openFileEntry ) );
+    entry->handle = handle;
+    entry->flags = flags;
+    entry->buffer = calloc( private_bufferSize(), 1 );
+
+    return fileDescriptor;
+}
+
+openFileEntry* private_getOpenFile( int fileDescriptor ) {
+    if( fileDescriptor < 0 || fileDescriptor >= MAX_OPEN_FILES ||
+        openFileTable[fileDescriptor].handle == NULL ) {
+        printf( "ERROR: BAD FILE DESCRIPTOR\n" );
+        return NULL;
+    }
+    // the header's blocks were freed, only closing the file is left to do
+    if( openFileTable[fileDescriptor].handle->isStale ) {
+        printf( "ERROR: FILE NO LONGER EXISTS\n" );
+        return NULL;
+    }
+    return openFileTable + fileDescriptor;
+}
+
+unsigned long private_bufferSize() {
+    return OPEN_FILE_BUFFER_BLOCKS * mainSystemInfo->lbaSize;
+}
+
+/* Buffered writes past the end of the file already count towards its size */
+unsigned long private_openFileSize( openFileEntry* entry ) {
+    unsigned long fileSize = entry->handle->inode->fileSize;
+    if( entry->dirtyEnd > fileSize ) {
+        fileSize = entry->dirtyEnd;
+    }
+    return fileSize;
+}
+
+/* Writes the dirty part of the buffer to the volume */
+int private_flushBuffer( openFileEntry* entry ) {
+    if( entry->dirtyEnd == entry->dirtyStart ) {
+        return 0;
+    }
+
+    long written = private_writeThrough( entry,
+                                         (void*)( entry->buffer + entry->dirtyStart - entry->bufferOffset ),
+                                         entry->dirtyStart, entry->dirtyEnd - entry->dirtyStart );
+    entry->dirtyStart = 0;
+    entry->dirtyEnd = 0;
+
+    return written < 0 ? -1 : 0;
+}
+
+/* Writes the range to the file on the volume. A write that runs out of
+ * space while deleted files still hold blocks is written again once they
+ * are freed. */
+long private_writeThrough( openFileEntry* entry, void* buffer, unsigned long offset, unsigned long length ) {
+    unsigned long failures = allocationFailures;
+    long written = writeInodeAt( entry->handle, buffer, offset, length );
+    if( written < 0 && reclaimForRetry( failures ) ) {
+        written = writeInodeAt( entry->handle, buffer, offset, length );
+    }
+    return written;
+}
+
+/* Points the buffer at the window holding offset and reads in what the file
+ * has there. Windows start on multiples of the buffer size, so the reads
+ * are whole blocks. */
+int private_fillBuffer( openFileEntry* entry, unsigned long offset ) {
+    unsigned long bufferSize = private_bufferSize();
+
+    if( private_flushBuffer( entry ) != 0 ) {
+        return -1;
+    }
+
+    entry->bufferOffset = offset - offset % bufferSize;
+    memset( (void*)entry->buffer, 0, bufferSize );
+
+    long amount = 0;
+    if( entry->bufferOffset < entry->handle->inode->fileSize ) {
+        amount = readInodeAt( entry->handle, (void*)entry->buffer, entry->bufferOffset, bufferSize );
+        if( amount < 0 ) {
+            return -1;
+        }
+    }
+
+    entry->bufferLength = amount;
+    entry->isBuffered = 1;
+    return 0;
+}
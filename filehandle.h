@@ -0,0 +1,57 @@
+#ifndef FILE_HANDLE_H
+#define FILE_HANDLE_H
+
+#include <stdio.h>
+
+#include "inode.h"
+#include "filesystem.h"
+
+#define MAX_OPEN_FILES 32
+#define OPEN_FILE_BUFFER_BLOCKS 16
+
+// extra whence values for seekFile(), as in lseek()
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#endif
+#ifndef SEEK_HOLE
+#define SEEK_HOLE 4
+#endif
+
+// flags for openFile(), or them together
+#define OPEN_READ 0b00001
+#define OPEN_WRITE 0b00010
+#define OPEN_CREATE 0b00100
+#define OPEN_TRUNCATE 0b01000
+#define OPEN_APPEND 0b10000
+
+/* An entry in the open file table. The file's header is held from
+ * openFile() until closeFile(), and reads and writes go through a buffer
+ * of OPEN_FILE_BUFFER_BLOCKS blocks. The buffer covers the window of the
+ * file starting at bufferOffset, holds the file's bytes up to
+ * bufferOffset + bufferLength, and the bytes from dirtyStart to dirtyEnd
+ * have not been written to the volume yet. */
+typedef struct openFileEntry {
+    inodeHandle* handle;
+    int flags;
+    unsigned long position;
+    char* buffer;
+    int isBuffered;       // the buffer holds a window of the file
+    unsigned long bufferOffset;
+    unsigned long bufferLength;
+    unsigned long dirtyStart;
+    unsigned long dirtyEnd;
+} openFileEntry;
+
+int openFile( char* filePath, int flags );
+int openFileAt( directoryHandle* directory, char* filePath, int flags );
+int openFileById( unsigned long inodeNumber, int flags );
+long readFile( int fileDescriptor, void* buffer, unsigned long length );
+long writeFile( int fileDescriptor, void* buffer, unsigned long length );
+long seekFile( int fileDescriptor, long offset, int whence );
+int syncFile( int fileDescriptor );
+int closeFile( int fileDescriptor );
+void syncAllFiles();
+void closeAllFiles();
+int isFileOpen( unsigned long blockLocation );
+
+#endif /* FILE_HANDLE_H end guard */
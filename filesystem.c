@@ -2,10 +2,128 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
 
 #include "fsLow.h"
 #include "systemstructs.h"
 #include "filesystem.h"
+#include "inode.h"
+#include "directory.h"
+#include "directoryhash.h"
+#include "filehandle.h"
+#include "refcount.h"
+#include "inodeindex.h"
+#include "dentry.h"
+#include "pathindex.h"
+#include "orphan.h"
+#include "nameindex.h"
+
+/* A window of a copy to or from linux. The linux side of the copy runs on
+ * a thread of its own, so while it reads or writes one chunk the volume
+ * side, which stays on the main thread, works on the other. */
+typedef struct linuxChunk {
+    FILE* linuxFile;
+    char* buffer;
+    unsigned long length;
+    long offset;          // where in the linux file a write goes
+    long result;          // bytes read or written, or -1
+    pthread_t thread;
+    int isRunning;
+} linuxChunk;
+
+/* A job of a recursive copy, see private_addCopyJob() */
+typedef struct copyJob {
+    directoryBlock* block;
+    unsigned long fromLocation;
+    unsigned long toLocation;
+    struct copyJob* next;
+} copyJob;
+
+/* The jobs a recursive copy's workers share. A worker that is busy may
+ * still add jobs, so the workers only stop once none are. */
+typedef struct copyPool {
+    copyJob* jobs;
+    int busyWorkers;
+    int isOutOfSpace;     // a worker ran out of space, the rest is dropped
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} copyPool;
+
+/* A run of blocks freed while a free batch is open, see beginFreeBatch() */
+typedef struct freeRun {
+    unsigned long startBlock;
+    unsigned long count;
+} freeRun;
+
+freeRun* freeBatch = NULL;
+unsigned long freeBatchCount = 0;
+unsigned long freeBatchCapacity = 0;
+int freeBatchDepth = 0;
+
+/* Held by getFreeBlocks(), delete() and the free batch functions while
+ * they change the free list, so a copy's workers can allocate at once.
+ * The path, index and reference table locks may be held when it is taken,
+ * the inode cache's lock never is. */
+pthread_mutex_t freeSpaceLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Held by path lookups for the whole walk, and by addChild(), addChildren()
+ * and removeChild() while they change a directory, so a lookup never reads
+ * a directory's blocks or index halfway through a change. The inode, dentry
+ * and path index caches each have their own lock besides, taken inside
+ * this one, so lookups can run on any number of threads alongside the
+ * operations that change the caches. */
+pthread_mutex_t pathLookupLock = PTHREAD_MUTEX_INITIALIZER;
+
+int private_compareFreeRuns( const void* first, const void* second );
+void private_applyFreeBatch();
+void private_startLinuxChunk( linuxChunk* chunk, void* (*transfer)( void* ) );
+void private_finishLinuxChunk( linuxChunk* chunk );
+void* private_readLinuxChunk( void* argument );
+void* private_writeLinuxChunk( void* argument );
+int private_growExtents( inodeHandle* handle, unsigned long newSize, unsigned long dataFrom,
+                         unsigned long* freshFrom );
+void private_transferBlocks( inodeHandle* handle, void* buffer, unsigned long offset,
+                             unsigned long length, int isWrite, unsigned long freshFrom );
+unsigned long private_lookupName( unsigned long blockLocation, char* fileName, directoryEntry* entry,
+                                  hashBucket* bucket, directoryBlock* block );
+unsigned long private_walkPath( directoryHandle* directory, pathIterator* iterator,
+                                directoryEntry* entry, int stopBeforeLast );
+unsigned long private_addFileAt( directoryHandle* directory, char* filePath, char* identifierTypeStr );
+unsigned long private_createChild( unsigned long parentLocation, char* fileName, char* identifierTypeStr );
+int private_isPathBelow( char* path, char* directoryPath );
+unsigned long private_copyFile( directoryHandle* directory, char* moveFrom, char* moveTo );
+int private_isBelow( unsigned long directoryLocation, unsigned long ancestorLocation, char* path, char* ancestorPath );
+int private_printMetadata( unsigned long blockLocation );
+char* private_getContent( unsigned long blockLocation );
+int private_writeFileData( unsigned long headerBlockLocation, void* fileBuffer, unsigned long fileSize );
+void private_copyData( inodeHandle* oldHandle, inodeHandle* newHandle );
+void private_copyTree( unsigned long fromLocation, unsigned long toLocation );
+void private_addCopyJob( copyPool* pool, directoryBlock* block,
+                         unsigned long fromLocation, unsigned long toLocation );
+void* private_runCopyWorker( void* argument );
+void private_splitDirectory( copyPool* pool, unsigned long fromLocation, unsigned long toLocation );
+void private_copyBlock( copyPool* pool, directoryBlock* block, unsigned long toLocation );
+
+/* One path of a resolvePaths() batch. component is the part of the path
+ * being resolved, NULL once the whole path has been. */
+typedef struct pathRequest {
+    unsigned long index;      // where the path is in the caller's list
+    int isAbsolute;
+    pathIterator iterator;
+    const char* component;
+    unsigned long length;
+} pathRequest;
+
+int private_comparePathRequests( const void* first, const void* second );
+int private_compareNames( const char* first, unsigned long firstLength,
+                          const char* second, unsigned long secondLength );
+void private_nextRequestComponent( pathRequest* request );
+void private_resolveGroup( pathRequest* requests, unsigned long count, directoryEntry* parent,
+                           unsigned long* blockLocations );
+void private_lookupNames( unsigned long parentLocation, pathRequest* requests, unsigned long* runStarts,
+                          unsigned long runCount, directoryEntry* children );
 
 /* Opens the volume through fslow and initializes the volume with the
  * main system info. Then creates the root directory and sets the rest of the
@@ -24,8 +142,42 @@ int startFileSystem( char* volumeName, unsigned long volumeSize, unsigned long b
 
     file_lbaSize = ( sizeof( file ) / blockSize ) + 1;
     file_mallocSize = file_lbaSize * blockSize;
+    file_inlineCapacity = file_mallocSize - sizeof( file );
+
+    extent_lbaSize = ( sizeof( extentBlock ) / blockSize ) + 1;
+    extent_mallocSize = extent_lbaSize * blockSize;
+    extent_extentsPerBlock =
+        ( extent_mallocSize - sizeof( extentBlock ) ) / sizeof( extent );
+
+    inodeIndex_lbaSize = ( INODE_INDEX_BLOCK_BYTES + blockSize - 1 ) / blockSize;
+    inodeIndex_mallocSize = inodeIndex_lbaSize * blockSize;
+    inodeIndex_entriesPerBlock =
+        ( inodeIndex_mallocSize - sizeof( inodeIndexBlock ) ) / sizeof( unsigned long );
+
+    pathIndex_lbaSize = ( PATH_INDEX_BLOCK_BYTES + blockSize - 1 ) / blockSize;
+    pathIndex_mallocSize = pathIndex_lbaSize * blockSize;
+    pathIndex_recordsPerBlock =
+        ( pathIndex_mallocSize - sizeof( pathIndexBlock ) ) / sizeof( pathIndexRecord );
+
+    snapshot_lbaSize = ( sizeof( snapshotTable ) / blockSize ) + 1;
+    snapshot_mallocSize = snapshot_lbaSize * blockSize;
+
+    exception_lbaSize = ( sizeof( exceptionBlock ) / blockSize ) + 1;
+    exception_mallocSize = exception_lbaSize * blockSize;
+    exception_exceptionsPerBlock =
+        ( exception_mallocSize - sizeof( exceptionBlock ) ) / sizeof( unsigned long );
+
+    // entries carry their names, so a directory block spans a few blocks
+    directory_lbaSize = ( DIRECTORY_BLOCK_BYTES + blockSize - 1 ) / blockSize;
+    directory_mallocSize = directory_lbaSize * blockSize;
+    directory_childrenPerBlock =
+        ( directory_mallocSize - sizeof( directoryBlock ) ) / sizeof( directoryEntry );
+    directory_entriesPerBucket =
+        ( directory_mallocSize - sizeof( hashBucket ) ) / sizeof( hashEntry );
 
     initializeSystemInfo( volumeName, volumeSize, blockSize );
+    loadSnapshots();
+    loadPathIndex();
 
     return 0;
 }
@@ -36,7 +188,7 @@ int startFileSystem( char* volumeName, unsigned long volumeSize, unsigned long b
  * Returns 1 if new system was created. */
 int initializeSystemInfo( char* volumeName, unsigned long volumeSize, unsigned long blockSize ) {
     mainSystemInfo = calloc( system_mallocSize, 1 );
-    LBAread( (void*)mainSystemInfo, system_lbaSize, 0 );
+    volumeRead( (void*)mainSystemInfo, system_lbaSize, 0 );
     
     if( isValidSystemInfo( mainSystemInfo ) ) {
         return 0;
@@ -57,8 +209,15 @@ int createNewSystem( char* volumeName, unsigned long volumeSize, unsigned long b
     strcpy( mainSystemInfo->volumeName, volumeName );
     mainSystemInfo->volumeSize = volumeSize;
     mainSystemInfo->lbaSize = blockSize;
+    mainSystemInfo->version = FILESYSTEM_VERSION;
     mainSystemInfo->signature1 = SYSTEMSIGNATURE1;
     mainSystemInfo->signature2 = SYSTEMSIGNATURE2;
+    mainSystemInfo->nextInodeNumber = 1;
+    mainSystemInfo->inodeIndex = 0;
+    mainSystemInfo->inodeIndexDepth = 0;
+    mainSystemInfo->pathIndex = 0;
+    mainSystemInfo->pathIndexClean = 1;
+    mainSystemInfo->orphanHead = 0;
 
     //If mainSystemInfo uses 2 blocks, then freeHeadBeginningLocation should
     //start at block 2. i.e. mainSystemInfo uses block 0 and block 1.
@@ -66,17 +225,22 @@ int createNewSystem( char* volumeName, unsigned long volumeSize, unsigned long b
     initializeFreeSpace( freeHeadBeginningLocation );
     mainSystemInfo->freeHeadBlock = freeHeadBeginningLocation;
 
+    //Data blocks start out owned by a single file
+    createReferenceTable();
+    createSnapshotTable();
+
     //Create the root directory
-    unsigned long rootLocation = makeBlank();
-    setFileIdentifierType( rootLocation, "dr" );
-    setDefaultMetadata( rootLocation );
-    setFileName( rootLocation, ROOTNAME );
-    mainSystemInfo->rootLocation = rootLocation;
+    inodeHandle* root = makeBlank();
+    setInodeIdentifierType( root, "dr" );
+    setInodeDefaultMetadata( root );
+    setInodeName( root, ROOTNAME );
+    mainSystemInfo->rootLocation = root->blockLocation;
+    putInode( root );
 
     //Write mainSystemInfo to volume at location 0
     //0 is hard-coded because... well, the main system info should be
     //the very first thing right?
-    LBAwrite( (void*)mainSystemInfo, system_lbaSize, 0 );
+    volumeWrite( (void*)mainSystemInfo, system_lbaSize, 0 );
 
     return 0;
 }
@@ -97,7 +261,7 @@ int initializeFreeSpace( const unsigned long beginLocation ) {
     beginningFreeSpace->signature2 = FREESIGNATURE2;
 
     //Write freeSpace to volume
-    LBAwrite( (void*)beginningFreeSpace, free_lbaSize, beginLocation );
+    volumeWrite( (void*)beginningFreeSpace, free_lbaSize, beginLocation );
 
     free(beginningFreeSpace);
 
@@ -106,62 +270,212 @@ int initializeFreeSpace( const unsigned long beginLocation ) {
 
 
 int copyFromVolumeToLinux( char* ourPath, char* linuxPath ) {
-// TODO: put comment here explaining the function
+    return copyFromVolumeToLinuxAt( NULL, ourPath, linuxPath );
+}
 
-    unsigned long fileLocation = getBlockLocationFromPath( ourPath );
-    file* ourFile = calloc( file_mallocSize, 1 );
-    LBAread( (void*)ourFile, file_lbaSize, fileLocation );
-    
-    if( !isValidFile( ourFile ) || !isFile( ourFile ) || !isWritable( ourFile ) ) {
+
+int copyFromVolumeToLinuxAt( directoryHandle* directory, char* ourPath, char* linuxPath ) {
+// streams the file out a window at a time, so the file doesn't have to fit
+// in memory, writing one window to linux while the next is read
+
+    int fileDescriptor = openFileAt( directory, ourPath, OPEN_READ );
+    if( fileDescriptor < 0 ) {
         printf( "Not a valid file on the alpha volume\n");
-        free( ourFile );
         return -1;
     }
-    
-    unsigned long contentLocation = ourFile->startingBlock;
-    unsigned long fileSize = ourFile->fileSize;
-    int contentBlockAmount = ( fileSize / mainSystemInfo->lbaSize ) + 1;
-    int bufferMallocSize = contentBlockAmount * mainSystemInfo->lbaSize;
-    void* buffer = calloc( bufferMallocSize, 1 );
-
-    LBAread( buffer, contentBlockAmount, contentLocation );
 
     FILE* linuxFile = fopen( linuxPath, "w" );
-    fwrite( buffer, fileSize, 1, linuxFile );
-    fclose( linuxFile );
+    if( linuxFile == NULL ) {
+        printf( "Could not open %s\n", linuxPath );
+        closeFile( fileDescriptor );
+        return -1;
+    }
 
-    free( ourFile );
-    free( buffer );
+    unsigned long windowSize = COPY_WINDOW_BLOCKS * mainSystemInfo->lbaSize;
+    linuxChunk chunks[2];
+    for( int i = 0; i < 2; i++ ) {
+        memset( (void*)( chunks + i ), 0, sizeof( linuxChunk ) );
+        chunks[i].linuxFile = linuxFile;
+        chunks[i].buffer = malloc( windowSize );
+    }
 
-    return 0;
+    long fileSize = seekFile( fileDescriptor, 0, SEEK_END );
+    long dataStart = 0;
+    int current = 0;
+    int returnValue = 0;
+    int isDone = 0;
+
+    // only the data is copied, seeking over the holes so that the linux
+    // file gets the same holes
+    while( !isDone && ( dataStart = seekFile( fileDescriptor, dataStart, SEEK_DATA ) ) >= 0 ) {
+        long dataEnd = seekFile( fileDescriptor, dataStart, SEEK_HOLE );
+        seekFile( fileDescriptor, dataStart, SEEK_SET );
+
+        while( dataStart < dataEnd ) {
+            // the window is free again once its last write is done
+            linuxChunk* chunk = chunks + current;
+            private_finishLinuxChunk( chunk );
+            if( chunk->result < 0 ) {
+                returnValue = -1;
+                isDone = 1;
+                break;
+            }
+
+            unsigned long amount = dataEnd - dataStart;
+            if( amount > windowSize ) {
+                amount = windowSize;
+            }
+            long amountRead = readFile( fileDescriptor, (void*)chunk->buffer, amount );
+            if( amountRead <= 0 ) {
+                returnValue = amountRead < 0 ? -1 : 0;
+                isDone = 1;
+                break;
+            }
+
+            chunk->offset = dataStart;
+            chunk->length = amountRead;
+            private_startLinuxChunk( chunk, &private_writeLinuxChunk );
+            dataStart += amountRead;
+            current = 1 - current;
+        }
+    }
+
+    for( int i = 0; i < 2; i++ ) {
+        private_finishLinuxChunk( chunks + i );
+        if( chunks[i].result < 0 ) {
+            returnValue = -1;
+        }
+        free( chunks[i].buffer );
+    }
+
+    // a hole at the end only shows up through the file size
+    if( fileSize >= 0 && ftruncate( fileno( linuxFile ), fileSize ) != 0 ) {
+        printf( "Could not set the size of %s\n", linuxPath );
+    }
+
+    fclose( linuxFile );
+    closeFile( fileDescriptor );
+
+    return returnValue;
 }
 
 
 int copyFromLinuxToVolume( char* linuxFileName, char* volumeFileName ) {
+    return copyFromLinuxToVolumeAt( NULL, linuxFileName, volumeFileName );
+}
+
+
+int copyFromLinuxToVolumeAt( directoryHandle* directory, char* linuxFileName, char* volumeFileName ) {
+// streams the file in a window at a time, creating the volume file or
+// replacing its contents, reading the next window from linux while one
+// is written to the volume
 
     FILE* linuxFile = fopen( linuxFileName, "r" );
+    if( linuxFile == NULL ) {
+        printf( "Could not open %s\n", linuxFileName );
+        return -1;
+    }
 
-    // get file size
-    fseek( linuxFile, 0, SEEK_END );
-    int linuxFileSize = ftell( linuxFile );
-    rewind( linuxFile );
+    int fileDescriptor = openFileAt( directory, volumeFileName, OPEN_WRITE | OPEN_CREATE | OPEN_TRUNCATE );
+    if( fileDescriptor < 0 ) {
+        fclose( linuxFile );
+        return -1;
+    }
 
+    unsigned long windowSize = COPY_WINDOW_BLOCKS * mainSystemInfo->lbaSize;
+    linuxChunk chunks[2];
+    for( int i = 0; i < 2; i++ ) {
+        memset( (void*)( chunks + i ), 0, sizeof( linuxChunk ) );
+        chunks[i].linuxFile = linuxFile;
+        chunks[i].buffer = malloc( windowSize );
+        chunks[i].length = windowSize;
+    }
 
-    unsigned int blockSize = mainSystemInfo->lbaSize;
-    // integer divsion that takes ceiling
-    unsigned int numberOfBlocks = ( linuxFileSize + blockSize - 1 ) / blockSize;
-    int bufferMallocSize = numberOfBlocks * mainSystemInfo->lbaSize;
+    int current = 0;
+    int returnValue = 0;
 
-    void* buffer = calloc( bufferMallocSize, 1 );
-    fread( buffer, linuxFileSize, 1, linuxFile );
+    private_startLinuxChunk( chunks, &private_readLinuxChunk );
+    private_finishLinuxChunk( chunks );
+
+    while( chunks[current].result > 0 ) {
+        linuxChunk* nextChunk = chunks + 1 - current;
+        private_startLinuxChunk( nextChunk, &private_readLinuxChunk );
 
-    unsigned long volumeBlockLocation = addFile( volumeFileName );
-    writeFileData( volumeBlockLocation, numberOfBlocks, buffer, linuxFileSize );
+        long amountWritten = writeFile( fileDescriptor, (void*)chunks[current].buffer, chunks[current].result );
+
+        private_finishLinuxChunk( nextChunk );
+        if( amountWritten < 0 ) {
+            returnValue = -1;
+            break;
+        }
+        current = 1 - current;
+    }
+    if( chunks[current].result < 0 ) {
+        printf( "Could not read %s\n", linuxFileName );
+        returnValue = -1;
+    }
 
-    free( buffer );
+    for( int i = 0; i < 2; i++ ) {
+        free( chunks[i].buffer );
+    }
     fclose( linuxFile );
+    closeFile( fileDescriptor );
 
-    return 0;
+    return returnValue;
+}
+
+
+/* Runs the linux side of a chunk on its own thread, or right here if no
+ * thread can be started */
+void private_startLinuxChunk( linuxChunk* chunk, void* (*transfer)( void* ) ) {
+    chunk->isRunning = pthread_create( &chunk->thread, NULL, transfer, (void*)chunk ) == 0;
+    if( !chunk->isRunning ) {
+        transfer( (void*)chunk );
+    }
+}
+
+
+/* Waits for the chunk's linux side to be done, after which its result is
+ * set and its buffer can be used again */
+void private_finishLinuxChunk( linuxChunk* chunk ) {
+    if( chunk->isRunning ) {
+        pthread_join( chunk->thread, NULL );
+        chunk->isRunning = 0;
+    }
+}
+
+
+/* Reads up to length bytes from where the linux file is. Only ever runs
+ * on one chunk at a time, as each read starts after the last one is
+ * finished. */
+void* private_readLinuxChunk( void* argument ) {
+    linuxChunk* chunk = argument;
+    chunk->result = fread( (void*)chunk->buffer, 1, chunk->length, chunk->linuxFile );
+    if( chunk->result == 0 && ferror( chunk->linuxFile ) ) {
+        chunk->result = -1;
+    }
+    return NULL;
+}
+
+
+/* Writes the chunk at its own offset, so the two chunks' writes don't
+ * share a file position */
+void* private_writeLinuxChunk( void* argument ) {
+    linuxChunk* chunk = argument;
+    unsigned long written = 0;
+
+    while( written < chunk->length ) {
+        ssize_t amount = pwrite( fileno( chunk->linuxFile ), (void*)( chunk->buffer + written ),
+                                 chunk->length - written, chunk->offset + written );
+        if( amount <= 0 ) {
+            chunk->result = -1;
+            return NULL;
+        }
+        written += amount;
+    }
+
+    chunk->result = written;
+    return NULL;
 }
 
 
@@ -169,96 +483,171 @@ int copyFromLinuxToVolume( char* linuxFileName, char* volumeFileName ) {
  * reads file that will be moved into a temp buffer, then writes 
  * the buffer to the new location. Assumes both are absolute paths. */
 unsigned long copyFile( char* moveFrom, char* moveTo ) {
+    return copyFileAt( NULL, moveFrom, moveTo );
+}
+
+
+/* Same as copyFile() for paths relative to directory */
+unsigned long copyFileAt( directoryHandle* directory, char* moveFrom, char* moveTo ) {
+    unsigned long failures = allocationFailures;
+    unsigned long toBlockLocation = private_copyFile( directory, moveFrom, moveTo );
+
+    // out of space with deleted files still holding blocks, throw away
+    // the partial copy along with them and copy again
+    if( allocationFailures != failures && mainSystemInfo->orphanHead != 0 ) {
+        if( toBlockLocation != 0 ) {
+            deleteFileAt( directory, moveTo );
+        }
+        toBlockLocation = 0;
+        if( reclaimForRetry( failures ) ) {
+            toBlockLocation = private_copyFile( directory, moveFrom, moveTo );
+        }
+    }
+
+    return toBlockLocation;
+}
+
+
+/* copyFileAt() without the retry */
+unsigned long private_copyFile( directoryHandle* directory, char* moveFrom, char* moveTo ) {
 
     if( strcmp( moveFrom, moveTo ) == 0 ) {
         printf( "new filename must be different than old filename\n" );
         return 0;
     }
 
-    if( getBlockLocationFromPath( moveFrom ) == 0 ) {
+    unsigned long toBlockLocation;
+    unsigned long fromBlockLocation = getBlockLocationAt( directory, moveFrom );
+    if( fromBlockLocation == 0 ) {
         printf( "Source file doesn't exist\n");
+        return 0;
     }
 
-    if( getBlockLocationFromPath( moveTo ) != 0 ) {
+    if( getBlockLocationAt( directory, moveTo ) != 0 ) {
         printf( "File name already exists\n");
         return 0;
     }
 
-    unsigned long toBlockLocation;
-    unsigned long fromBlockLocation = getBlockLocationFromPath( moveFrom );
+    // a copy inside the directory would be copied again, until the volume
+    // is full
+    pathIterator iterator;
+    directoryEntry toParentEntry;
+    openPath( &iterator, moveTo );
+    unsigned long toParentLocation = private_walkPath( directory, &iterator, &toParentEntry, 1 );
+    if( private_isBelow( toParentLocation, fromBlockLocation, moveTo, moveFrom ) ) {
+        printf( "Cannot copy a directory into itself\n" );
+        return 0;
+    }
 
-    toBlockLocation = addFile( moveTo );
+    // load the header of the file being copied once up front so the copy
+    // can be created with the right type in a single header write
+    inodeHandle* oldHandle = getInode( fromBlockLocation );
+    file* oldFile = oldHandle->inode;
 
-    if( !fromBlockLocation || !toBlockLocation ) {
+    if( oldFile->identifierType == IDENTIFIER_DIRECTORY ) {
+        toBlockLocation = private_addFileAt( directory, moveTo, "dr" );
+    } else {
+        toBlockLocation = private_addFileAt( directory, moveTo, "fl" );
+    }
+
+    if( !toBlockLocation ) {
         printf( "Invalid file path\n" );
+        putInode( oldHandle );
         return 0;
     }
 
-    // save file being moved to a temporary buffer
-    void* oldFileBuffer = calloc( file_mallocSize, 1 );
-    LBAread( oldFileBuffer, file_lbaSize, fromBlockLocation);
-    file* oldFile = (file*)oldFileBuffer;
-
     // directories do not contain any data
     if( oldFile->identifierType == IDENTIFIER_FILE ) {
-        // save file data being moved into a temporary buffer
-        setFileIdentifierType( toBlockLocation, "fl" );
-        int contentBlockAmount = ( oldFile->fileSize / mainSystemInfo->lbaSize ) + 1;
-        int bufferMallocSize = contentBlockAmount * mainSystemInfo->lbaSize;
-        void* tempDataBuffer = calloc( bufferMallocSize, 1 );
-        LBAread( tempDataBuffer, contentBlockAmount, oldFile->startingBlock );
-        writeFileData( toBlockLocation, contentBlockAmount, tempDataBuffer, oldFile->fileSize );
-        free( tempDataBuffer );
+        inodeHandle* newHandle = getInode( toBlockLocation );
+        private_copyData( oldHandle, newHandle );
+        putInode( newHandle );
     } else if( oldFile->identifierType == IDENTIFIER_DIRECTORY ) {
-        setFileIdentifierType( toBlockLocation, "dr" );
-        for( int i = 0; i < NUMBER_OF_CHILDREN; ++i ) {
-            if( oldFile->children[i] > 1 ) {
-                void* childFileBuffer = calloc( file_mallocSize, 1 );
-                LBAread( childFileBuffer, file_lbaSize, oldFile->children[i] );
-                file* childFile = (file*)childFileBuffer;
-
-                // appends child file name to given file path 
-                char* childMoveFrom = filePathConcat( moveFrom, childFile->fileName );
-                char* childMoveTo = filePathConcat( moveTo, childFile->fileName );
-                unsigned long childBlockLocation = copyFile( childMoveFrom, childMoveTo );
-
-                void* newFileBuffer = calloc( file_mallocSize, 1 );
-                LBAread( newFileBuffer, file_lbaSize, toBlockLocation );
-                file* newFile = (file*)newFileBuffer;
-                newFile->children[i] = childBlockLocation;
-                LBAwrite( newFileBuffer, file_lbaSize, toBlockLocation );
-
-                free( childMoveFrom );
-                free( childMoveTo );
-                free( childFileBuffer );
-                free( newFileBuffer );
-            }
-        }
+        private_copyTree( fromBlockLocation, toBlockLocation );
     }
     
-    free( oldFileBuffer );
+    putInode( oldHandle );
 
     return toBlockLocation;
 }
 
 
 /* Takes two file paths and moves the file from the first path to the second.
- * calls the copy function and then deletes the original file */
+ * The file's header stays where it is: it is unlinked from the old parent,
+ * renamed and linked into the new parent, so moving a directory costs the
+ * same however much is below it.
+ * Returns 0 if successful, -1 otherwise. */
 int moveFile( char* moveFrom, char* moveTo ) {
+    return moveFileAt( NULL, moveFrom, moveTo );
+}
+
 
-    if( copyFile( moveFrom, moveTo ) == 0 ) {
+/* Same as moveFile() for paths relative to directory */
+int moveFileAt( directoryHandle* directory, char* moveFrom, char* moveTo ) {
+
+    if( strcmp( moveFrom, moveTo ) == 0 ) {
+        printf( "new filename must be different than old filename\n" );
         return -1;
     }
 
-    unsigned long fromBlockLocation = getBlockLocationFromPath( moveFrom );
-    char* parentPath = getParentPath( moveFrom );
-    unsigned long parentLocation = getBlockLocationFromPath( parentPath );
-    recursiveDelete( fromBlockLocation );
-    removeChild( parentLocation, fromBlockLocation );
+    unsigned long fromBlockLocation = getBlockLocationAt( directory, moveFrom );
+    if( fromBlockLocation == 0 ) {
+        printf( "Source file doesn't exist\n");
+        return -1;
+    }
+    if( fromBlockLocation == mainSystemInfo->rootLocation ) {
+        printf( "Cannot move the root directory\n" );
+        return -1;
+    }
+    if( getBlockLocationAt( directory, moveTo ) != 0 ) {
+        printf( "File name already exists\n");
+        return -1;
+    }
 
-    free( parentPath );
+    pathIterator iterator;
+    const char* component;
+    unsigned long length;
+    directoryEntry toParentEntry;
+    char newFileName[sizeof( toParentEntry.fileName )];
 
-    return 0;
+    openPath( &iterator, moveTo );
+    unsigned long toParentLocation = private_walkPath( directory, &iterator, &toParentEntry, 1 );
+    if( toParentLocation == 0 || toParentEntry.identifierType != IDENTIFIER_DIRECTORY ||
+        !nextPathComponent( &iterator, &component, &length ) || length >= sizeof( newFileName ) ) {
+        printf( "Invalid file path\n" );
+        return -1;
+    }
+    memcpy( newFileName, component, length );
+    newFileName[length] = '\0';
+
+    // a directory can't be moved below itself, it would be cut off from root
+    if( private_isBelow( toParentLocation, fromBlockLocation, moveTo, moveFrom ) ) {
+        printf( "Cannot move a directory into itself\n" );
+        return -1;
+    }
+
+    directoryEntry fromParentEntry;
+    openPath( &iterator, moveFrom );
+    unsigned long fromParentLocation = private_walkPath( directory, &iterator, &fromParentEntry, 1 );
+
+    inodeHandle* handle = getInode( fromBlockLocation );
+    char* oldFileName = getCopyOfString( handle->inode->fileName );
+
+    // unlink while the old name is still there to find it in the index
+    removeChild( fromParentLocation, fromBlockLocation );
+    setInodeName( handle, newFileName );
+    putInode( handle );
+
+    int returnValue = 0;
+    if( addChild( toParentLocation, fromBlockLocation ) == 0 ) {
+        // put it back where it was rather than lose it
+        setFileName( fromBlockLocation, oldFileName );
+        addChild( fromParentLocation, fromBlockLocation );
+        printf( "ERROR: COULD NOT MOVE FILE\n" );
+        returnValue = -1;
+    }
+
+    free( oldFileName );
+    return returnValue;
 }
 
 
@@ -266,66 +655,327 @@ int moveFile( char* moveFrom, char* moveTo ) {
  * at the end of the filepath. Assumes an absolute path.
  * Will return 0 if no match is found. */
 unsigned long getBlockLocationFromPath( char* filePath ) {
+    directoryEntry entry;
+    return getDirectoryEntryFromPath( filePath, &entry );
+}
 
-    filePath = getCopyOfString( filePath );
 
-    // starts at root directory
-    unsigned long blockLocation = mainSystemInfo->rootLocation;
+/* Finds a file by its inode number without walking a path. The header it
+ * leads to is checked to still be that file.
+ * Returns the block location of the file, or 0 if there is no such file. */
+unsigned long getBlockLocationFromInodeNumber( unsigned long inodeNumber ) {
+    unsigned long blockLocation = getInodeLocation( inodeNumber );
+    if( blockLocation == 0 ) {
+        return 0;
+    }
+
+    inodeHandle* handle = getInode( blockLocation );
+    if( !isValidInode( handle ) || handle->inode->inodeNumber != inodeNumber ) {
+        blockLocation = 0;
+    }
+    putInode( handle );
+
+    return blockLocation;
+}
 
+
+/* Parses a filepath and fills entry with the directory entry of the file
+ * at the end of it, which gives its name and type without reading its
+ * header. Assumes an absolute path.
+ * Returns the block location of the file, or 0 if no match is found. */
+unsigned long getDirectoryEntryFromPath( char* filePath, directoryEntry* entry ) {
     // if no forward slashes present so return root dir
     char *pLastBackslash = strrchr(filePath, '/');
     if( !pLastBackslash || !*(pLastBackslash + 1) ) {
-        return blockLocation;
+        filePath = ROOTNAME;
     }
 
-    // remove newline from end of user inputted string
-    filePath[strcspn( filePath, "\n" )] = 0;
-    char* directoryName = strtok( filePath, "/" );
-    if( strcmp( directoryName, ROOTNAME ) != 0 ) {
-        return 0;
+    return getDirectoryEntryAt( NULL, filePath, entry );
+}
+
+
+/* Same as getDirectoryEntryFromPath() but stops at the directory the last
+ * component of the path would be in, so callers about to add, remove or
+ * rename that component don't need a copy of the path to cut it off.
+ * Returns the block location of the parent, or 0 if it isn't found. */
+unsigned long getParentEntryFromPath( char* filePath, directoryEntry* entry ) {
+    pathIterator iterator;
+    openPath( &iterator, filePath );
+    return private_walkPath( NULL, &iterator, entry, 1 );
+}
+
+
+/* The At functions below take a path relative to an open directory, like
+ * the *at() calls of POSIX, so only the components below that directory
+ * are walked. A path starting with root is still absolute, and a NULL
+ * directory means the path has to be. */
+
+/* Fills handle with a handle to the directory at filePath. The handle
+ * holds the directory's inode number as a generation, so it stays good
+ * while the directory is moved around and is refused once the directory is
+ * deleted, even if its blocks are reused.
+ * Returns 0 if successful, -1 if the path isn't a directory. */
+int openDirectoryHandle( directoryHandle* directory, char* filePath, directoryHandle* handle ) {
+    directoryEntry entry;
+    unsigned long blockLocation = getDirectoryEntryAt( directory, filePath, &entry );
+    if( blockLocation == 0 || entry.identifierType != IDENTIFIER_DIRECTORY ) {
+        return -1;
     }
-    directoryName = strtok( NULL, "/" );
 
-    while( directoryName != NULL ) {
-        // go to child directory
-        blockLocation = getBlockLocationFromName( blockLocation, directoryName );
-        if( blockLocation == 0 ) {
-            break;
+    inodeHandle* inode = getInode( blockLocation );
+    handle->blockLocation = blockLocation;
+    handle->generation = inode->inode->inodeNumber;
+    putInode( inode );
+
+    return 0;
+}
+
+
+/* Fills handle with a handle to the directory holding the one directory is
+ * open on, root being its own parent. Parents are only known through the
+ * name index.
+ * Returns 0 if successful, -1 if the directory no longer exists or the
+ * index isn't loaded. */
+int openParentDirectoryHandle( directoryHandle* directory, directoryHandle* handle ) {
+    if( !isPathIndexReady() || !isValidDirectoryHandle( directory ) ) {
+        return -1;
+    }
+    unsigned long parentLocation = getParentDirectory( directory->blockLocation );
+    if( parentLocation == 0 ) {
+        return -1;
+    }
+
+    inodeHandle* inode = getInode( parentLocation );
+    handle->blockLocation = parentLocation;
+    handle->generation = inode->inode->inodeNumber;
+    putInode( inode );
+
+    return 0;
+}
+
+
+/* Checks the directory a handle was opened on still exists */
+int isValidDirectoryHandle( directoryHandle* handle ) {
+    inodeHandle* inode = getInode( handle->blockLocation );
+    int isValid = isValidInode( inode ) && isDirectory( inode->inode ) &&
+                  inode->inode->inodeNumber == handle->generation;
+    putInode( inode );
+
+    // a directory below a deleted one is only freed later, until then the
+    // path index is what knows it's gone
+    if( isValid && isPathIndexReady() ) {
+        isValid = isDirectoryReachable( handle->blockLocation );
+    }
+    return isValid;
+}
+
+
+/* Same as getDirectoryEntryFromPath() for a path relative to directory.
+ * Returns the block location of the file, or 0 if no match is found or
+ * the directory no longer exists. */
+unsigned long getDirectoryEntryAt( directoryHandle* directory, char* filePath, directoryEntry* entry ) {
+    pathIterator iterator;
+    openPath( &iterator, filePath );
+    return private_walkPath( directory, &iterator, entry, 0 );
+}
+
+
+unsigned long getBlockLocationAt( directoryHandle* directory, char* filePath ) {
+    directoryEntry entry;
+    return getDirectoryEntryAt( directory, filePath, &entry );
+}
+
+
+unsigned long makeFileAt( directoryHandle* directory, char* filePath ) {
+    return private_addFileAt( directory, filePath, "fl" );
+}
+
+
+unsigned long makeDirectoryAt( directoryHandle* directory, char* filePath ) {
+    return private_addFileAt( directory, filePath, "dr" );
+}
+
+
+/* Same as deleteFilePath() for a path relative to directory. The path has
+ * to name something below the directory, not the directory itself.
+ * Returns 0 if successful, -1 otherwise. */
+int deleteFileAt( directoryHandle* directory, char* filePath ) {
+    directoryEntry entry;
+    unsigned long blockLocation = getDirectoryEntryAt( directory, filePath, &entry );
+    int isValid = 0;
+    if( blockLocation != 0 ) {
+        inodeHandle* handle = getInode( blockLocation );
+        isValid = isValidInode( handle );
+        putInode( handle );
+    }
+
+    if( !isValid ) {
+        printf( "WARNING SYSTEM ATTEMPTED TO REFERENCE A BLOCK THAT IS\n"
+                "NOT A FILE\n" );
+        return -1;
+    }
+
+    // unlink first, the parent's index needs the child's name
+    pathIterator iterator;
+    const char* component;
+    unsigned long length;
+    directoryEntry parentEntry;
+    openPath( &iterator, filePath );
+    unsigned long parentLocation = private_walkPath( directory, &iterator, &parentEntry, 1 );
+    if( !nextPathComponent( &iterator, &component, &length ) ) {
+        printf( "Invalid file path\n" );
+        return -1;
+    }
+    removeChild( parentLocation, blockLocation );
+
+    // the blocks are freed later, so deleting a big tree doesn't wait on it
+    return orphanFile( blockLocation );
+}
+
+
+/* Resolves a batch of paths, relative to directory or absolute as in
+ * getDirectoryEntryAt(), and fills blockLocations[i] with the location of
+ * filePaths[i], or 0 if it doesn't exist. The paths are sorted component
+ * by component first, so a prefix shared by many paths is walked once and
+ * every directory is visited once for all the names looked up in it.
+ * Returns how many of the paths were found. */
+unsigned long resolvePaths( directoryHandle* directory, char** filePaths, unsigned long pathCount,
+                            unsigned long* blockLocations ) {
+    pathRequest* requests = malloc( pathCount * sizeof( pathRequest ) );
+    const char* component;
+    unsigned long length;
+
+    for( unsigned long i = 0; i < pathCount; i++ ) {
+        pathRequest* request = requests + i;
+        request->index = i;
+        openPath( &request->iterator, filePaths[i] );
+
+        pathIterator rest = request->iterator;
+        request->isAbsolute = nextPathComponent( &rest, &component, &length ) &&
+                              private_compareNames( component, length, ROOTNAME, strlen( ROOTNAME ) ) == 0;
+        if( request->isAbsolute ) {
+            request->iterator = rest;
         }
-        directoryName = strtok( NULL, "/" );
     }
 
-    free( filePath );
-    return blockLocation;
+    // absolute paths sort first, then paths through the same directories
+    // end up next to each other
+    qsort( requests, pathCount, sizeof( pathRequest ), private_comparePathRequests );
+
+    unsigned long absoluteCount = 0;
+    while( absoluteCount < pathCount && requests[absoluteCount].isAbsolute ) {
+        absoluteCount++;
+    }
+    for( unsigned long i = 0; i < pathCount; i++ ) {
+        private_nextRequestComponent( requests + i );
+    }
+
+    directoryEntry start;
+    memset( (void*)&start, 0, sizeof( directoryEntry ) );
+    start.identifierType = IDENTIFIER_DIRECTORY;
+
+    pthread_mutex_lock( &pathLookupLock );
+    start.childLocation = mainSystemInfo->rootLocation;
+    private_resolveGroup( requests, absoluteCount, &start, blockLocations );
+
+    start.childLocation = 0;
+    if( directory != NULL && isValidDirectoryHandle( directory ) ) {
+        start.childLocation = directory->blockLocation;
+    }
+    private_resolveGroup( requests + absoluteCount, pathCount - absoluteCount, &start, blockLocations );
+    pthread_mutex_unlock( &pathLookupLock );
+
+    free( requests );
+
+    unsigned long foundCount = 0;
+    for( unsigned long i = 0; i < pathCount; i++ ) {
+        foundCount += blockLocations[i] != 0;
+    }
+    return foundCount;
+}
+
+
+/* Starts walking the components of filePath. The iterator only points into
+ * the caller's string and keeps all of its state itself, so a walk copies
+ * and allocates nothing and any number of walks can run at once. */
+void openPath( pathIterator* iterator, const char* filePath ) {
+    iterator->position = filePath;
+}
+
+
+/* Points component at the next component of the path and sets its length,
+ * skipping repeated slashes. The component is not NUL terminated. A newline
+ * left over from user input ends the path like the end of the string.
+ * Returns 1 if there was a component, 0 at the end of the path. */
+int nextPathComponent( pathIterator* iterator, const char** component, unsigned long* length ) {
+    const char* position = iterator->position;
+
+    while( *position == '/' ) {
+        position++;
+    }
+    if( *position == '\0' || *position == '\n' ) {
+        iterator->position = position;
+        return 0;
+    }
+
+    *component = position;
+    while( *position != '\0' && *position != '/' && *position != '\n' ) {
+        position++;
+    }
+    *length = position - *component;
+    iterator->position = position;
+
+    return 1;
 }
 
 
-/* Searches every child file of a specifed parent file using the file name,
+/* Looks up a child file of a specifed parent file using the file name,
  * and returns the child file's block location if a match is found.
  * Will return 0 if no match is found */
 unsigned long getBlockLocationFromName( unsigned long blockLocation, char* fileName ) {
+    directoryEntry entry;
+    return getDirectoryEntryFromName( blockLocation, fileName, &entry );
+}
 
-    unsigned long childBlockLocation = 0;
 
-    void* parentBuffer = calloc( file_mallocSize , 1 );
-    void* childBuffer = calloc( file_mallocSize , 1 );
+/* Same as getBlockLocationFromName() but also fills entry with the child's
+ * directory entry. A step taken before comes from the dentry cache, hit or
+ * miss, otherwise only the parent's header and index are read. */
+unsigned long getDirectoryEntryFromName( unsigned long blockLocation, char* fileName, directoryEntry* entry ) {
+    unsigned long bucket[directory_mallocSize / sizeof( unsigned long )];
+    unsigned long block[directory_mallocSize / sizeof( unsigned long )];
 
-    LBAread( parentBuffer, file_lbaSize, blockLocation);
-    file* parentFile = (file*)parentBuffer;
+    pthread_mutex_lock( &pathLookupLock );
+    unsigned long childBlockLocation = private_lookupName( blockLocation, fileName, entry,
+                                                           (hashBucket*)bucket, (directoryBlock*)block );
+    pthread_mutex_unlock( &pathLookupLock );
 
-    // read in each of the parent file's children
-    for( int i = 0; i < NUMBER_OF_CHILDREN; ++i ) {
-        LBAread( childBuffer, file_lbaSize, parentFile->children[i] );
-        file* childFile = (file*)childBuffer;
+    return childBlockLocation;
+}
 
-        if( strcmp( childFile->fileName, fileName ) == 0 ) {
-            childBlockLocation = parentFile->children[i];
-            break;
-        }
+
+/* getDirectoryEntryFromName() for a caller already holding pathLookupLock.
+ * The index is read into bucket and block. Only a step missing from the
+ * caches allocates, for the cache entries it adds. */
+unsigned long private_lookupName( unsigned long blockLocation, char* fileName, directoryEntry* entry,
+                                  hashBucket* bucket, directoryBlock* block ) {
+
+    if( lookupPathIndex( blockLocation, fileName, entry ) ||
+        lookupDentry( blockLocation, fileName, entry ) ) {
+        return entry->childLocation;
+    }
+
+    unsigned long childBlockLocation = 0;
+
+    inodeHandle* parentHandle = getInode( blockLocation );
+
+    // the directory's name index finds the child without a scan
+    if( isValidInode( parentHandle ) && isDirectory( parentHandle->inode ) ) {
+        childBlockLocation = findHashEntry( parentHandle, fileName, entry, NULL, bucket, block );
+        addDentry( blockLocation, fileName, childBlockLocation != 0 ? entry : NULL );
     }
 
-    free( parentBuffer );
-    free( childBuffer );
+    putInode( parentHandle );
 
     return childBlockLocation;
 }
@@ -346,24 +996,21 @@ char* filePathConcat( const char *s1, const char *s2 ) {
 }
 
 
-unsigned long addFile( char* filePath ) {
+unsigned long addFile( char* filePath, char* identifierTypeStr ) {
 // creates a file at the location of the specified absolute path
-
-    filePath = getCopyOfString( filePath );
+// the new header is built in memory and written to the volume once
 
     char* newFileName;
-    unsigned long newFileLocation;
     unsigned long toDirectoryLocation;
+    directoryEntry toDirectoryEntry;
 
-    // goes to directory where file will be created by "splitting" the string
-    // on the last forward slash
+    // the new file's name is everything after the last forward slash, and
+    // the directory it goes in is the rest of the path
     char *pLastBackslash = strrchr(filePath, '/');
     if( pLastBackslash && *(pLastBackslash + 1) ) {
         newFileName = pLastBackslash + 1;
-        *(pLastBackslash) = '\0';
-        toDirectoryLocation = getBlockLocationFromPath( filePath );
+        toDirectoryLocation = getParentEntryFromPath( filePath, &toDirectoryEntry );
         if( toDirectoryLocation == 0 ) {
-            free( filePath );
             return 0;
         }
     } else {
@@ -371,125 +1018,146 @@ unsigned long addFile( char* filePath ) {
         return mainSystemInfo->rootLocation;
     }
 
-    newFileLocation = makeBlank();
-    setDefaultMetadata( newFileLocation );
-    setFileName( newFileLocation, newFileName );
-    addChild( toDirectoryLocation, newFileLocation );
-    
-    free( filePath );
-    return newFileLocation;
+    return private_createChild( toDirectoryLocation, newFileName, identifierTypeStr );
 }
 
 
-unsigned long makeBlank() {
-    unsigned long newFileLocation;
-    file* newFile = calloc( file_mallocSize, 1 );
-    newFile->signature1 = FILESIGNATURE1;
-    newFile->signature2 = FILESIGNATURE2;
-    
-    newFileLocation = getFreeBlocks( file_lbaSize );
-    LBAwrite( (void*)newFile, file_lbaSize, newFileLocation );
-
-    free( newFile );
-
-    return newFileLocation;
+/* Allocates the blocks for a new file header and returns a dirty handle to
+ * a blank header for them, or NULL if there is no space. Nothing is
+ * written until the handle is put. */
+inodeHandle* makeBlank() {
+    unsigned long newFileLocation = getFreeBlocks( file_lbaSize );
+    if( newFileLocation == 0 ) {
+        return NULL;
+    }
+    return newInode( newFileLocation );
 }
 
 
 unsigned long makeDirectory( char* filePath ) {
-    unsigned long directoryLocation;
-    directoryLocation = addFile( filePath );
-    if( directoryLocation == 0 ) {
-        return 0;
-    }
-    setFileIdentifierType( directoryLocation, "dr" );
-    return directoryLocation;
+    return addFile( filePath, "dr" );
 }
 
 
 unsigned long makeFile( char* filePath ) {
-    unsigned long fileLocation;
-    fileLocation = addFile( filePath );
-    if( fileLocation == 0 ) {
-        return 0;
-    }
-    setFileIdentifierType( fileLocation, "fl" );
-    return fileLocation;
+    return addFile( filePath, "fl" );
 }
 
 
+/* Links the child into the parent directory. The child's name and type are
+ * copied into the directory entry, so they must be set before linking and
+ * not changed while linked. The directory has no fixed limit on the number
+ * of children.
+ * Returns the new number of children, or 0 if the child couldn't be added. */
 int addChild( unsigned long parentLocation, unsigned long childLocation ) {
-    file* parent = calloc( file_mallocSize, 1 );
-    LBAread( (void*)parent, file_lbaSize, parentLocation );
-
-    int currentChild;
-    for( currentChild = 0; currentChild < NUMBER_OF_CHILDREN; currentChild++ ) {
-        if( parent->children[currentChild] == 0 ) {
-            parent->children[currentChild] = childLocation;
-            break;
+    pthread_mutex_lock( &pathLookupLock );
+    inodeHandle* parentHandle = getInode( parentLocation );
+    inodeHandle* childHandle = getInode( childLocation );
+    directoryPosition position;
+    directoryEntry entry;
+    int numberOfChildren = 0;
+
+    memset( (void*)&entry, 0, sizeof( directoryEntry ) );
+    entry.childLocation = childLocation;
+    entry.identifierType = childHandle->inode->identifierType;
+    strcpy( entry.fileName, childHandle->inode->fileName );
+
+    if( appendDirectoryEntry( parentHandle, &entry, &position ) == 0 ) {
+        if( insertHashEntry( parentHandle, entry.fileName, childLocation, &position ) == 0 ) {
+            numberOfChildren = parentHandle->inode->childCount;
+            addDentry( parentLocation, entry.fileName, &entry );
+            addPathIndexEntry( parentLocation, &entry );
+        }
+        else {
+            // no room for the index entry, back the child out again
+            removeDirectoryEntry( parentHandle, &position, &entry );
         }
     }
 
-    LBAwrite( (void*)parent, file_lbaSize, parentLocation );
+    putInode( childHandle );
+    putInode( parentHandle );
+    pthread_mutex_unlock( &pathLookupLock );
+
+    return numberOfChildren;
+}
 
-    free( parent );
 
-    int numberOfChildren = currentChild + 1;
-    
-    if( numberOfChildren <= NUMBER_OF_CHILDREN ) {
-        return numberOfChildren;
+/* Links count children into the parent directory at once, see addChild().
+ * entries hold each child's location, type and name. The directory blocks
+ * they land in and the index buckets are written once per block rather
+ * than once per child.
+ * Returns how many were linked, always the first ones of entries. */
+unsigned int addChildren( unsigned long parentLocation, directoryEntry* entries, unsigned int count ) {
+    pthread_mutex_lock( &pathLookupLock );
+    inodeHandle* parentHandle = getInode( parentLocation );
+    directoryPosition* positions = malloc( count * sizeof( directoryPosition ) );
+
+    unsigned int added = appendDirectoryEntries( parentHandle, entries, count, positions );
+    unsigned int linked = insertHashEntries( parentHandle, entries, added, positions );
+    for( unsigned int i = 0; i < linked; i++ ) {
+        addDentry( parentLocation, entries[i].fileName, entries + i );
+        addPathIndexEntry( parentLocation, entries + i );
     }
-    else {
-        return 0;
+
+    // no room for the rest of the index entries, back those children out
+    // again starting from the last so none of the others has to move
+    for( unsigned int i = added; i > linked; i-- ) {
+        directoryEntry movedEntry;
+        removeDirectoryEntry( parentHandle, positions + i - 1, &movedEntry );
     }
+
+    free( positions );
+    putInode( parentHandle );
+    pthread_mutex_unlock( &pathLookupLock );
+
+    return linked;
 }
 
 
+/* Unlinks the child from the parent directory. This does not free the
+ * child, and has to happen while the child still exists since its name is
+ * needed to find it in the parent's index. Returns the remaining number of children, or -1 if the child
+ * wasn't found. */
 int removeChild( unsigned long parentLocation, unsigned long childLocation ) {
-    file* parent = calloc( file_mallocSize, 1 );
-    LBAread( (void*)parent, file_lbaSize, parentLocation );
-
-    int currentChild;
-    for( currentChild = 0; currentChild < NUMBER_OF_CHILDREN; currentChild++ ) {
-        if( parent->children[currentChild] == childLocation ) {
-            break;
+    pthread_mutex_lock( &pathLookupLock );
+    inodeHandle* parentHandle = getInode( parentLocation );
+    inodeHandle* childHandle = getInode( childLocation );
+    directoryPosition position;
+    int returnValue = -1;
+
+    // the index tells us where the child is, the directory then fills the
+    // hole with its last child whose index entry has to follow it
+    if( removeHashEntry( parentHandle, childHandle->inode->fileName,
+                         childLocation, &position ) == 0 ) {
+        directoryEntry movedEntry;
+        if( removeDirectoryEntry( parentHandle, &position, &movedEntry ) ) {
+            moveHashEntry( parentHandle, movedEntry.fileName, movedEntry.childLocation, &position );
         }
+        returnValue = parentHandle->inode->childCount;
+        addDentry( parentLocation, childHandle->inode->fileName, NULL );
+        removePathIndexEntry( parentLocation, childHandle->inode->fileName );
     }
 
-    if( currentChild == NUMBER_OF_CHILDREN ) {
-        return -1;
-    }
-
-    while( parent->children[currentChild] != 0 ) {
-        parent->children[currentChild] = parent->children[currentChild+1];
-        currentChild++;
-    }
+    putInode( childHandle );
+    putInode( parentHandle );
+    pthread_mutex_unlock( &pathLookupLock );
 
-    LBAwrite( (void*)parent, file_lbaSize, parentLocation );
-
-    free( parent );
-
-    return currentChild;
+    return returnValue;
 }
 
 
 void listChildren( unsigned long blockLocation ) {
-    file* parentDirectory = calloc( file_mallocSize, 1 );
-    file* childFile = calloc( file_mallocSize, 1 );
-    LBAread( (void*)parentDirectory, file_lbaSize, blockLocation );
-
-    for( int i = 0; i < NUMBER_OF_CHILDREN; i++ ) {
-        if( parentDirectory->children[i] != 0 ) {
-            LBAread( (void*)childFile, file_lbaSize, parentDirectory->children[i]);
-            printf("%s\n", childFile->fileName );
-        }
-        else {
-            break;
-        }
+    inodeHandle* parentHandle = getInode( blockLocation );
+    directoryIterator* iterator = openDirectory( parentHandle );
+    directoryEntry* childEntry;
+
+    // names come straight from the directory blocks
+    while( ( childEntry = nextDirectoryEntry( iterator ) ) != NULL ) {
+        printf("%s\n", childEntry->fileName );
     }
 
-    free( parentDirectory );
-    free( childFile );
+    closeDirectory( iterator );
+    putInode( parentHandle );
 }
 
 
@@ -503,11 +1171,10 @@ void listChildrenFromPath( char* absolutePath ) {
 int setDefaultMetadata( unsigned long blockLocation ) {
 // convenience function to call all default file setters in one place
 
-    setFileCreatedAt( blockLocation );
-    setFileId( blockLocation );
-    setFileModifiedAt( blockLocation );
-    setFilePermissions( blockLocation, "write" );
-    return 0;
+    inodeHandle* handle = getInode( blockLocation );
+    int returnValue = setInodeDefaultMetadata( handle );
+    putInode( handle );
+    return returnValue;
 }
 
 
@@ -515,97 +1182,150 @@ int setFileCreatedAt( unsigned long blockLocation ) {
 // sets the created date of the file to the current time
 // this should only be called once during file creation
 
-    void* buffer = calloc( file_mallocSize , 1 );
-    LBAread( buffer, file_lbaSize, blockLocation);
-    file* currentFile = (file*)buffer;
-
-    // currrent time
-    currentFile->created = time( NULL );
-
-    LBAwrite( buffer, file_lbaSize, blockLocation );
-    free( buffer );
-    return 0;
+    inodeHandle* handle = getInode( blockLocation );
+    int returnValue = setInodeCreatedAt( handle );
+    putInode( handle );
+    return returnValue;
 }
 
 
 int setFileModifiedAt( unsigned long blockLocation ) {
 // sets the modified date of the file to the current time
 
-    void* buffer = calloc( file_mallocSize , 1 );
-    LBAread( buffer, file_lbaSize, blockLocation);
-    file* currentFile = (file*)buffer;
-
-    // current time
-    currentFile->modified = time( NULL );
-    
-    LBAwrite( buffer, file_lbaSize, blockLocation );
-    free( buffer );
-
-    return 0;
+    inodeHandle* handle = getInode( blockLocation );
+    int returnValue = setInodeModifiedAt( handle );
+    putInode( handle );
+    return returnValue;
 }
 
 
 int setFileId( unsigned long blockLocation ) {
-// uses a random number generator to set file id
+// gives the file the next inode number
 // this should only be called once during file creation
 
-    void* buffer = malloc( file_mallocSize );
-    LBAread( buffer, file_lbaSize, blockLocation );
-    file* currentFile = (file*)buffer;
+    inodeHandle* handle = getInode( blockLocation );
+    int returnValue = setInodeId( handle );
+    putInode( handle );
+    return returnValue;
+}
 
-    srand( (unsigned) time(NULL) );
 
-    for ( int i = 0; i < ID_LENGTH-1; ++i ) {
-        currentFile->id[i] = rand() % 10 + '0';
-    }
+int setFileName( unsigned long blockLocation, char* fileName ) {
+// clears the current name and write the new name
+
+    inodeHandle* handle = getInode( blockLocation );
+    int returnValue = setInodeName( handle, fileName );
+    putInode( handle );
+    return returnValue;
+}
 
-    LBAwrite( buffer, file_lbaSize, blockLocation );
-    free( buffer );
 
-    return 0;
+unsigned int getFilePermissons( unsigned long blockLocation ) {
+// takes in block location and returns permissions of the file
+
+    inodeHandle* handle = getInode( blockLocation );
+    unsigned int permissions = handle->inode->permissions;
+    putInode( handle );
+
+    return permissions;
 }
 
 
-int setFileName( unsigned long blockLocation, char* fileName ) {
-// clears the current name and write the new name
+int setFilePermissions( unsigned long blockLocation, char* newPermissionStr ) {
+// takes in a permissions string ("read", "write", "execute") and modifies permissions accordingly
 
-    void* buffer = calloc( file_mallocSize , 1 );
-    LBAread( buffer, file_lbaSize, blockLocation);
-    file* currentFile = (file*)buffer;
+    inodeHandle* handle = getInode( blockLocation );
+    int returnValue = setInodePermissions( handle, newPermissionStr );
+    putInode( handle );
+    return returnValue;
+}
+
+
+int setCount( unsigned long blockLocation, unsigned int count ) {
+// takes in block location and returns starting block location of file data
+
+    inodeHandle* handle = getInode( blockLocation );
+    int returnValue = setInodeCount( handle, count );
+    putInode( handle );
+    return returnValue;
+}
 
-    // clear current name
-    memset( currentFile->fileName, '\0', sizeof(currentFile->fileName) );
-    strcpy( currentFile->fileName, fileName );
 
-    LBAwrite( buffer, file_lbaSize, blockLocation );
-    free( buffer );
+int setFileIdentifierType( unsigned long blockLocation, char* identifierTypeStr ) {
+// takes in a indentifier type ("dr", "fl", "-lnk") and sets type accordingly
+// this should only be called once during file creation
 
+    inodeHandle* handle = getInode( blockLocation );
+    int returnValue = setInodeIdentifierType( handle, identifierTypeStr );
+    putInode( handle );
+    return returnValue;
+}
+
+
+/* The setInode functions below are the in-memory versions of the setters
+ * above. They only modify the header held by the handle and mark it dirty,
+ * so any number of them can be applied before a single putInode(). */
+
+int setInodeDefaultMetadata( inodeHandle* handle ) {
+    setInodeCreatedAt( handle );
+    setInodeId( handle );
+    setInodeModifiedAt( handle );
+    setInodePermissions( handle, "write" );
     return 0;
 }
 
 
-unsigned int getFilePermissons( unsigned long blockLocation ) {
-// takes in block location and returns permissions of the file
+/* The timestamp setters only mark the header's times dirty, so setting them
+ * alone never costs a header write, see markInodeTimesDirty() */
+int setInodeCreatedAt( inodeHandle* handle ) {
+    // currrent time
+    struct timespec now;
+    clock_gettime( CLOCK_REALTIME, &now );
+    handle->inode->created = now.tv_sec;
+    handle->inode->createdNanoseconds = now.tv_nsec;
+    markInodeTimesDirty( handle );
+    return 0;
+}
+
+
+int setInodeModifiedAt( inodeHandle* handle ) {
+    // current time
+    struct timespec now;
+    clock_gettime( CLOCK_REALTIME, &now );
+    handle->inode->modified = now.tv_sec;
+    handle->inode->modifiedNanoseconds = now.tv_nsec;
+    markInodeTimesDirty( handle );
+    return 0;
+}
 
-    void* buffer = malloc( file_mallocSize );
-    LBAread( buffer, file_lbaSize, blockLocation );
-    file* currentFile = (file*)buffer;
 
-    unsigned int permissions = currentFile->permissions;
-    free( buffer );
+int setInodeId( inodeHandle* handle ) {
+    // a file given a new number gives up its old one
+    if( handle->inode->inodeNumber != 0 ) {
+        removeInodeNumber( handle->inode->inodeNumber );
+    }
 
-    return permissions;
+    handle->inode->inodeNumber = allocateInodeNumber( handle->blockLocation );
+    if( handle->inode->inodeNumber == 0 ) {
+        printf( "ERROR: NO SPACE LEFT IN THE INODE INDEX\n" );
+    }
+
+    markInodeDirty( handle );
+    return handle->inode->inodeNumber != 0 ? 0 : -1;
 }
 
 
-int setFilePermissions( unsigned long blockLocation, char* newPermissionStr ) {
-// takes in a permissions string ("read", "write", "execute") and modifies permissions accordingly
+int setInodeName( inodeHandle* handle, char* fileName ) {
+    // clear current name
+    memset( handle->inode->fileName, '\0', sizeof(handle->inode->fileName) );
+    strcpy( handle->inode->fileName, fileName );
+    markInodeDirty( handle );
+    return 0;
+}
 
-    unsigned int newPermissionInt;
 
-    void* buffer = calloc( file_mallocSize , 1 );
-    LBAread( buffer, file_lbaSize, blockLocation );
-    file* currentFile = (file*)buffer;
+int setInodePermissions( inodeHandle* handle, char* newPermissionStr ) {
+    unsigned int newPermissionInt;
 
     if( strcmp( "read", newPermissionStr ) == 0 ) {
         newPermissionInt = PERMISSION_READ;
@@ -618,135 +1338,563 @@ int setFilePermissions( unsigned long blockLocation, char* newPermissionStr ) {
         return -1;
     }
 
-    currentFile->permissions = newPermissionInt;
-    
-    LBAwrite( buffer, file_lbaSize, blockLocation );
-    free( buffer );
+    handle->inode->permissions = newPermissionInt;
+    markInodeDirty( handle );
+    return 0;
+}
+
 
+int setInodeCount( inodeHandle* handle, unsigned int count ) {
+    handle->inode->fileSize = count;
+    markInodeDirty( handle );
     return 0;
 }
 
 
-int setStartingBlock( unsigned long headerBlockLocation, unsigned long dataBlockLocation ) {
-// takes in block location and returns starting block location of file data
+int setInodeIdentifierType( inodeHandle* handle, char* identifierTypeStr ) {
+    unsigned int identifierTypeInt;
+
+    if( strcmp( "dr", identifierTypeStr ) == 0 ) {
+        identifierTypeInt = IDENTIFIER_DIRECTORY;
+    } else if( strcmp( "fl", identifierTypeStr ) == 0 ) {
+        identifierTypeInt = IDENTIFIER_FILE;
+    } else if( strcmp( "drlnk", identifierTypeStr ) == 0 ) {
+        identifierTypeInt = IDENTIFIER_FILE_LINK;
+    } else if( strcmp( "fllnk", identifierTypeStr ) == 0 ) {
+        identifierTypeInt = IDENTIFIER_DIRECTORY_LINK;
+    } else {
+        printf("Invalid Permissions given\n");
+        return -1;
+    }
+
+    handle->inode->identifierType = identifierTypeInt;
+    markInodeDirty( handle );
+    return 0;
+}
+
+
+int writeFileData( unsigned long headerBlockLocation, void* fileBuffer, unsigned long fileSize ) {
+// modifies the content of a file at the block location passed in
+// the header is read once and written back once
+
+    unsigned long failures = allocationFailures;
+    int returnValue = private_writeFileData( headerBlockLocation, fileBuffer, fileSize );
+    if( returnValue != 0 && reclaimForRetry( failures ) ) {
+        returnValue = private_writeFileData( headerBlockLocation, fileBuffer, fileSize );
+    }
+    return returnValue;
+}
 
-    void* buffer = malloc( file_mallocSize );
-    LBAread( buffer, file_lbaSize, headerBlockLocation );
-    file* currentFile = (file*)buffer;
 
-    if( currentFile->startingBlock != 0 ) {
-        delete( currentFile->startingBlock, currentFile->fileSize );
+int private_writeFileData( unsigned long headerBlockLocation, void* fileBuffer, unsigned long fileSize ) {
+
+    inodeHandle* handle = getInode( headerBlockLocation );
+
+    if( !isWritable( handle->inode ) ) {
+        printf( "ERROR: FILE IS READ ONLY\n" );
+        putInode( handle );
+        return -1;
+    }
+
+    // small files live in the header itself, which saves the allocation
+    // and the extra block read and write
+    if( fileSize <= file_inlineCapacity ) {
+        freeExtents( handle );
+        memset( (void*)handle->inode->inlineData, 0, file_inlineCapacity );
+        memcpy( (void*)handle->inode->inlineData, fileBuffer, fileSize );
+    }
+    else {
+        // the blocks the file already has are reused, so only the
+        // difference is allocated or freed
+        unsigned long blocksNeeded =
+            ( fileSize + mainSystemInfo->lbaSize - 1 ) / mainSystemInfo->lbaSize;
+        if( blocksNeeded > handle->inode->blockCount ) {
+            if( allocateExtents( handle, blocksNeeded - handle->inode->blockCount ) != 0 ) {
+                printf( "ERROR: NOT ENOUGH FREE SPACE\n" );
+                putInode( handle );
+                return -1;
+            }
+        }
+        else {
+            truncateExtents( handle, blocksNeeded );
+        }
+
+        // every block is about to be written, so holes and blocks shared
+        // with a copy need blocks of this file's own
+        if( makeBlocksWritable( handle, 0, blocksNeeded, 0 ) != 0 ) {
+            printf( "ERROR: NOT ENOUGH FREE SPACE\n" );
+            putInode( handle );
+            return -1;
+        }
+
+        extentIterator* iterator = openExtents( handle );
+        extent* currentExtent;
+        while( ( currentExtent = nextExtent( iterator ) ) != NULL ) {
+            volumeWrite( (char*)fileBuffer + iterator->fileBlock * mainSystemInfo->lbaSize,
+                      currentExtent->count, currentExtent->startBlock );
+        }
+        closeExtents( iterator );
+        memset( (void*)handle->inode->inlineData, 0, file_inlineCapacity );
     }
 
-    currentFile->startingBlock = dataBlockLocation;
-    LBAwrite( buffer, file_lbaSize, headerBlockLocation );
-    free( buffer );
+    setInodeCount( handle, fileSize );
+    setInodeModifiedAt( handle );
+    putInode( handle );
 
     return 0;
 }
 
 
-int setCount( unsigned long blockLocation, unsigned int count ) {
-// takes in block location and returns starting block location of file data
+/* Reads the whole content of a file into a new buffer, from the header
+ * if the data is inline or from its extents otherwise. The buffer is
+ * rounded up to whole blocks with at least one zero byte past the data,
+ * and must be freed by the caller. */
+void* readFileData( inodeHandle* handle ) {
+    file* fileToRead = handle->inode;
+    unsigned long bufferMallocSize =
+        ( ( fileToRead->fileSize / mainSystemInfo->lbaSize ) + 1 ) * mainSystemInfo->lbaSize;
+    void* buffer = calloc( bufferMallocSize, 1 );
 
-    void* buffer = malloc( file_mallocSize );
-    LBAread( buffer, file_lbaSize, blockLocation );
-    file* currentFile = (file*)buffer;
+    if( isInlineData( fileToRead ) ) {
+        memcpy( buffer, (void*)fileToRead->inlineData, fileToRead->fileSize );
+    }
+    else {
+        extentIterator* iterator = openExtents( handle );
+        extent* currentExtent;
+        while( ( currentExtent = nextExtent( iterator ) ) != NULL ) {
+            // holes are already zero in the buffer
+            if( !isHole( currentExtent ) ) {
+                volumeRead( (char*)buffer + iterator->fileBlock * mainSystemInfo->lbaSize,
+                         currentExtent->count, currentExtent->startBlock );
+            }
+        }
+        closeExtents( iterator );
+    }
+
+    return buffer;
+}
 
-    currentFile->fileSize = count;
-    LBAwrite( buffer, file_lbaSize, blockLocation );
-    free( buffer );
 
-    return 0;
+/* Reads up to length bytes starting at offset into buffer. Only the blocks
+ * holding the range are read.
+ * Returns the number of bytes read, which is less than length if the file
+ * ends first, or -1 if the file can't be read. */
+long readFileAt( unsigned long headerBlockLocation, void* buffer, unsigned long offset, unsigned long length ) {
+    inodeHandle* handle = getInode( headerBlockLocation );
+    long returnValue = readInodeAt( handle, buffer, offset, length );
+    putInode( handle );
+    return returnValue;
 }
 
 
-int setFileIdentifierType( unsigned long blockLocation, char* identifierTypeStr ) {
-// takes in a indentifier type ("dr", "fl", "-lnk") and sets type accordingly
-// this should only be called once during file creation
+/* Writes length bytes from buffer starting at offset, growing the file if
+ * the range goes past its end. Any gap between the old end and offset is
+ * left as a hole that reads back as zeros. Only the blocks holding the
+ * range are written.
+ * Returns the number of bytes written, or -1 on error. */
+long writeFileAt( unsigned long headerBlockLocation, void* buffer, unsigned long offset, unsigned long length ) {
+    inodeHandle* handle = getInode( headerBlockLocation );
+    long returnValue = writeInodeAt( handle, buffer, offset, length );
+    putInode( handle );
+    return returnValue;
+}
 
-    unsigned int identifierTypeInt;
 
-    void* buffer = malloc( file_mallocSize );
-    LBAread( buffer, file_lbaSize, blockLocation );
-    file* currentFile = (file*)buffer;
+/* Adds length bytes from buffer to the end of the file */
+long appendFileData( unsigned long headerBlockLocation, void* buffer, unsigned long length ) {
+    inodeHandle* handle = getInode( headerBlockLocation );
+    long returnValue = writeInodeAt( handle, buffer, handle->inode->fileSize, length );
+    putInode( handle );
+    return returnValue;
+}
 
-    if( strcmp( "dr", identifierTypeStr ) == 0 ) {
-        identifierTypeInt = IDENTIFIER_DIRECTORY;
-    } else if( strcmp( "fl", identifierTypeStr ) == 0 ) {
-        identifierTypeInt = IDENTIFIER_FILE;
-    } else if( strcmp( "drlnk", identifierTypeStr ) == 0 ) {
-        identifierTypeInt = IDENTIFIER_FILE_LINK;
-    } else if( strcmp( "fllnk", identifierTypeStr ) == 0 ) {
-        identifierTypeInt = IDENTIFIER_DIRECTORY_LINK;
-    } else {
-        printf("Invalid Permissions given\n");
+
+/* Sets the size of the file, dropping the data past newSize or padding the
+ * file up to it with a hole */
+int truncateFile( unsigned long headerBlockLocation, unsigned long newSize ) {
+    inodeHandle* handle = getInode( headerBlockLocation );
+    int returnValue = truncateInode( handle, newSize );
+    putInode( handle );
+    return returnValue;
+}
+
+
+long readInodeAt( inodeHandle* handle, void* buffer, unsigned long offset, unsigned long length ) {
+    file* fileToRead = handle->inode;
+
+    if( !isValidInode( handle ) || !isFile( fileToRead ) || !isReadable( fileToRead ) ) {
+        printf( "Not a valid file or file not readable\n");
         return -1;
     }
 
-    currentFile->identifierType = identifierTypeInt;
-    
-    LBAwrite( buffer, file_lbaSize, blockLocation );
-    free( buffer );
+    if( offset >= fileToRead->fileSize ) {
+        return 0;
+    }
+    if( length > fileToRead->fileSize - offset ) {
+        length = fileToRead->fileSize - offset;
+    }
+
+    if( isInlineData( fileToRead ) ) {
+        memcpy( buffer, (void*)( fileToRead->inlineData + offset ), length );
+    }
+    else {
+        private_transferBlocks( handle, buffer, offset, length, 0, 0 );
+    }
+
+    return length;
+}
+
+
+long writeInodeAt( inodeHandle* handle, void* buffer, unsigned long offset, unsigned long length ) {
+    file* fileToWrite = handle->inode;
+    unsigned long oldSize = fileToWrite->fileSize;
+    unsigned long newSize = offset + length;
+
+    if( !isValidInode( handle ) || !isFile( fileToWrite ) || !isWritable( fileToWrite ) ) {
+        printf( "ERROR: FILE IS READ ONLY\n" );
+        return -1;
+    }
+
+    if( newSize < oldSize ) {
+        newSize = oldSize;
+    }
+
+    if( isInlineData( fileToWrite ) && newSize <= file_inlineCapacity ) {
+        // past the end of the data the inline area is always zero, so a
+        // gap before offset needs no filling
+        memcpy( (void*)( fileToWrite->inlineData + offset ), buffer, length );
+        markInodeDirty( handle );
+    }
+    else {
+        unsigned int blockSize = mainSystemInfo->lbaSize;
+        unsigned long firstBlock = offset / blockSize;
+        unsigned long endBlock = ( offset + length + blockSize - 1 ) / blockSize;
+        unsigned long freshFrom;
+
+        // parts of the range inside the file that are holes or shared with
+        // a copy get blocks of their own first, keeping what was there at
+        // the ends if the write only covers part of them
+        if( endBlock > fileToWrite->blockCount ) {
+            endBlock = fileToWrite->blockCount;
+        }
+        if( length > 0 && firstBlock < endBlock ) {
+            int partialEnds = ( offset % blockSize != 0 ) || ( ( offset + length ) % blockSize != 0 );
+            if( makeBlocksWritable( handle, firstBlock, endBlock - firstBlock, partialEnds ) != 0 ) {
+                printf( "ERROR: NOT ENOUGH FREE SPACE\n" );
+                return -1;
+            }
+        }
+
+        if( private_growExtents( handle, newSize, offset, &freshFrom ) != 0 ) {
+            printf( "ERROR: NOT ENOUGH FREE SPACE\n" );
+            return -1;
+        }
+
+        private_transferBlocks( handle, buffer, offset, length, 1, freshFrom );
+    }
+
+    // an overwrite inside the file only changes the times, which can wait
+    if( newSize != fileToWrite->fileSize ) {
+        fileToWrite->fileSize = newSize;
+        markInodeDirty( handle );
+    }
+    setInodeModifiedAt( handle );
+    return length;
+}
+
+
+int truncateInode( inodeHandle* handle, unsigned long newSize ) {
+    file* fileToChange = handle->inode;
+    unsigned int blockSize = mainSystemInfo->lbaSize;
+
+    if( !isValidInode( handle ) || !isFile( fileToChange ) || !isWritable( fileToChange ) ) {
+        printf( "ERROR: FILE IS READ ONLY\n" );
+        return -1;
+    }
+
+    if( newSize > fileToChange->fileSize ) {
+        if( !isInlineData( fileToChange ) || newSize > file_inlineCapacity ) {
+            // all of the growth is a hole
+            unsigned long freshFrom;
+            unsigned long holeEnd = ( ( newSize + blockSize - 1 ) / blockSize ) * blockSize;
+            if( private_growExtents( handle, newSize, holeEnd, &freshFrom ) != 0 ) {
+                printf( "ERROR: NOT ENOUGH FREE SPACE\n" );
+                return -1;
+            }
+        }
+    }
+    else if( isInlineData( fileToChange ) ) {
+        memset( (void*)( fileToChange->inlineData + newSize ), 0,
+                fileToChange->fileSize - newSize );
+    }
+    else if( newSize <= file_inlineCapacity ) {
+        // small enough to go back into the header
+        char* data = calloc( file_inlineCapacity, 1 );
+        private_transferBlocks( handle, data, 0, newSize, 0, 0 );
+        freeExtents( handle );
+        memcpy( (void*)fileToChange->inlineData, data, file_inlineCapacity );
+        free( data );
+    }
+    else {
+        truncateExtents( handle, ( newSize + blockSize - 1 ) / blockSize );
+
+        // keep the rest of the new last block zero for later growth, on a
+        // block of this file's own if it was shared with a copy
+        unsigned long lastBlock = getVolumeBlock( handle, newSize / blockSize );
+        if( newSize % blockSize != 0 && lastBlock != 0 && hasSharedBlocks( lastBlock, 1 ) ) {
+            if( makeBlocksWritable( handle, newSize / blockSize, 1, 1 ) != 0 ) {
+                printf( "ERROR: NOT ENOUGH FREE SPACE\n" );
+                return -1;
+            }
+            lastBlock = getVolumeBlock( handle, newSize / blockSize );
+        }
+        if( newSize % blockSize != 0 && lastBlock != 0 ) {
+            char* blockBuffer = calloc( blockSize, 1 );
+            volumeRead( (void*)blockBuffer, 1, lastBlock );
+            memset( (void*)( blockBuffer + newSize % blockSize ), 0,
+                    blockSize - newSize % blockSize );
+            volumeWrite( (void*)blockBuffer, 1, lastBlock );
+            free( blockBuffer );
+        }
+    }
+
+    fileToChange->fileSize = newSize;
+    markInodeDirty( handle );
+    setInodeModifiedAt( handle );
+    return 0;
+}
+
+
+/* Returns the first offset at or after offset that is not in a hole, or
+ * the file size if the rest of the file is a hole */
+unsigned long seekInodeData( inodeHandle* handle, unsigned long offset ) {
+    file* currentFile = handle->inode;
+    unsigned int blockSize = mainSystemInfo->lbaSize;
+
+    if( offset >= currentFile->fileSize ) {
+        return currentFile->fileSize;
+    }
+    if( isInlineData( currentFile ) ) {
+        return offset;
+    }
+
+    unsigned long dataBlock = nextDataBlock( handle, offset / blockSize );
+    unsigned long dataOffset = dataBlock * blockSize;
+    if( dataOffset < offset ) {
+        dataOffset = offset;
+    }
+    return dataOffset < currentFile->fileSize ? dataOffset : currentFile->fileSize;
+}
+
+
+/* Returns the first offset at or after offset that is in a hole. The end
+ * of the file counts as a hole. */
+unsigned long seekInodeHole( inodeHandle* handle, unsigned long offset ) {
+    file* currentFile = handle->inode;
+    unsigned int blockSize = mainSystemInfo->lbaSize;
+
+    if( offset >= currentFile->fileSize || isInlineData( currentFile ) ) {
+        return currentFile->fileSize;
+    }
+
+    unsigned long holeBlock = nextHoleBlock( handle, offset / blockSize );
+    unsigned long holeOffset = holeBlock * blockSize;
+    if( holeOffset < offset ) {
+        holeOffset = offset;
+    }
+    return holeOffset < currentFile->fileSize ? holeOffset : currentFile->fileSize;
+}
+
+
+/* Makes sure the file's extents cover newSize bytes, moving inline data
+ * out to the first extent if needed. New blocks before the one holding
+ * dataFrom are left as a hole, the rest are allocated. freshFrom is set to
+ * the offset where allocated blocks that have never been written start,
+ * which the caller has to fill in as nothing is read from them. */
+int private_growExtents( inodeHandle* handle, unsigned long newSize, unsigned long dataFrom,
+                         unsigned long* freshFrom ) {
+    file* currentFile = handle->inode;
+    unsigned int blockSize = mainSystemInfo->lbaSize;
+    unsigned long blocksNeeded = ( newSize + blockSize - 1 ) / blockSize;
+    unsigned long holeEnd = dataFrom / blockSize;
+
+    *freshFrom = currentFile->blockCount * blockSize;
+
+    if( blocksNeeded <= currentFile->blockCount ) {
+        return 0;
+    }
+
+    if( currentFile->blockCount == 0 && currentFile->fileSize > 0 ) {
+        unsigned long inlineBlocks = ( currentFile->fileSize + blockSize - 1 ) / blockSize;
+        if( allocateExtents( handle, inlineBlocks ) != 0 ) {
+            return -1;
+        }
+        private_transferBlocks( handle, currentFile->inlineData, 0, currentFile->fileSize, 1, 0 );
+        memset( (void*)currentFile->inlineData, 0, file_inlineCapacity );
+        *freshFrom = inlineBlocks * blockSize;
+    }
+
+    unsigned long oldBlockCount = currentFile->blockCount;
+
+    if( holeEnd > blocksNeeded ) {
+        holeEnd = blocksNeeded;
+    }
+    if( holeEnd > currentFile->blockCount ) {
+        if( appendExtent( handle, 0, holeEnd - currentFile->blockCount ) != 0 ) {
+            truncateExtents( handle, oldBlockCount );
+            return -1;
+        }
+        *freshFrom = holeEnd * blockSize;
+    }
+
+    if( blocksNeeded > currentFile->blockCount &&
+        allocateExtents( handle, blocksNeeded - currentFile->blockCount ) != 0 ) {
+        truncateExtents( handle, oldBlockCount );
+        return -1;
+    }
 
+    markInodeDirty( handle );
     return 0;
 }
 
 
-int writeFileData( unsigned long headerBlockLocation, int numberOfBlocks, void* fileBuffer, int fileSize ) {
-// modifies the content of a file at the block location passed in
+/* Copies bytes offset to offset + length of the file's extents to buffer,
+ * or from buffer if isWrite is set. Whole blocks go straight to or from
+ * buffer, one LBA call per extent, and only the partial blocks at either
+ * end go through a block sized buffer. Holes read as zeros without any
+ * I/O. When writing, partial blocks at or past freshFrom start out as zeros
+ * instead of being read. The range must not have holes when writing. */
+void private_transferBlocks( inodeHandle* handle, void* buffer, unsigned long offset,
+                             unsigned long length, int isWrite, unsigned long freshFrom ) {
+    unsigned int blockSize = mainSystemInfo->lbaSize;
+    unsigned long endOffset = offset + length;
+    char* blockBuffer = calloc( blockSize, 1 );
 
-    if( getFilePermissons( headerBlockLocation ) < PERMISSION_WRITE) {
-        printf( "ERROR: FILE IS READ ONLY\n" );
-        return -1;
+    if( length == 0 ) {
+        free( blockBuffer );
+        return;
     }
 
-    unsigned long dataBlockLocation = getFreeBlocks( numberOfBlocks );
+    extentIterator* iterator = openExtents( handle );
+    extent* currentExtent;
+    seekExtents( iterator, offset / blockSize );
+    while( ( currentExtent = nextExtent( iterator ) ) != NULL ) {
+        unsigned long extentStart = iterator->fileBlock * blockSize;
+        unsigned long extentEnd = extentStart + currentExtent->count * blockSize;
+
+        if( extentEnd <= offset ) {
+            continue;
+        }
+        if( extentStart >= endOffset ) {
+            break;
+        }
+
+        unsigned long position = offset > extentStart ? offset : extentStart;
+        unsigned long stop = endOffset < extentEnd ? endOffset : extentEnd;
+
+        if( isHole( currentExtent ) ) {
+            if( !isWrite ) {
+                memset( (void*)( (char*)buffer + ( position - offset ) ), 0, stop - position );
+            }
+            continue;
+        }
 
-    LBAwrite( fileBuffer, numberOfBlocks, dataBlockLocation );
-    setStartingBlock( headerBlockLocation, dataBlockLocation );
-    setCount( headerBlockLocation, fileSize );
+        while( position < stop ) {
+            unsigned long fileBlock = position / blockSize;
+            unsigned long volumeBlock = currentExtent->startBlock + fileBlock - iterator->fileBlock;
+            unsigned long inBlock = position % blockSize;
+            char* bufferPosition = (char*)buffer + ( position - offset );
+
+            if( inBlock == 0 && stop - position >= blockSize ) {
+                // a run of whole blocks
+                unsigned long wholeBlocks = ( stop - position ) / blockSize;
+                if( isWrite ) {
+                    volumeWrite( (void*)bufferPosition, wholeBlocks, volumeBlock );
+                }
+                else {
+                    volumeRead( (void*)bufferPosition, wholeBlocks, volumeBlock );
+                }
+                position += wholeBlocks * blockSize;
+                continue;
+            }
 
-    return 0;
+            unsigned long amount = blockSize - inBlock;
+            if( amount > stop - position ) {
+                amount = stop - position;
+            }
+
+            if( isWrite && fileBlock * blockSize >= freshFrom ) {
+                memset( (void*)blockBuffer, 0, blockSize );
+            }
+            else {
+                volumeRead( (void*)blockBuffer, 1, volumeBlock );
+            }
+
+            if( isWrite ) {
+                memcpy( (void*)( blockBuffer + inBlock ), (void*)bufferPosition, amount );
+                volumeWrite( (void*)blockBuffer, 1, volumeBlock );
+            }
+            else {
+                memcpy( (void*)bufferPosition, (void*)( blockBuffer + inBlock ), amount );
+            }
+            position += amount;
+        }
+    }
+    closeExtents( iterator );
+
+    free( blockBuffer );
 }
 
 
 int recursiveDelete( unsigned long blockLocation ) {
 // TODO: put comment here explaining the function
     
-    //Create a space for then read the file at blockLocation
-    file* currentFile = calloc( file_mallocSize , 1 );
-    LBAread( (void*)currentFile, file_lbaSize, blockLocation );
+    //Get the file at blockLocation from the inode cache
+    inodeHandle* currentHandle = getInode( blockLocation );
+    file* currentFile = currentHandle->inode;
     
     //Check to see if the file is valid by checking the signature
-    if( !isValidFile( currentFile ) ) {
+    if( !isValidInode( currentHandle ) ) {
         printf( "WARNING SYSTEM ATTEMPTED TO REFERENCE A BLOCK THAT IS\n"
                 "NOT A FILE\n" );
+        putInode( currentHandle );
         return -1;
     }
 
     //If the block location pointed to a directory, recursively
     //delete the children then delete the fileStruct
+    //The whole tree goes back on the free list in one batch
     if( isDirectory( currentFile ) && isWritable( currentFile ) ) {
-        for( int i = 0; i < NUMBER_OF_CHILDREN; i++ ) {
-            if( currentFile->children[i] > 1) {
-                recursiveDelete( currentFile->children[i] );
+        beginFreeBatch();
+        directoryIterator* iterator = openDirectory( currentHandle );
+        directoryEntry* childEntry;
+        while( ( childEntry = nextDirectoryEntry( iterator ) ) != NULL ) {
+            removePathIndexEntry( blockLocation, childEntry->fileName );
+            if( childEntry->childLocation > 1 ) {
+                recursiveDelete( childEntry->childLocation );
             }
         }
+        closeDirectory( iterator );
+        invalidateDentryDirectory( blockLocation );
+        freeHashIndex( currentHandle );
+        freeDirectoryBlocks( currentHandle );
+        removeInodeNumber( currentFile->inodeNumber );
         delete( blockLocation, file_lbaSize );
+        putInode( currentHandle );
+        endFreeBatch();
         return 0;
     }
 
     //If the block location pointed to a file, delete the
     //contents first then delete the fileStruct
     if( isFile( currentFile ) && isWritable( currentFile ) ) {
-        int contentBlockAmount = currentFile->fileSize / mainSystemInfo->lbaSize + 1;
-        delete( currentFile->startingBlock, contentBlockAmount );
+        freeExtents( currentHandle );
+        removeInodeNumber( currentFile->inodeNumber );
         delete( blockLocation, file_lbaSize );
     }
 
-    //Free the malloc'ed block
-    free( currentFile );
+    //Give back the handle, delete() already dropped it from the cache
+    putInode( currentHandle );
 
     return 0;
 }
@@ -764,6 +1912,29 @@ int delete( unsigned long blockLocation, unsigned int amountToFree ) {
         return -1;
     }
 
+    pthread_mutex_lock( &freeSpaceLock );
+
+    //Any cached headers in the freed range no longer exist
+    invalidateInodeRange( blockLocation, amountToFree );
+
+    //While a batch is open the run is only noted, see endFreeBatch()
+    if( freeBatchDepth > 0 ) {
+        if( freeBatchCount == freeBatchCapacity ) {
+            if( freeBatchCount >= FREE_BATCH_MAX_RUNS ) {
+                private_applyFreeBatch();
+            }
+            else {
+                freeBatchCapacity = freeBatchCapacity == 0 ? 64 : freeBatchCapacity * 2;
+                freeBatch = realloc( freeBatch, freeBatchCapacity * sizeof( freeRun ) );
+            }
+        }
+        freeBatch[freeBatchCount].startBlock = blockLocation;
+        freeBatch[freeBatchCount].count = amountToFree;
+        freeBatchCount++;
+        pthread_mutex_unlock( &freeSpaceLock );
+        return 0;
+    }
+
     //Malloc the space for the new, head, and last blocks
     freeSpace* newFreeBlock = calloc( free_mallocSize , 1 );
     numberOfAllocs++;
@@ -774,14 +1945,14 @@ int delete( unsigned long blockLocation, unsigned int amountToFree ) {
     //We get the lastFreeBlock by first getting the head and getting
     //the previous node, since the doubly linked list is circular
     // ... <--> secondToLast <--> Last <--> HEAD <--> Second <--> Third <--> ...
-    LBAread( (void*)freeHeadBlock, free_lbaSize, mainSystemInfo->freeHeadBlock );
+    volumeRead( (void*)freeHeadBlock, free_lbaSize, mainSystemInfo->freeHeadBlock );
     if( freeHeadBlock->prev == mainSystemInfo->freeHeadBlock ) {
         lastFreeBlock = freeHeadBlock;
     }
     else {
         lastFreeBlock = calloc( free_mallocSize , 1 );
         numberOfAllocs++;
-        LBAread( (void*)lastFreeBlock, free_lbaSize, freeHeadBlock->prev );
+        volumeRead( (void*)lastFreeBlock, free_lbaSize, freeHeadBlock->prev );
     }
 
     //Links the new free block to the head block and last block
@@ -795,9 +1966,9 @@ int delete( unsigned long blockLocation, unsigned int amountToFree ) {
     lastFreeBlock->next = blockLocation;
 
     //Write all the blocks now that they are set
-    LBAwrite( (void*)newFreeBlock, free_lbaSize, blockLocation );
-    LBAwrite( (void*)freeHeadBlock, free_lbaSize, newFreeBlock->next );
-    LBAwrite( (void*)lastFreeBlock, free_lbaSize, newFreeBlock->prev );
+    volumeWrite( (void*)newFreeBlock, free_lbaSize, blockLocation );
+    volumeWrite( (void*)freeHeadBlock, free_lbaSize, newFreeBlock->next );
+    volumeWrite( (void*)lastFreeBlock, free_lbaSize, newFreeBlock->prev );
 
     //Free all the malloc'ed blocks
     if( numberOfAllocs == 1 ) {
@@ -813,27 +1984,111 @@ int delete( unsigned long blockLocation, unsigned int amountToFree ) {
         free( lastFreeBlock );
     }
 
+    pthread_mutex_unlock( &freeSpaceLock );
     return 0;
 }
 
 
-int deleteFilePath( char* filePath ) {
-    unsigned long blockLocation = getBlockLocationFromPath( filePath );
-    int returnValue = recursiveDelete( blockLocation );
+/* Starts gathering the blocks delete() frees instead of putting each run
+ * on the free list as it comes. Batches nest, the blocks go back on the
+ * list when the outermost one ends. Until then they can't be handed out
+ * again, so a batch is for operations that only free. */
+void beginFreeBatch() {
+    pthread_mutex_lock( &freeSpaceLock );
+    freeBatchDepth++;
+    pthread_mutex_unlock( &freeSpaceLock );
+}
 
-    if( returnValue == -1 ) {
-        return -1;
+
+/* Ends a batch. When it is the outermost one, the runs it gathered are
+ * sorted, neighbours are merged into one run, and the merged runs are put
+ * on the free list together, reading and writing the list's head and
+ * tail once for all of them. */
+void endFreeBatch() {
+    pthread_mutex_lock( &freeSpaceLock );
+    if( freeBatchDepth > 0 ) {
+        freeBatchDepth--;
+        if( freeBatchDepth == 0 ) {
+            private_applyFreeBatch();
+            free( freeBatch );
+            freeBatch = NULL;
+            freeBatchCapacity = 0;
+        }
     }
+    pthread_mutex_unlock( &freeSpaceLock );
+}
 
-    char* parentPath = getParentPath( filePath );
-    unsigned long parentLocation = getBlockLocationFromPath( parentPath );
-    free( parentPath );
-    removeChild( parentLocation, blockLocation );
-    return 0;
+
+int private_compareFreeRuns( const void* first, const void* second ) {
+    const freeRun* firstRun = first;
+    const freeRun* secondRun = second;
+    return ( firstRun->startBlock > secondRun->startBlock ) - ( firstRun->startBlock < secondRun->startBlock );
+}
+
+
+/* Puts the gathered runs on the end of the free list, the same place
+ * delete() puts a single run, as one chain */
+void private_applyFreeBatch() {
+    if( freeBatchCount == 0 ) {
+        return;
+    }
+
+    qsort( (void*)freeBatch, freeBatchCount, sizeof( freeRun ), &private_compareFreeRuns );
+    unsigned long runCount = 1;
+    for( unsigned long i = 1; i < freeBatchCount; i++ ) {
+        freeRun* lastRun = freeBatch + runCount - 1;
+        // a run's count has to fit in its freeSpace node
+        if( lastRun->startBlock + lastRun->count == freeBatch[i].startBlock &&
+            lastRun->count + freeBatch[i].count <= UINT_MAX ) {
+            lastRun->count += freeBatch[i].count;
+        }
+        else {
+            freeBatch[runCount++] = freeBatch[i];
+        }
+    }
+
+    freeSpace* newFreeBlock = calloc( free_mallocSize, 1 );
+    freeSpace* freeHeadBlock = calloc( free_mallocSize, 1 );
+    freeSpace* lastFreeBlock = freeHeadBlock;
+
+    volumeRead( (void*)freeHeadBlock, free_lbaSize, mainSystemInfo->freeHeadBlock );
+    unsigned long lastFreeLocation = freeHeadBlock->prev;
+    if( lastFreeLocation != mainSystemInfo->freeHeadBlock ) {
+        lastFreeBlock = calloc( free_mallocSize, 1 );
+        volumeRead( (void*)lastFreeBlock, free_lbaSize, lastFreeLocation );
+    }
+
+    newFreeBlock->signature1 = FREESIGNATURE1;
+    newFreeBlock->signature2 = FREESIGNATURE2;
+    for( unsigned long i = 0; i < runCount; i++ ) {
+        newFreeBlock->count = freeBatch[i].count;
+        newFreeBlock->prev = i == 0 ? lastFreeLocation : freeBatch[i - 1].startBlock;
+        newFreeBlock->next = i == runCount - 1 ? mainSystemInfo->freeHeadBlock : freeBatch[i + 1].startBlock;
+        volumeWrite( (void*)newFreeBlock, free_lbaSize, freeBatch[i].startBlock );
+    }
+
+    freeHeadBlock->prev = freeBatch[runCount - 1].startBlock;
+    lastFreeBlock->next = freeBatch[0].startBlock;
+    volumeWrite( (void*)freeHeadBlock, free_lbaSize, mainSystemInfo->freeHeadBlock );
+    volumeWrite( (void*)lastFreeBlock, free_lbaSize, lastFreeLocation );
+
+    if( lastFreeBlock != freeHeadBlock ) {
+        free( lastFreeBlock );
+    }
+    free( freeHeadBlock );
+    free( newFreeBlock );
+
+    freeBatchCount = 0;
+}
+
+
+int deleteFilePath( char* filePath ) {
+    return deleteFileAt( NULL, filePath );
 }
 
 
 unsigned long getFreeBlocks( unsigned int numberOfFreeBlocksWanted ) {
+    pthread_mutex_lock( &freeSpaceLock );
     unsigned long startBlock = mainSystemInfo->freeHeadBlock;
     int numberOfAllocs = 0;
     
@@ -841,14 +2096,14 @@ unsigned long getFreeBlocks( unsigned int numberOfFreeBlocksWanted ) {
     numberOfAllocs++;
     freeSpace* previousFreeBlock;
     freeSpace* nextFreeBlock;
-    LBAread( (void*)currentFreeBlock, free_lbaSize, mainSystemInfo->freeHeadBlock );
+    volumeRead( (void*)currentFreeBlock, free_lbaSize, mainSystemInfo->freeHeadBlock );
     
     /* Iterate through the list and find a block big enough for the desired
      * size */
     while( currentFreeBlock->count < numberOfFreeBlocksWanted &&
            currentFreeBlock->next != mainSystemInfo->freeHeadBlock ) {
                startBlock = currentFreeBlock->next;
-               LBAread( (void*)currentFreeBlock, free_lbaSize, currentFreeBlock->next );
+               volumeRead( (void*)currentFreeBlock, free_lbaSize, currentFreeBlock->next );
     }
 
     /* I was having problems when the nodes in the list refer to the same node
@@ -859,42 +2114,46 @@ unsigned long getFreeBlocks( unsigned int numberOfFreeBlocksWanted ) {
      * You would then only end up writing half of the changes because copy 1
      * got a change and copy 2 got a change but you are writing copy 2 last so
      * the node only gets the changes in copy 2. */
-    if( currentFreeBlock->next == mainSystemInfo->freeHeadBlock ) {
+    if( currentFreeBlock->next == startBlock ) {
+        // the only node, which is its own next and previous
         previousFreeBlock = currentFreeBlock;
         nextFreeBlock = currentFreeBlock;
     }
     else if ( currentFreeBlock->next == currentFreeBlock->prev ) {
         previousFreeBlock = calloc( free_mallocSize, 1 );
         numberOfAllocs++;
-        LBAread( (void*)previousFreeBlock, free_lbaSize, currentFreeBlock->prev );
+        volumeRead( (void*)previousFreeBlock, free_lbaSize, currentFreeBlock->prev );
         nextFreeBlock = previousFreeBlock;
     }
     else {
         previousFreeBlock = calloc( free_mallocSize, 1 );
         numberOfAllocs++;
-        LBAread( (void*)previousFreeBlock, free_lbaSize, currentFreeBlock->prev );
+        volumeRead( (void*)previousFreeBlock, free_lbaSize, currentFreeBlock->prev );
         nextFreeBlock = calloc( free_mallocSize, 1 );
         numberOfAllocs++;
-        LBAread( (void*)nextFreeBlock, free_lbaSize, currentFreeBlock->next );
+        volumeRead( (void*)nextFreeBlock, free_lbaSize, currentFreeBlock->next );
     }
 
-    /* Sets all the next and previous node values */
-    if( currentFreeBlock->count >= numberOfFreeBlocksWanted ) {
+    /* Sets all the next and previous node values. The last free run is
+     * never handed out whole, as the list can't be empty. */
+    if( currentFreeBlock->count >= numberOfFreeBlocksWanted &&
+        !( currentFreeBlock->count == numberOfFreeBlocksWanted &&
+           currentFreeBlock->next == startBlock ) ) {
 
         currentFreeBlock->count = currentFreeBlock->count - numberOfFreeBlocksWanted;
         
         if( currentFreeBlock->count == 0 ) {
             previousFreeBlock->next = currentFreeBlock->next;
             nextFreeBlock->prev = currentFreeBlock->prev;
-            LBAwrite( (void*)previousFreeBlock, free_lbaSize, currentFreeBlock->prev );
-            LBAwrite( (void*)nextFreeBlock, free_lbaSize, currentFreeBlock->next );
+            volumeWrite( (void*)previousFreeBlock, free_lbaSize, currentFreeBlock->prev );
+            volumeWrite( (void*)nextFreeBlock, free_lbaSize, currentFreeBlock->next );
         }
         else {
             previousFreeBlock->next = previousFreeBlock->next + numberOfFreeBlocksWanted;
             nextFreeBlock->prev = previousFreeBlock->next;
-            LBAwrite( (void*)previousFreeBlock, free_lbaSize, currentFreeBlock->prev );
-            LBAwrite( (void*)nextFreeBlock, free_lbaSize, currentFreeBlock->next );
-            LBAwrite( (void*)currentFreeBlock, free_lbaSize, previousFreeBlock->next );
+            volumeWrite( (void*)previousFreeBlock, free_lbaSize, currentFreeBlock->prev );
+            volumeWrite( (void*)nextFreeBlock, free_lbaSize, currentFreeBlock->next );
+            volumeWrite( (void*)currentFreeBlock, free_lbaSize, previousFreeBlock->next );
         }
 
         if( startBlock == mainSystemInfo->freeHeadBlock ) {
@@ -919,6 +2178,13 @@ unsigned long getFreeBlocks( unsigned int numberOfFreeBlocksWanted ) {
         free( nextFreeBlock );
     }
 
+    // the operation can free the deleted files and try again once it is
+    // out of the middle of things, see reclaimForRetry()
+    if( startBlock == 0 ) {
+        allocationFailures++;
+    }
+    pthread_mutex_unlock( &freeSpaceLock );
+
     return startBlock;
 }
 
@@ -928,10 +2194,11 @@ int isFile( file* fileToCheck ) {
 }
 
 int isFile_pathVersion( char* path ) {
-    unsigned long blockLocation = getBlockLocationFromPath( path );
-    file* fileToCheck = calloc( file_mallocSize, 1 );
-    LBAread( (void*)fileToCheck, file_lbaSize, blockLocation );
-    return isFile( fileToCheck );
+    directoryEntry entry;
+    if( getDirectoryEntryFromPath( path, &entry ) == 0 ) {
+        return 0;
+    }
+    return entry.identifierType == IDENTIFIER_FILE;
 }
 
 
@@ -956,7 +2223,8 @@ int isReadable( file* fileToCheck ) {
 
 
 int isWritable( file* fileToCheck ) {
-    return ( fileToCheck->permissions >= PERMISSION_WRITE );
+    // nothing in a mounted snapshot can be changed
+    return ( fileToCheck->permissions >= PERMISSION_WRITE ) && !isSnapshotMounted();
 }
 
 
@@ -964,6 +2232,11 @@ int isExecutable( file* fileToCheck ) {
     return ( fileToCheck->permissions >= PERMISSION_EXECUTE );
 }
 
+/* A file with no data blocks keeps its data (if any) in the header */
+int isInlineData( file* fileToCheck ) {
+    return fileToCheck->blockCount == 0;
+}
+
 
 int isValidFile( file* fileToCheck ) {
     return ( fileToCheck->signature1 == FILESIGNATURE1 ) &&
@@ -973,7 +2246,8 @@ int isValidFile( file* fileToCheck ) {
 
 int isValidSystemInfo( sysInfo* systemInfoToCheck ) {
     return ( systemInfoToCheck->signature1 == SYSTEMSIGNATURE1 ) &&
-           ( systemInfoToCheck->signature2 == SYSTEMSIGNATURE2 );
+           ( systemInfoToCheck->signature2 == SYSTEMSIGNATURE2 ) &&
+           ( systemInfoToCheck->version == FILESYSTEM_VERSION );
 }
 
 
@@ -983,6 +2257,608 @@ int isValidFreeSpace( freeSpace* freeSpaceToCheck ) {
 }
 
 
+/* Walks the rest of the path from root, or from directory if the path
+ * doesn't start at root, and fills entry with the directory entry of the
+ * last component. If stopBeforeLast is set it stops at the one before
+ * that, and leaves iterator in front of the last component for the caller
+ * to take. Each name is copied to the stack only to terminate it for the
+ * lookup, and a step missing from the caches reads the directory's index
+ * into stack buffers. A walk through cached steps reads and allocates
+ * nothing, a missed step only allocates the cache entries it adds. The
+ * walk holds pathLookupLock throughout.
+ * Returns the block location found, or 0 if the path doesn't exist. */
+unsigned long private_walkPath( directoryHandle* directory, pathIterator* iterator,
+                                directoryEntry* entry, int stopBeforeLast ) {
+    pathIterator rest = *iterator;
+    pathIterator lookahead;
+    const char* component;
+    const char* nextComponent;
+    unsigned long length;
+    unsigned long nextLength;
+    char name[sizeof( entry->fileName )];
+    unsigned long bucket[directory_mallocSize / sizeof( unsigned long )];
+    unsigned long block[directory_mallocSize / sizeof( unsigned long )];
+
+    int isAbsolute = nextPathComponent( &rest, &component, &length ) &&
+                     length == strlen( ROOTNAME ) && strncmp( component, ROOTNAME, length ) == 0;
+
+    pthread_mutex_lock( &pathLookupLock );
+
+    memset( (void*)entry, 0, sizeof( directoryEntry ) );
+    entry->identifierType = IDENTIFIER_DIRECTORY;
+    if( isAbsolute ) {
+        // starts at root directory
+        *iterator = rest;
+        entry->childLocation = mainSystemInfo->rootLocation;
+        strcpy( entry->fileName, ROOTNAME );
+    }
+    else if( directory != NULL && isValidDirectoryHandle( directory ) ) {
+        entry->childLocation = directory->blockLocation;
+    }
+    else {
+        pthread_mutex_unlock( &pathLookupLock );
+        return 0;
+    }
+
+    rest = *iterator;
+    while( nextPathComponent( &rest, &component, &length ) ) {
+        // the parent is wanted, so the last component is not looked up
+        lookahead = rest;
+        if( stopBeforeLast && !nextPathComponent( &lookahead, &nextComponent, &nextLength ) ) {
+            break;
+        }
+        *iterator = rest;
+
+        // only directories have children, and the entry already says what
+        // the current file is. A name too long to copy can't exist.
+        if( entry->identifierType != IDENTIFIER_DIRECTORY || length >= sizeof( name ) ) {
+            entry->childLocation = 0;
+            break;
+        }
+        memcpy( name, component, length );
+        name[length] = '\0';
+
+        if( private_lookupName( entry->childLocation, name, entry,
+                                (hashBucket*)bucket, (directoryBlock*)block ) == 0 ) {
+            entry->childLocation = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock( &pathLookupLock );
+    return entry->childLocation;
+}
+
+
+/* Creates a file named by the last component of filePath in the directory
+ * the rest of it leads to.
+ * Returns the new file's block location, or 0 if it couldn't be made. */
+unsigned long private_addFileAt( directoryHandle* directory, char* filePath, char* identifierTypeStr ) {
+    pathIterator iterator;
+    const char* component;
+    unsigned long length;
+    directoryEntry parentEntry;
+    char newFileName[sizeof( parentEntry.fileName )];
+
+    openPath( &iterator, filePath );
+    unsigned long parentLocation = private_walkPath( directory, &iterator, &parentEntry, 1 );
+    if( parentLocation == 0 || parentEntry.identifierType != IDENTIFIER_DIRECTORY ||
+        !nextPathComponent( &iterator, &component, &length ) || length >= sizeof( newFileName ) ) {
+        return 0;
+    }
+    memcpy( newFileName, component, length );
+    newFileName[length] = '\0';
+
+    return private_createChild( parentLocation, newFileName, identifierTypeStr );
+}
+
+
+/* Builds a new header in memory, writes it once and links it into the
+ * parent directory. Returns its block location, or 0 if there was no space
+ * for it. */
+unsigned long private_createChild( unsigned long parentLocation, char* fileName, char* identifierTypeStr ) {
+    unsigned long failures = allocationFailures;
+    unsigned long headerLocation = getFreeBlocks( file_lbaSize );
+    if( headerLocation == 0 && reclaimForRetry( failures ) ) {
+        headerLocation = getFreeBlocks( file_lbaSize );
+    }
+    if( headerLocation == 0 ) {
+        printf( "ERROR: NO SPACE LEFT FOR A NEW FILE\n" );
+        return 0;
+    }
+
+    inodeHandle* newFile = newInode( headerLocation );
+    setInodeIdentifierType( newFile, identifierTypeStr );
+    setInodeDefaultMetadata( newFile );
+    setInodeName( newFile, fileName );
+    unsigned long newFileLocation = newFile->blockLocation;
+    putInode( newFile );
+
+    failures = allocationFailures;
+    int isLinked = addChild( parentLocation, newFileLocation ) != 0;
+    if( !isLinked && reclaimForRetry( failures ) ) {
+        isLinked = addChild( parentLocation, newFileLocation ) != 0;
+    }
+    if( !isLinked ) {
+        // nothing points at the header, give it back
+        printf( "ERROR: NO SPACE LEFT FOR A NEW FILE\n" );
+        recursiveDelete( newFileLocation );
+        return 0;
+    }
+
+    return newFileLocation;
+}
+
+
+/* Returns 1 if path names something below the directory at directoryPath */
+int private_isPathBelow( char* path, char* directoryPath ) {
+    unsigned long directoryLength = strlen( directoryPath );
+    return strncmp( path, directoryPath, directoryLength ) == 0 && path[directoryLength] == '/';
+}
+
+
+/* Returns 1 if the directory at directoryLocation is the one at
+ * ancestorLocation or below it. Its parents come from the name index, and
+ * without it the paths are compared instead, which only works for
+ * absolute paths. */
+int private_isBelow( unsigned long directoryLocation, unsigned long ancestorLocation, char* path, char* ancestorPath ) {
+    if( !isPathIndexReady() ) {
+        return private_isPathBelow( path, ancestorPath );
+    }
+
+    while( directoryLocation != 0 && directoryLocation != ancestorLocation &&
+           directoryLocation != mainSystemInfo->rootLocation ) {
+        directoryLocation = getParentDirectory( directoryLocation );
+    }
+    return directoryLocation != 0 && directoryLocation == ancestorLocation;
+}
+
+
+/* Gives the new file the old one's contents, sharing its blocks where it
+ * can */
+void private_copyData( inodeHandle* oldHandle, inodeHandle* newHandle ) {
+    file* oldFile = oldHandle->inode;
+
+    if( isInlineData( oldFile ) ) {
+        memcpy( (void*)newHandle->inode->inlineData, (void*)oldFile->inlineData, file_inlineCapacity );
+        newHandle->inode->fileSize = oldFile->fileSize;
+        markInodeDirty( newHandle );
+        setInodeModifiedAt( newHandle );
+    }
+    // the copy shares the original's blocks until either is written
+    else if( cloneExtents( oldHandle, newHandle ) == 0 ) {
+        newHandle->inode->fileSize = oldFile->fileSize;
+        markInodeDirty( newHandle );
+        setInodeModifiedAt( newHandle );
+    }
+    else {
+        // copy the data through a fixed size buffer so big files don't
+        // have to fit in memory, skipping holes so the copy keeps them
+        unsigned long bufferMallocSize = COPY_WINDOW_BLOCKS * mainSystemInfo->lbaSize;
+        void* tempDataBuffer = malloc( bufferMallocSize );
+        unsigned long offset = 0;
+        long amountRead = 0;
+
+        while( amountRead >= 0 && ( offset = seekInodeData( oldHandle, offset ) ) < oldFile->fileSize ) {
+            unsigned long dataEnd = seekInodeHole( oldHandle, offset );
+            while( offset < dataEnd ) {
+                unsigned long amount = dataEnd - offset;
+                if( amount > bufferMallocSize ) {
+                    amount = bufferMallocSize;
+                }
+                amountRead = readInodeAt( oldHandle, tempDataBuffer, offset, amount );
+                if( amountRead <= 0 || writeInodeAt( newHandle, tempDataBuffer, offset, amountRead ) < 0 ) {
+                    amountRead = -1;
+                    break;
+                }
+                offset += amountRead;
+            }
+        }
+        truncateInode( newHandle, oldFile->fileSize );
+
+        free( tempDataBuffer );
+    }
+}
+
+
+/* Copies everything below the directory at fromLocation into the empty
+ * directory at toLocation on a pool of COPY_WORKER_COUNT workers, the
+ * calling thread being one of them. Directories and their blocks are
+ * shared out as jobs, so subtrees and wide directories are copied side by
+ * side. Returns once every job is done. */
+void private_copyTree( unsigned long fromLocation, unsigned long toLocation ) {
+    copyPool pool;
+    pthread_t workers[COPY_WORKER_COUNT - 1];
+    int workerCount = 0;
+
+    pool.jobs = NULL;
+    pool.busyWorkers = 0;
+    pool.isOutOfSpace = 0;
+    pthread_mutex_init( &pool.lock, NULL );
+    pthread_cond_init( &pool.changed, NULL );
+    private_addCopyJob( &pool, NULL, fromLocation, toLocation );
+
+    // with fewer threads the copy is just slower
+    for( int i = 0; i < COPY_WORKER_COUNT - 1; i++ ) {
+        if( pthread_create( workers + workerCount, NULL, private_runCopyWorker, (void*)&pool ) == 0 ) {
+            workerCount++;
+        }
+    }
+    private_runCopyWorker( (void*)&pool );
+    for( int i = 0; i < workerCount; i++ ) {
+        pthread_join( workers[i], NULL );
+    }
+
+    pthread_cond_destroy( &pool.changed );
+    pthread_mutex_destroy( &pool.lock );
+}
+
+
+/* Hands the pool a job. With a block it is that block's children to copy
+ * into the directory at toLocation, without one it is the whole directory
+ * at fromLocation. The pool takes over the block. */
+void private_addCopyJob( copyPool* pool, directoryBlock* block,
+                         unsigned long fromLocation, unsigned long toLocation ) {
+    copyJob* job = malloc( sizeof( copyJob ) );
+    job->block = block;
+    job->fromLocation = fromLocation;
+    job->toLocation = toLocation;
+
+    pthread_mutex_lock( &pool->lock );
+    job->next = pool->jobs;
+    pool->jobs = job;
+    pthread_cond_signal( &pool->changed );
+    pthread_mutex_unlock( &pool->lock );
+}
+
+
+/* Takes jobs from the pool until there are none left and no worker is
+ * still busy with one, since that one may add more */
+void* private_runCopyWorker( void* argument ) {
+    copyPool* pool = argument;
+
+    pthread_mutex_lock( &pool->lock );
+    while( pool->jobs != NULL || pool->busyWorkers > 0 ) {
+        if( pool->jobs == NULL ) {
+            pthread_cond_wait( &pool->changed, &pool->lock );
+            continue;
+        }
+        copyJob* job = pool->jobs;
+        pool->jobs = job->next;
+        pool->busyWorkers++;
+        int isOutOfSpace = pool->isOutOfSpace;
+        pthread_mutex_unlock( &pool->lock );
+
+        // once the volume is full the rest of the jobs are only dropped
+        if( !isOutOfSpace && job->block != NULL ) {
+            private_copyBlock( pool, job->block, job->toLocation );
+        }
+        else if( !isOutOfSpace ) {
+            private_splitDirectory( pool, job->fromLocation, job->toLocation );
+        }
+        free( job->block );
+        free( job );
+
+        pthread_mutex_lock( &pool->lock );
+        pool->busyWorkers--;
+        if( pool->busyWorkers == 0 && pool->jobs == NULL ) {
+            // the last job is done, wake the others to finish
+            pthread_cond_broadcast( &pool->changed );
+        }
+    }
+    pthread_mutex_unlock( &pool->lock );
+
+    return NULL;
+}
+
+
+/* Gives the pool a job for each block of the directory at fromLocation, to
+ * be copied into the directory at toLocation */
+void private_splitDirectory( copyPool* pool, unsigned long fromLocation, unsigned long toLocation ) {
+    inodeHandle* fromDirectory = getInode( fromLocation );
+    directoryIterator* iterator = openDirectory( fromDirectory );
+    directoryBlock* block;
+
+    while( ( block = nextDirectoryBlock( iterator ) ) != NULL ) {
+        directoryBlock* blockCopy = malloc( directory_mallocSize );
+        memcpy( (void*)blockCopy, (void*)block, directory_mallocSize );
+        private_addCopyJob( pool, blockCopy, 0, toLocation );
+    }
+
+    closeDirectory( iterator );
+    putInode( fromDirectory );
+}
+
+
+/* Copies the children listed in one block of a directory being copied into
+ * the directory at toLocation. The copies are made from the directory
+ * entries, so no path is looked up again, and they are linked into the
+ * new directory at once with addChildren(). The worker takes the headers
+ * from one run of free blocks of its own when there is one, and numbers
+ * them together with allocateInodeNumbers(). Subdirectories
+ * go back to the pool once they are linked. */
+void private_copyBlock( copyPool* pool, directoryBlock* block, unsigned long toLocation ) {
+    unsigned int batchSize = block->count;
+    directoryEntry* entries = malloc( ( batchSize + 1 ) * sizeof( directoryEntry ) );
+    unsigned long* fromLocations = malloc( ( batchSize + 1 ) * sizeof( unsigned long ) );
+    unsigned int count = 0;
+    unsigned long batchLocation = batchSize > 1 ? getFreeBlocks( batchSize * file_lbaSize ) : 0;
+    // numbered all at once, so the index is written once for the batch and not per file
+    unsigned long firstNumber = batchLocation != 0 ? allocateInodeNumbers( batchLocation, batchSize ) : 0;
+    int isOutOfSpace = 0;
+
+    for( unsigned int i = 0; i < block->count; i++ ) {
+        directoryEntry* childEntry = block->children + i;
+        inodeHandle* oldHandle = getInode( childEntry->childLocation );
+        inodeHandle* newHandle = batchLocation != 0 ?
+                                 newInode( batchLocation + count * file_lbaSize ) : makeBlank();
+        if( newHandle == NULL ) {
+            // link what was made so far and stop
+            putInode( oldHandle );
+            isOutOfSpace = 1;
+            break;
+        }
+        int isChildDirectory = oldHandle->inode->identifierType == IDENTIFIER_DIRECTORY;
+
+        setInodeIdentifierType( newHandle, isChildDirectory ? "dr" : "fl" );
+        if( firstNumber != 0 ) {
+            setInodeCreatedAt( newHandle );
+            setInodeModifiedAt( newHandle );
+            setInodePermissions( newHandle, "write" );
+            newHandle->inode->inodeNumber = firstNumber + count;
+            markInodeDirty( newHandle );
+        }
+        else {
+            setInodeDefaultMetadata( newHandle );
+        }
+        setInodeName( newHandle, childEntry->fileName );
+        if( oldHandle->inode->identifierType == IDENTIFIER_FILE ) {
+            private_copyData( oldHandle, newHandle );
+        }
+
+        memset( (void*)( entries + count ), 0, sizeof( directoryEntry ) );
+        entries[count].childLocation = newHandle->blockLocation;
+        entries[count].identifierType = newHandle->inode->identifierType;
+        strcpy( entries[count].fileName, childEntry->fileName );
+        fromLocations[count] = childEntry->childLocation;
+        count++;
+
+        putInode( newHandle );
+        putInode( oldHandle );
+    }
+
+    // the headers that weren't made go back, with their numbers
+    if( batchLocation != 0 && count < batchSize ) {
+        for( unsigned int i = count; firstNumber != 0 && i < batchSize; i++ ) {
+            removeInodeNumber( firstNumber + i );
+        }
+        delete( batchLocation + count * file_lbaSize, ( batchSize - count ) * file_lbaSize );
+    }
+
+    unsigned int linked = count > 0 ? addChildren( toLocation, entries, count ) : 0;
+    if( linked < count ) {
+        beginFreeBatch();
+        for( unsigned int i = linked; i < count; i++ ) {
+            recursiveDelete( entries[i].childLocation );
+        }
+        endFreeBatch();
+        isOutOfSpace = 1;
+    }
+
+    for( unsigned int i = 0; i < linked; i++ ) {
+        if( entries[i].identifierType == IDENTIFIER_DIRECTORY ) {
+            private_addCopyJob( pool, NULL, fromLocations[i], entries[i].childLocation );
+        }
+    }
+
+    if( isOutOfSpace ) {
+        pthread_mutex_lock( &pool->lock );
+        if( !pool->isOutOfSpace ) {
+            printf( "ERROR: NO SPACE LEFT TO FINISH THE COPY\n" );
+            pool->isOutOfSpace = 1;
+        }
+        pthread_mutex_unlock( &pool->lock );
+    }
+
+    free( fromLocations );
+    free( entries );
+}
+
+
+/* qsort() order for a resolvePaths() batch: absolute paths first, then
+ * component by component, a path coming before the longer ones below it */
+int private_comparePathRequests( const void* first, const void* second ) {
+    const pathRequest* firstRequest = first;
+    const pathRequest* secondRequest = second;
+
+    if( firstRequest->isAbsolute != secondRequest->isAbsolute ) {
+        return secondRequest->isAbsolute - firstRequest->isAbsolute;
+    }
+
+    pathIterator firstPath = firstRequest->iterator;
+    pathIterator secondPath = secondRequest->iterator;
+    const char* firstComponent;
+    const char* secondComponent;
+    unsigned long firstLength;
+    unsigned long secondLength;
+
+    while( 1 ) {
+        int hasFirst = nextPathComponent( &firstPath, &firstComponent, &firstLength );
+        int hasSecond = nextPathComponent( &secondPath, &secondComponent, &secondLength );
+        if( !hasFirst || !hasSecond ) {
+            return hasFirst - hasSecond;
+        }
+
+        int order = private_compareNames( firstComponent, firstLength, secondComponent, secondLength );
+        if( order != 0 ) {
+            return order;
+        }
+    }
+}
+
+
+/* Orders two names that aren't NUL terminated */
+int private_compareNames( const char* first, unsigned long firstLength,
+                          const char* second, unsigned long secondLength ) {
+    int order = memcmp( first, second, firstLength < secondLength ? firstLength : secondLength );
+    if( order != 0 ) {
+        return order;
+    }
+    return ( firstLength > secondLength ) - ( firstLength < secondLength );
+}
+
+
+void private_nextRequestComponent( pathRequest* request ) {
+    if( !nextPathComponent( &request->iterator, &request->component, &request->length ) ) {
+        request->component = NULL;
+    }
+}
+
+
+/* Resolves a sorted group of requests that have all been walked as far as
+ * parent. Those ending there are the parent. The rest are split into runs
+ * going through the same child, the children are looked up together and
+ * each run carries on from its child. */
+void private_resolveGroup( pathRequest* requests, unsigned long count, directoryEntry* parent,
+                           unsigned long* blockLocations ) {
+    unsigned long first = 0;
+    while( first < count && requests[first].component == NULL ) {
+        blockLocations[requests[first].index] = parent->childLocation;
+        first++;
+    }
+    if( first == count ) {
+        return;
+    }
+
+    // only directories have children
+    if( parent->childLocation == 0 || parent->identifierType != IDENTIFIER_DIRECTORY ) {
+        for( unsigned long i = first; i < count; i++ ) {
+            blockLocations[requests[i].index] = 0;
+        }
+        return;
+    }
+
+    unsigned long runCount = 0;
+    for( unsigned long i = first; i < count; i++ ) {
+        if( i == first || private_compareNames( requests[i - 1].component, requests[i - 1].length,
+                                                requests[i].component, requests[i].length ) != 0 ) {
+            runCount++;
+        }
+    }
+
+    unsigned long* runStarts = malloc( ( runCount + 1 ) * sizeof( unsigned long ) );
+    directoryEntry* children = malloc( runCount * sizeof( directoryEntry ) );
+    unsigned long run = 0;
+    for( unsigned long i = first; i < count; i++ ) {
+        if( i == first || private_compareNames( requests[i - 1].component, requests[i - 1].length,
+                                                requests[i].component, requests[i].length ) != 0 ) {
+            runStarts[run++] = i;
+        }
+    }
+    runStarts[runCount] = count;
+
+    private_lookupNames( parent->childLocation, requests, runStarts, runCount, children );
+
+    for( run = 0; run < runCount; run++ ) {
+        for( unsigned long i = runStarts[run]; i < runStarts[run + 1]; i++ ) {
+            private_nextRequestComponent( requests + i );
+        }
+        private_resolveGroup( requests + runStarts[run], runStarts[run + 1] - runStarts[run],
+                              children + run, blockLocations );
+    }
+
+    free( children );
+    free( runStarts );
+}
+
+
+/* Fills children[run] with the entry named by the first request of each
+ * run, or zeroes it if there is none. Names the dentry cache doesn't know
+ * are looked up in the directory's index one by one, unless there are more
+ * of them than the directory has blocks, in which case reading through the
+ * directory once is cheaper. */
+void private_lookupNames( unsigned long parentLocation, pathRequest* requests, unsigned long* runStarts,
+                          unsigned long runCount, directoryEntry* children ) {
+    unsigned long* pendingRuns = malloc( runCount * sizeof( unsigned long ) );
+    unsigned long pendingCount = 0;
+    char name[sizeof( children->fileName )];
+    unsigned long bucket[directory_mallocSize / sizeof( unsigned long )];
+    unsigned long block[directory_mallocSize / sizeof( unsigned long )];
+
+    for( unsigned long run = 0; run < runCount; run++ ) {
+        pathRequest* request = requests + runStarts[run];
+        memset( (void*)( children + run ), 0, sizeof( directoryEntry ) );
+
+        // a name too long to copy can't exist
+        if( request->length >= sizeof( name ) ) {
+            continue;
+        }
+        memcpy( name, request->component, request->length );
+        name[request->length] = '\0';
+
+        if( !lookupPathIndex( parentLocation, name, children + run ) &&
+            !lookupDentry( parentLocation, name, children + run ) ) {
+            pendingRuns[pendingCount++] = run;
+        }
+    }
+
+    inodeHandle* parentHandle = getInode( parentLocation );
+    if( pendingCount == 0 || !isValidInode( parentHandle ) || !isDirectory( parentHandle->inode ) ) {
+        putInode( parentHandle );
+        free( pendingRuns );
+        return;
+    }
+
+    unsigned long directoryBlocks = ( parentHandle->inode->childCount + directory_childrenPerBlock - 1 ) /
+                                    directory_childrenPerBlock;
+    if( pendingCount > directoryBlocks ) {
+        // the pending runs are in sorted order, so each child is matched
+        // with a binary search
+        directoryIterator* iterator = openDirectory( parentHandle );
+        directoryEntry* childEntry;
+        while( ( childEntry = nextDirectoryEntry( iterator ) ) != NULL ) {
+            unsigned long low = 0;
+            unsigned long high = pendingCount;
+            unsigned long childLength = strlen( childEntry->fileName );
+            while( low < high ) {
+                unsigned long middle = ( low + high ) / 2;
+                pathRequest* request = requests + runStarts[pendingRuns[middle]];
+                int order = private_compareNames( request->component, request->length,
+                                                  childEntry->fileName, childLength );
+                if( order == 0 ) {
+                    memcpy( (void*)( children + pendingRuns[middle] ), (void*)childEntry,
+                            sizeof( directoryEntry ) );
+                    break;
+                }
+                if( order < 0 ) {
+                    low = middle + 1;
+                }
+                else {
+                    high = middle;
+                }
+            }
+        }
+        closeDirectory( iterator );
+    }
+
+    for( unsigned long i = 0; i < pendingCount; i++ ) {
+        pathRequest* request = requests + runStarts[pendingRuns[i]];
+        directoryEntry* child = children + pendingRuns[i];
+        memcpy( name, request->component, request->length );
+        name[request->length] = '\0';
+
+        if( pendingCount <= directoryBlocks &&
+            findHashEntry( parentHandle, name, child, NULL, (hashBucket*)bucket, (directoryBlock*)block ) == 0 ) {
+            memset( (void*)child, 0, sizeof( directoryEntry ) );
+        }
+        addDentry( parentLocation, name, child->childLocation != 0 ? child : NULL );
+    }
+
+    putInode( parentHandle );
+    free( pendingRuns );
+}
+
+
 char* getCopyOfString( char* string ) {
     char* stringCopy = calloc( strlen( string ) + 1 , sizeof( char ) );
     strcpy( stringCopy, string );
@@ -991,19 +2867,40 @@ char* getCopyOfString( char* string ) {
 
 
 int closeFileSystem() {
-    LBAwrite( (void*)mainSystemInfo, system_lbaSize, 0 );
+    if( isSnapshotMounted() ) {
+        unmountSnapshot();
+    }
+    closeAllFiles();
+    freeInodeCache();
+    freeDentryCache();
+    closePathIndex();
+    volumeWrite( (void*)mainSystemInfo, system_lbaSize, 0 );
+    freeSnapshots();
     free( mainSystemInfo );
     closePartitionSystem();
     return 0;
 }
 
 int printMetadata( char* path ) {
-    unsigned long blockLocation = getBlockLocationFromPath( path );
-    file* fileToPrint = calloc( file_mallocSize, 1 );
-    LBAread( fileToPrint, file_lbaSize, blockLocation );
-    if( !isValidFile( fileToPrint ) ) {
+    return private_printMetadata( getBlockLocationFromPath( path ) );
+}
+
+/* Same as printMetadata() for a path relative to directory */
+int printMetadataAt( directoryHandle* directory, char* path ) {
+    return private_printMetadata( getBlockLocationAt( directory, path ) );
+}
+
+int private_printMetadata( unsigned long blockLocation ) {
+    if( blockLocation == 0 ) {
         printf( "Not a valid file\n" );
-        free( fileToPrint );
+        return -1;
+    }
+
+    inodeHandle* handle = getInode( blockLocation );
+    file* fileToPrint = handle->inode;
+    if( !isValidInode( handle ) ) {
+        printf( "Not a valid file\n" );
+        putInode( handle );
         return -1;
     }
     
@@ -1024,30 +2921,66 @@ int printMetadata( char* path ) {
 
     printf( "Identifier Type: %s\n", identifierType );
     printf( "File Name: %s\n", fileToPrint->fileName );
+    printf( "Inode Number: %lu\n", fileToPrint->inodeNumber );
     printf( "Permissions: %s\n", permissions );
-    printf( "Modified: %lu\n", fileToPrint->modified );
-    printf( "Created: %lu\n", fileToPrint->created );
+    char time[TIME_STRING_SIZE];
+    formatTime( time, fileToPrint->modified, fileToPrint->modifiedNanoseconds );
+    printf( "Modified: %s\n", time );
+    formatTime( time, fileToPrint->created, fileToPrint->createdNanoseconds );
+    printf( "Created: %s\n", time );
     printf( "File Size: %lu\n", fileToPrint->fileSize );
 
+    putInode( handle );
     return 0;
 }
 
+/* Writes a timestamp into buffer, which has room for TIME_STRING_SIZE
+ * characters, as local time, e.g. "2024-03-05 14:02:11.123456789 PST".
+ * The nanoseconds are left out if they are NO_NANOSECONDS, for times that
+ * are only kept to the second. */
+void formatTime( char* buffer, unsigned long seconds, long nanoseconds ) {
+    time_t time = (time_t)seconds;
+    struct tm localTime;
+    char date[32];
+    char zone[16];
+
+    localtime_r( &time, &localTime );
+    strftime( date, sizeof( date ), "%Y-%m-%d %H:%M:%S", &localTime );
+    strftime( zone, sizeof( zone ), "%Z", &localTime );
+    if( nanoseconds == NO_NANOSECONDS ) {
+        snprintf( buffer, TIME_STRING_SIZE, "%s %s", date, zone );
+    }
+    else {
+        snprintf( buffer, TIME_STRING_SIZE, "%s.%09ld %s", date, nanoseconds, zone );
+    }
+}
+
 char* getContent( char* filePath ) {
-    unsigned long blockLocation = getBlockLocationFromPath( filePath );
-    file* fileToRead = calloc( file_mallocSize, 1 );
-    LBAread( (void*)fileToRead, file_lbaSize, blockLocation );
+    return private_getContent( getBlockLocationFromPath( filePath ) );
+}
+
+/* Same as getContent() for a path relative to directory */
+char* getContentAt( directoryHandle* directory, char* filePath ) {
+    return private_getContent( getBlockLocationAt( directory, filePath ) );
+}
 
-    if( !isValidFile( fileToRead ) || !isFile( fileToRead ) || !isReadable( fileToRead ) ) {
+char* private_getContent( unsigned long blockLocation ) {
+    if( blockLocation == 0 ) {
         printf( "Not a valid file or file not readable\n");
         return NULL;
     }
 
-    int contentBlockAmount = ( fileToRead->fileSize / mainSystemInfo->lbaSize ) + 1;
-    int bufferMallocSize = contentBlockAmount * mainSystemInfo->lbaSize;
-    char* content = calloc( bufferMallocSize, 1 );
+    inodeHandle* handle = getInode( blockLocation );
+    file* fileToRead = handle->inode;
+
+    if( !isValidInode( handle ) || !isFile( fileToRead ) || !isReadable( fileToRead ) ) {
+        printf( "Not a valid file or file not readable\n");
+        putInode( handle );
+        return NULL;
+    }
 
-    LBAread( (void*)content, contentBlockAmount, fileToRead->startingBlock );
+    char* content = readFileData( handle );
 
-    free( fileToRead );
+    putInode( handle );
     return content;
 }
\ No newline at end of file
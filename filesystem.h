@@ -2,6 +2,9 @@
 #define FILE_SYSTEM_DRIVER_H
 
 #include "systemstructs.h"
+#include "inode.h"
+#include "extent.h"
+#include "snapshot.h"
 
 sysInfo* mainSystemInfo;
 unsigned int system_lbaSize;
@@ -10,32 +13,102 @@ unsigned int free_lbaSize;
 unsigned int free_mallocSize;
 unsigned int file_lbaSize;
 unsigned int file_mallocSize;
+unsigned int file_inlineCapacity;
+unsigned int directory_lbaSize;
+unsigned int directory_mallocSize;
+unsigned int directory_childrenPerBlock;
+unsigned int directory_entriesPerBucket;
+unsigned int extent_lbaSize;
+unsigned int extent_mallocSize;
+unsigned int extent_extentsPerBlock;
+unsigned int inodeIndex_lbaSize;
+unsigned int inodeIndex_mallocSize;
+unsigned int inodeIndex_entriesPerBlock;
+unsigned int pathIndex_lbaSize;
+unsigned int pathIndex_mallocSize;
+unsigned int pathIndex_recordsPerBlock;
+
+// how many times getFreeBlocks() has come back empty, see reclaimForRetry()
+unsigned long allocationFailures;
+unsigned int snapshot_lbaSize;
+unsigned int snapshot_mallocSize;
+unsigned int exception_lbaSize;
+unsigned int exception_mallocSize;
+unsigned int exception_exceptionsPerBlock;
 
 #define ROOTNAME "root"
 
+// how much of a file a copy moves at a time. Copies to and from linux keep
+// two windows, one for each side of the copy.
+#define COPY_WINDOW_BLOCKS 128
+
+// threads a recursive copy runs on, the calling thread being one of them.
+// Each takes one directory block's worth of children at a time.
+#define COPY_WORKER_COUNT 8
+
+// runs a free batch gathers before putting them on the free list anyway,
+// see beginFreeBatch()
+#define FREE_BATCH_MAX_RUNS 65536
+
+// room formatTime() needs, and what to pass it for a time without
+// nanoseconds
+#define TIME_STRING_SIZE 64
+#define NO_NANOSECONDS -1
+
+/* Walks the components of a path in place, see nextPathComponent() */
+typedef struct pathIterator {
+    const char* position;
+} pathIterator;
+
+/* An open directory that paths can be relative to, see openDirectoryHandle() */
+typedef struct directoryHandle {
+    unsigned long blockLocation;
+    unsigned long generation;
+} directoryHandle;
+
 int startFileSystem( char* volumeName, unsigned long volumeSize, unsigned long blockSize );
 int initializeSystemInfo( char* volumeName, unsigned long volumeSize, unsigned long blockSize );
 int createNewSystem( char* volumeName, unsigned long volumeSize, unsigned long blockSize );
 int initializeFreeSpace( const unsigned long beginLocation );
 int copyFromVolumeToLinux( char* ourPath, char* linuxPath );
+int copyFromVolumeToLinuxAt( directoryHandle* directory, char* ourPath, char* linuxPath );
 int copyFromLinuxToVolume( char* linuxFileName, char* volumeFileName );
+int copyFromLinuxToVolumeAt( directoryHandle* directory, char* linuxFileName, char* volumeFileName );
 int moveFile( char* moveFrom, char* moveTo );
+int moveFileAt( directoryHandle* directory, char* moveFrom, char* moveTo );
 unsigned long copyFile( char* moveFrom, char* moveTo );
+unsigned long copyFileAt( directoryHandle* directory, char* moveFrom, char* moveTo );
 unsigned long getBlockLocationFromPath( char* filePath );
 unsigned long getBlockLocationFromName( unsigned long blockLocation, char* fileName );
+unsigned long getBlockLocationFromInodeNumber( unsigned long inodeNumber );
+unsigned long getDirectoryEntryFromPath( char* filePath, directoryEntry* entry );
+unsigned long getParentEntryFromPath( char* filePath, directoryEntry* entry );
+int openDirectoryHandle( directoryHandle* directory, char* filePath, directoryHandle* handle );
+int openParentDirectoryHandle( directoryHandle* directory, directoryHandle* handle );
+int isValidDirectoryHandle( directoryHandle* handle );
+unsigned long getDirectoryEntryAt( directoryHandle* directory, char* filePath, directoryEntry* entry );
+unsigned long getBlockLocationAt( directoryHandle* directory, char* filePath );
+unsigned long makeFileAt( directoryHandle* directory, char* filePath );
+unsigned long makeDirectoryAt( directoryHandle* directory, char* filePath );
+int deleteFileAt( directoryHandle* directory, char* filePath );
+unsigned long resolvePaths( directoryHandle* directory, char** filePaths, unsigned long pathCount,
+                            unsigned long* blockLocations );
+void openPath( pathIterator* iterator, const char* filePath );
+int nextPathComponent( pathIterator* iterator, const char** component, unsigned long* length );
+unsigned long getDirectoryEntryFromName( unsigned long blockLocation, char* fileName, directoryEntry* entry );
 char* getParentPath( char* filePath );
-unsigned long addFile( char* filePath );
-unsigned long makeBlank();
+unsigned long addFile( char* filePath, char* identifierTypeStr );
+inodeHandle* makeBlank();
 unsigned long makeDirectory( char* filePath );
 unsigned long makeFile( char* filePath );
 int addChild( unsigned long parentLocation, unsigned long childLocation );
+unsigned int addChildren( unsigned long parentLocation, directoryEntry* entries, unsigned int count );
 int removeChild( unsigned long parentLocation, unsigned long childLocation );
 void listChildren( unsigned long blockLocation );
 void listChildrenFromPath( char* absolutePath );
 char* filePathConcat( const char *s1, const char *s2 );
 unsigned int getFilePermissons( unsigned long blockLocation );
 int setCount( unsigned long blockLocation, unsigned int count );
-int setStartingBlock( unsigned long headerBlockLocation, unsigned long dataBlockLocation );
 int setDefaultMetadata( unsigned long blockLocation );
 int setFileCreatedAt( unsigned long blockLocation );
 int setFileModifiedAt( unsigned long blockLocation );
@@ -43,9 +116,30 @@ int setFileId( unsigned long blockLocation );
 int setFileName( unsigned long blockLocation, char* fileName );
 int setFilePermissions( unsigned long blockLocation, char* newPermissionStr );
 int setFileIdentifierType( unsigned long blockLocation, char* identifierTypeStr );
-int writeFileData( unsigned long blockLocation, int numberOfBlocks, void* fileBuffer, int fileSize );
+int setInodeDefaultMetadata( inodeHandle* handle );
+int setInodeCreatedAt( inodeHandle* handle );
+int setInodeModifiedAt( inodeHandle* handle );
+int setInodeId( inodeHandle* handle );
+int setInodeName( inodeHandle* handle, char* fileName );
+int setInodePermissions( inodeHandle* handle, char* newPermissionStr );
+int setInodeCount( inodeHandle* handle, unsigned int count );
+int setInodeIdentifierType( inodeHandle* handle, char* identifierTypeStr );
+int writeFileData( unsigned long blockLocation, void* fileBuffer, unsigned long fileSize );
+void* readFileData( inodeHandle* handle );
+int isInlineData( file* fileToCheck );
+long readFileAt( unsigned long headerBlockLocation, void* buffer, unsigned long offset, unsigned long length );
+long writeFileAt( unsigned long headerBlockLocation, void* buffer, unsigned long offset, unsigned long length );
+long appendFileData( unsigned long headerBlockLocation, void* buffer, unsigned long length );
+int truncateFile( unsigned long headerBlockLocation, unsigned long newSize );
+long readInodeAt( inodeHandle* handle, void* buffer, unsigned long offset, unsigned long length );
+long writeInodeAt( inodeHandle* handle, void* buffer, unsigned long offset, unsigned long length );
+int truncateInode( inodeHandle* handle, unsigned long newSize );
+unsigned long seekInodeData( inodeHandle* handle, unsigned long offset );
+unsigned long seekInodeHole( inodeHandle* handle, unsigned long offset );
 int recursiveDelete( unsigned long blockLocation );
 int delete( unsigned long blockLocation, unsigned int amountToFree );
+void beginFreeBatch();
+void endFreeBatch();
 int deleteFilePath( char* filePath );
 unsigned long getFreeBlocks( unsigned int numberOfFreeBlocksWanted );
 int isFile( file* fileToCheck );
@@ -62,6 +156,9 @@ int isValidFreeSpace( freeSpace* freeSpaceToCheck );
 char* getCopyOfString( char* string );
 int closeFileSystem();
 int printMetadata( char* path );
+int printMetadataAt( directoryHandle* directory, char* path );
+void formatTime( char* buffer, unsigned long seconds, long nanoseconds );
 char* getContent( char* filePath );
+char* getContentAt( directoryHandle* directory, char* filePath );
 
 #endif /* FILE_SYSTEM_DRIVER_H end guard */
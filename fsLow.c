@@ -201,8 +201,8 @@ uint64_t LBAwrite (void * buffer, uint64_t lbaCount, uint64_t lbaPosition)
 				
 	fcntl(partInfop->fd, F_SETLKW, &fl);
 
-	lseek (partInfop->fd, fl.l_start, SEEK_SET);
-	uint64_t retWrite = write(partInfop->fd, buffer, fl.l_len);
+	// positioned so threads sharing the descriptor can't move each other's offset
+	uint64_t retWrite = pwrite(partInfop->fd, buffer, fl.l_len, fl.l_start);
 	
 	fsync(partInfop->fd);
 
@@ -240,8 +240,7 @@ uint64_t LBAread (void * buffer, uint64_t lbaCount, uint64_t lbaPosition)
 		
 	fcntl(partInfop->fd, F_SETLKW, &fl);
 
-	lseek (partInfop->fd, fl.l_start, SEEK_SET);
-	read(partInfop->fd, buffer, fl.l_len);
+	pread(partInfop->fd, buffer, fl.l_len, fl.l_start);
 
 	fl.l_type = F_UNLCK;
 	fcntl(partInfop->fd, F_SETLKW, &fl);
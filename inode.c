@@ -0,0 +1,379 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fsLow.h"
+#include "systemstructs.h"
+#include "filesystem.h"
+#include "inode.h"
+
+/* The inode cache. Decoded headers are hashed on their block location and
+ * also kept on an LRU list (most recently used at the head) so that the
+ * cache can stay near INODE_CACHE_CAPACITY by dropping unreferenced handles
+ * from the tail. */
+inodeHandle* inodeCacheBuckets[INODE_CACHE_BUCKETS];
+inodeHandle* inodeLruHead = NULL;
+inodeHandle* inodeLruTail = NULL;
+int inodeCacheCount = 0;
+unsigned long inodeTimesFlushedAt = 0;
+
+/* Held by every entry point while it uses the hash chains, the LRU list
+ * and the handles' reference counts and flags, so path lookups on other
+ * threads can share the cache with whatever else is running. It is let go
+ * while a header is read or written, so threads don't wait on each
+ * other's I/O; inodeCacheChanged is signalled once that I/O is done. */
+pthread_mutex_t inodeCacheLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t inodeCacheChanged = PTHREAD_COND_INITIALIZER;
+
+inodeHandle** private_inodeCacheFind( unsigned long blockLocation );
+void private_lruRemove( inodeHandle* handle );
+void private_lruPushFront( inodeHandle* handle );
+void private_writeInode( inodeHandle* handle );
+void private_unhashInode( inodeHandle* handle );
+void private_freeInode( inodeHandle* handle );
+void private_evictInodes();
+void private_flushLazyTimes();
+void private_invalidateInodeRange( unsigned long blockLocation, unsigned long blockCount );
+int private_flushInodeCache();
+inodeHandle* private_allocateInode( unsigned long blockLocation );
+
+/* Returns the handle for the file header stored at blockLocation, reading
+ * and validating it only if it is not already cached. The handle must be
+ * given back with putInode() once the caller is done. A thread wanting a
+ * header another thread is reading waits for that read. */
+inodeHandle* getInode( unsigned long blockLocation ) {
+    pthread_mutex_lock( &inodeCacheLock );
+    inodeHandle** slot = private_inodeCacheFind( blockLocation );
+    inodeHandle* handle = *slot;
+
+    if( handle != NULL ) {
+        handle->referenceCount++;
+        private_lruRemove( handle );
+        private_lruPushFront( handle );
+        while( handle->isLoading ) {
+            pthread_cond_wait( &inodeCacheChanged, &inodeCacheLock );
+        }
+        pthread_mutex_unlock( &inodeCacheLock );
+        return handle;
+    }
+
+    // the reference keeps the handle from being evicted while it is read
+    handle = private_allocateInode( blockLocation );
+    handle->isLoading = 1;
+    pthread_mutex_unlock( &inodeCacheLock );
+
+    volumeRead( (void*)handle->inode, file_lbaSize, blockLocation );
+
+    pthread_mutex_lock( &inodeCacheLock );
+    handle->isValid = isValidFile( handle->inode );
+    handle->isLoading = 0;
+    pthread_cond_broadcast( &inodeCacheChanged );
+    pthread_mutex_unlock( &inodeCacheLock );
+
+    return handle;
+}
+
+/* Returns a handle to a brand new, blank file header that will live at
+ * blockLocation. Nothing is read from the volume and the handle starts out
+ * dirty so the header is written when it is put back. */
+inodeHandle* newInode( unsigned long blockLocation ) {
+    // blocks handed out by the allocator can't still be cached, but drop
+    // anything left over just in case
+    pthread_mutex_lock( &inodeCacheLock );
+    private_invalidateInodeRange( blockLocation, file_lbaSize );
+
+    inodeHandle* handle = private_allocateInode( blockLocation );
+    handle->inode->signature1 = FILESIGNATURE1;
+    handle->inode->signature2 = FILESIGNATURE2;
+    handle->isValid = 1;
+    handle->dirty = 1;
+    pthread_mutex_unlock( &inodeCacheLock );
+
+    return handle;
+}
+
+/* Flags the header as modified so putInode() knows to write it back */
+void markInodeDirty( inodeHandle* handle ) {
+    pthread_mutex_lock( &inodeCacheLock );
+    handle->dirty = 1;
+    pthread_mutex_unlock( &inodeCacheLock );
+}
+
+/* Flags the header's timestamps as changed. Unlike markInodeDirty() this
+ * doesn't make putInode() write the header, the times wait for the next
+ * write that has to happen anyway. */
+void markInodeTimesDirty( inodeHandle* handle ) {
+    pthread_mutex_lock( &inodeCacheLock );
+    if( !handle->timesDirty ) {
+        handle->timesDirty = 1;
+        handle->timesDirtySince = time( NULL );
+    }
+    pthread_mutex_unlock( &inodeCacheLock );
+}
+
+/* Gives back a reference to the handle. Once the last reference is dropped a
+ * dirty header is written back, so nested users of the same header still
+ * only cause one write. Returns 1 if the header was written, 0 otherwise. */
+int putInode( inodeHandle* handle ) {
+    int wasWritten = 0;
+
+    if( handle == NULL ) {
+        return 0;
+    }
+
+    pthread_mutex_lock( &inodeCacheLock );
+
+    // the write happens before the last reference goes, so the handle
+    // can't be evicted under it, and again if it was changed meanwhile
+    while( handle->referenceCount == 1 && handle->dirty && !handle->isStale ) {
+        handle->dirty = 0;
+        handle->timesDirty = 0;
+        handle->isWriting = 1;
+        pthread_mutex_unlock( &inodeCacheLock );
+
+        volumeWrite( (void*)handle->inode, file_lbaSize, handle->blockLocation );
+
+        pthread_mutex_lock( &inodeCacheLock );
+        handle->isWriting = 0;
+        pthread_cond_broadcast( &inodeCacheChanged );
+        wasWritten = 1;
+    }
+
+    handle->referenceCount--;
+    if( handle->referenceCount > 0 ) {
+        pthread_mutex_unlock( &inodeCacheLock );
+        return wasWritten;
+    }
+
+    if( handle->isStale ) {
+        // the blocks were freed while we held it; the header is gone
+        private_freeInode( handle );
+        pthread_mutex_unlock( &inodeCacheLock );
+        return wasWritten;
+    }
+
+    private_flushLazyTimes();
+    private_evictInodes();
+    pthread_mutex_unlock( &inodeCacheLock );
+
+    return wasWritten;
+}
+
+/* Writes the header back now if it or its times are dirty, without giving
+ * up the reference. Returns 1 if the header was written, 0 otherwise. */
+int syncInode( inodeHandle* handle ) {
+    int wasWritten = 0;
+
+    pthread_mutex_lock( &inodeCacheLock );
+    if( ( handle->dirty || handle->timesDirty ) && !handle->isStale ) {
+        private_writeInode( handle );
+        wasWritten = 1;
+    }
+    pthread_mutex_unlock( &inodeCacheLock );
+
+    return wasWritten;
+}
+
+/* Signatures are checked once when the header is loaded into the cache */
+int isValidInode( inodeHandle* handle ) {
+    return handle->isValid;
+}
+
+/* Drops every cached header inside the freed range. This has to be called
+ * whenever blocks are given back to the free list so that a stale header
+ * is never served or written back over whatever reuses the blocks. */
+void invalidateInodeRange( unsigned long blockLocation, unsigned long blockCount ) {
+    pthread_mutex_lock( &inodeCacheLock );
+    private_invalidateInodeRange( blockLocation, blockCount );
+    pthread_mutex_unlock( &inodeCacheLock );
+}
+
+/* Writes back every dirty header in the cache, including the ones with
+ * only new timestamps. Returns the number of headers written. */
+int flushInodeCache() {
+    pthread_mutex_lock( &inodeCacheLock );
+    int numberWritten = private_flushInodeCache();
+    pthread_mutex_unlock( &inodeCacheLock );
+    return numberWritten;
+}
+
+/* Flushes and then releases every header in the cache */
+void freeInodeCache() {
+    pthread_mutex_lock( &inodeCacheLock );
+    private_flushInodeCache();
+    while( inodeLruHead != NULL ) {
+        private_freeInode( inodeLruHead );
+    }
+    pthread_mutex_unlock( &inodeCacheLock );
+}
+
+/* invalidateInodeRange() for a caller already holding inodeCacheLock. A
+ * header still being written is waited for, so the write can't land on
+ * the blocks after they are handed out again. */
+void private_invalidateInodeRange( unsigned long blockLocation, unsigned long blockCount ) {
+    inodeHandle* handle = inodeLruHead;
+    inodeHandle* nextHandle;
+
+    while( handle != NULL ) {
+        nextHandle = handle->lruNext;
+        if( handle->blockLocation >= blockLocation &&
+            handle->blockLocation < blockLocation + blockCount ) {
+            if( handle->isWriting ) {
+                // the list may have changed while waiting, start over
+                pthread_cond_wait( &inodeCacheChanged, &inodeCacheLock );
+                handle = inodeLruHead;
+                continue;
+            }
+            if( handle->referenceCount > 0 ) {
+                // still held, putInode() will release it
+                private_unhashInode( handle );
+                handle->isStale = 1;
+                handle->dirty = 0;
+                handle->timesDirty = 0;
+            }
+            else {
+                private_freeInode( handle );
+            }
+        }
+        handle = nextHandle;
+    }
+}
+
+/* flushInodeCache() for a caller already holding inodeCacheLock */
+int private_flushInodeCache() {
+    int numberWritten = 0;
+    for( inodeHandle* handle = inodeLruHead; handle != NULL; handle = handle->lruNext ) {
+        if( ( handle->dirty || handle->timesDirty ) && !handle->isStale ) {
+            private_writeInode( handle );
+            numberWritten++;
+        }
+    }
+    return numberWritten;
+}
+
+/* Finds the hash chain slot holding blockLocation, or the empty slot at the
+ * end of the chain if it isn't cached */
+inodeHandle** private_inodeCacheFind( unsigned long blockLocation ) {
+    inodeHandle** slot = inodeCacheBuckets + ( blockLocation % INODE_CACHE_BUCKETS );
+
+    while( *slot != NULL ) {
+        if( (*slot)->blockLocation == blockLocation ) {
+            return slot;
+        }
+        slot = &((*slot)->hashNext);
+    }
+
+    return slot;
+}
+
+/* Creates a referenced, clean handle for blockLocation and adds it to the
+ * cache. The caller fills in the header. */
+inodeHandle* private_allocateInode( unsigned long blockLocation ) {
+    inodeHandle* handle = calloc( 1, sizeof( inodeHandle ) );
+    handle->blockLocation = blockLocation;
+    handle->inode = calloc( file_mallocSize, 1 );
+    handle->referenceCount = 1;
+
+    inodeHandle** slot = private_inodeCacheFind( blockLocation );
+    *slot = handle;
+    private_lruPushFront( handle );
+    inodeCacheCount++;
+
+    return handle;
+}
+
+void private_writeInode( inodeHandle* handle ) {
+    volumeWrite( (void*)handle->inode, file_lbaSize, handle->blockLocation );
+    handle->dirty = 0;
+    handle->timesDirty = 0;
+}
+
+/* Takes the handle out of its hash chain so lookups no longer find it */
+void private_unhashInode( inodeHandle* handle ) {
+    inodeHandle** slot = private_inodeCacheFind( handle->blockLocation );
+    if( *slot == handle ) {
+        *slot = handle->hashNext;
+    }
+    handle->hashNext = NULL;
+}
+
+/* Removes the handle from the cache entirely without writing it */
+void private_freeInode( inodeHandle* handle ) {
+    if( !handle->isStale ) {
+        private_unhashInode( handle );
+    }
+    private_lruRemove( handle );
+    inodeCacheCount--;
+    free( handle->extentMap );
+    free( handle->inode );
+    free( handle );
+}
+
+/* Drops unreferenced handles from the cold end of the LRU list until the
+ * cache is back within its capacity */
+void private_evictInodes() {
+    inodeHandle* handle = inodeLruTail;
+    inodeHandle* previousHandle;
+
+    while( inodeCacheCount > INODE_CACHE_CAPACITY && handle != NULL ) {
+        previousHandle = handle->lruPrev;
+        if( handle->referenceCount == 0 ) {
+            if( handle->dirty || handle->timesDirty ) {
+                private_writeInode( handle );
+            }
+            private_freeInode( handle );
+        }
+        handle = previousHandle;
+    }
+}
+
+/* Writes out timestamps that have waited INODE_LAZYTIME_SECONDS, so a
+ * header that stays cached doesn't hold them back forever. The cache is
+ * only scanned once in that period. */
+void private_flushLazyTimes() {
+    unsigned long now = time( NULL );
+    if( now - inodeTimesFlushedAt < INODE_LAZYTIME_SECONDS ) {
+        return;
+    }
+    inodeTimesFlushedAt = now;
+
+    for( inodeHandle* handle = inodeLruHead; handle != NULL; handle = handle->lruNext ) {
+        if( handle->timesDirty && !handle->isStale &&
+            now - handle->timesDirtySince >= INODE_LAZYTIME_SECONDS ) {
+            private_writeInode( handle );
+        }
+    }
+}
+
+void private_lruRemove( inodeHandle* handle ) {
+    if( handle->lruPrev != NULL ) {
+        handle->lruPrev->lruNext = handle->lruNext;
+    }
+    else {
+        inodeLruHead = handle->lruNext;
+    }
+
+    if( handle->lruNext != NULL ) {
+        handle->lruNext->lruPrev = handle->lruPrev;
+    }
+    else {
+        inodeLruTail = handle->lruPrev;
+    }
+
+    handle->lruPrev = NULL;
+    handle->lruNext = NULL;
+}
+
+void private_lruPushFront( inodeHandle* handle ) {
+    handle->lruPrev = NULL;
+    handle->lruNext = inodeLruHead;
+    if( inodeLruHead != NULL ) {
+        inodeLruHead->lruPrev = handle;
+    }
+    inodeLruHead = handle;
+    if( inodeLruTail == NULL ) {
+        inodeLruTail = handle;
+    }
+}
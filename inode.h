@@ -0,0 +1,57 @@
+#ifndef INODE_H
+#define INODE_H
+
+#include "systemstructs.h"
+
+#define INODE_CACHE_BUCKETS 256
+#define INODE_CACHE_CAPACITY 128
+#define INODE_LAZYTIME_SECONDS 60
+
+/* Where a block of a file's extent chain is and the block of the file its
+ * first extent starts at */
+typedef struct extentBlockPosition {
+    unsigned long blockLocation;
+    unsigned long fileBlock;
+} extentBlockPosition;
+
+/* An in-memory copy of a file header. The header is read once by getInode(),
+ * modified in place through handle->inode, and written back once by
+ * putInode() if anything marked it dirty.
+ *
+ * Handles live in the inode cache, so every caller asking for the same block
+ * location gets the same handle. referenceCount counts the callers currently
+ * holding it; only unreferenced handles can be evicted.
+ *
+ * A header whose only change is a new timestamp is not written when it is
+ * put back. The times go out with the next write of the header, when it is
+ * synced or evicted, or once they have waited INODE_LAZYTIME_SECONDS. */
+typedef struct inodeHandle {
+    unsigned long blockLocation;
+    file* inode;
+    int dirty;
+    int timesDirty;       // only timestamps changed, see markInodeTimesDirty()
+    unsigned long timesDirtySince;
+    int isValid;          // signatures were checked once when it was loaded
+    int isStale;          // blocks were freed while the handle was held
+    int isLoading;        // the header is being read, see getInode()
+    int isWriting;        // the header is being written, see putInode()
+    int referenceCount;
+    extentBlockPosition* extentMap;  // the extent block chain, see seekExtents()
+    unsigned int extentMapCount;
+    struct inodeHandle* hashNext;
+    struct inodeHandle* lruPrev;
+    struct inodeHandle* lruNext;
+} inodeHandle;
+
+inodeHandle* getInode( unsigned long blockLocation );
+inodeHandle* newInode( unsigned long blockLocation );
+void markInodeDirty( inodeHandle* handle );
+void markInodeTimesDirty( inodeHandle* handle );
+int putInode( inodeHandle* handle );
+int syncInode( inodeHandle* handle );
+int isValidInode( inodeHandle* handle );
+void invalidateInodeRange( unsigned long blockLocation, unsigned long blockCount );
+int flushInodeCache();
+void freeInodeCache();
+
+#endif /* INODE_H end guard */
@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fsLow.h"
+#include "systemstructs.h"
+#include "filesystem.h"
+#include "inodeindex.h"
+
+// deep enough for any number of files a volume can hold
+#define MAX_INODE_INDEX_DEPTH 8
+
+/* Held by every entry point, numbers are handed out and the index blocks
+ * changed from the copy's workers at once */
+pthread_mutex_t inodeIndexLock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long private_findLeaf( unsigned long inodeNumber, inodeIndexBlock* block );
+unsigned long private_getInodeLocation( unsigned long inodeNumber );
+int private_removeInodeNumber( unsigned long inodeNumber );
+unsigned long private_newIndexBlock();
+unsigned long private_levelSpan( unsigned int level );
+
+/* Gives the next inode number to the header at blockLocation and records
+ * it in the index, adding a level on top first if the index is full.
+ * Returns the number, or 0 if there was no space for an index block. */
+unsigned long allocateInodeNumber( unsigned long blockLocation ) {
+    return allocateInodeNumbers( blockLocation, 1 );
+}
+
+/* Same as allocateInodeNumber() for count headers laid out one after the
+ * other from blockLocation, as a batch of them is allocated. They get
+ * numbers in a row, and each index block the numbers go in is written
+ * once for all of them.
+ * Returns the first number, or 0 if there was no space for an index
+ * block, in which case none are given out. */
+unsigned long allocateInodeNumbers( unsigned long blockLocation, unsigned int count ) {
+    pthread_mutex_lock( &inodeIndexLock );
+    unsigned long firstNumber = mainSystemInfo->nextInodeNumber;
+    inodeIndexBlock* block = calloc( inodeIndex_mallocSize, 1 );
+    inodeIndexBlock* leaf = calloc( inodeIndex_mallocSize, 1 );
+    unsigned long leafLocation = 0;
+
+    for( unsigned int i = 0; i < count; i++ ) {
+        unsigned long inodeNumber = firstNumber + i;
+        unsigned long location = private_findLeaf( inodeNumber, block );
+        if( location == 0 ) {
+            break;
+        }
+        if( location != leafLocation ) {
+            if( leafLocation != 0 ) {
+                volumeWrite( (void*)leaf, inodeIndex_lbaSize, leafLocation );
+            }
+            volumeRead( (void*)leaf, inodeIndex_lbaSize, location );
+            leafLocation = location;
+        }
+        leaf->entries[inodeNumber % inodeIndex_entriesPerBlock] = blockLocation + i * file_lbaSize;
+        mainSystemInfo->nextInodeNumber++;
+    }
+    if( leafLocation != 0 ) {
+        volumeWrite( (void*)leaf, inodeIndex_lbaSize, leafLocation );
+    }
+
+    // out of space part way, take back the ones already given
+    if( mainSystemInfo->nextInodeNumber - firstNumber < count ) {
+        for( unsigned long inodeNumber = firstNumber; inodeNumber < mainSystemInfo->nextInodeNumber; inodeNumber++ ) {
+            private_removeInodeNumber( inodeNumber );
+        }
+        firstNumber = 0;
+    }
+
+    free( leaf );
+    free( block );
+    pthread_mutex_unlock( &inodeIndexLock );
+    return firstNumber;
+}
+
+/* Returns the location of the leaf inodeNumber goes in, adding a level on
+ * top of the index first if it is full and any missing blocks on the way
+ * down. block is used to read the levels above.
+ * Returns 0 if there was no space for an index block. */
+unsigned long private_findLeaf( unsigned long inodeNumber, inodeIndexBlock* block ) {
+    while( inodeNumber >= private_levelSpan( mainSystemInfo->inodeIndexDepth ) ) {
+        unsigned long newRoot = private_newIndexBlock();
+        if( newRoot == 0 ) {
+            return 0;
+        }
+
+        // the old root covers the lowest numbers of the new one
+        if( mainSystemInfo->inodeIndex != 0 ) {
+            volumeRead( (void*)block, inodeIndex_lbaSize, newRoot );
+            block->entries[0] = mainSystemInfo->inodeIndex;
+            volumeWrite( (void*)block, inodeIndex_lbaSize, newRoot );
+        }
+        mainSystemInfo->inodeIndex = newRoot;
+        mainSystemInfo->inodeIndexDepth++;
+    }
+
+    unsigned long location = mainSystemInfo->inodeIndex;
+    for( unsigned int level = mainSystemInfo->inodeIndexDepth; level > 1; level-- ) {
+        volumeRead( (void*)block, inodeIndex_lbaSize, location );
+        unsigned int slot = ( inodeNumber / private_levelSpan( level - 1 ) ) % inodeIndex_entriesPerBlock;
+
+        if( block->entries[slot] == 0 ) {
+            unsigned long child = private_newIndexBlock();
+            if( child == 0 ) {
+                return 0;
+            }
+            block->entries[slot] = child;
+            volumeWrite( (void*)block, inodeIndex_lbaSize, location );
+        }
+        location = block->entries[slot];
+    }
+
+    return location;
+}
+
+/* Looks up the header location of an inode number, reading one index block
+ * per level of the index.
+ * Returns 0 if the number was never given out or its file is deleted. */
+unsigned long getInodeLocation( unsigned long inodeNumber ) {
+    pthread_mutex_lock( &inodeIndexLock );
+    unsigned long returnValue = private_getInodeLocation( inodeNumber );
+    pthread_mutex_unlock( &inodeIndexLock );
+    return returnValue;
+}
+
+unsigned long private_getInodeLocation( unsigned long inodeNumber ) {
+    if( inodeNumber == 0 || inodeNumber >= mainSystemInfo->nextInodeNumber ) {
+        return 0;
+    }
+
+    inodeIndexBlock* block = calloc( inodeIndex_mallocSize, 1 );
+    unsigned long location = mainSystemInfo->inodeIndex;
+
+    for( unsigned int level = mainSystemInfo->inodeIndexDepth; level > 0 && location != 0; level-- ) {
+        volumeRead( (void*)block, inodeIndex_lbaSize, location );
+        if( !isValidInodeIndexBlock( block ) ) {
+            printf( "ERROR: INODE INDEX IS DAMAGED\n" );
+            location = 0;
+            break;
+        }
+        location = block->entries[( inodeNumber / private_levelSpan( level - 1 ) ) % inodeIndex_entriesPerBlock];
+    }
+
+    free( block );
+    return location;
+}
+
+/* Clears the entry of a deleted file. Index blocks left empty are given
+ * back, unless new numbers will still go in them. */
+int removeInodeNumber( unsigned long inodeNumber ) {
+    pthread_mutex_lock( &inodeIndexLock );
+    int returnValue = private_removeInodeNumber( inodeNumber );
+    pthread_mutex_unlock( &inodeIndexLock );
+    return returnValue;
+}
+
+int private_removeInodeNumber( unsigned long inodeNumber ) {
+    if( inodeNumber == 0 || inodeNumber >= mainSystemInfo->nextInodeNumber ) {
+        return -1;
+    }
+
+    unsigned long path[MAX_INODE_INDEX_DEPTH];
+    unsigned int slots[MAX_INODE_INDEX_DEPTH];
+    inodeIndexBlock* block = calloc( inodeIndex_mallocSize, 1 );
+    unsigned int depth = mainSystemInfo->inodeIndexDepth;
+    unsigned long location = mainSystemInfo->inodeIndex;
+
+    // path[level - 1] is the block at that level, 1 being the leaf
+    for( unsigned int level = depth; level > 0; level-- ) {
+        if( location == 0 ) {
+            free( block );
+            return -1;
+        }
+        path[level - 1] = location;
+        slots[level - 1] = ( inodeNumber / private_levelSpan( level - 1 ) ) % inodeIndex_entriesPerBlock;
+        if( level > 1 ) {
+            volumeRead( (void*)block, inodeIndex_lbaSize, location );
+            location = block->entries[slots[level - 1]];
+        }
+    }
+
+    for( unsigned int level = 1; level <= depth; level++ ) {
+        volumeRead( (void*)block, inodeIndex_lbaSize, path[level - 1] );
+        block->entries[slots[level - 1]] = 0;
+
+        int isEmpty = 1;
+        for( unsigned int i = 0; i < inodeIndex_entriesPerBlock && isEmpty; i++ ) {
+            isEmpty = block->entries[i] == 0;
+        }
+        int isFinished = inodeNumber / private_levelSpan( level ) <
+                         mainSystemInfo->nextInodeNumber / private_levelSpan( level );
+
+        if( !isEmpty || !isFinished || level == depth ) {
+            volumeWrite( (void*)block, inodeIndex_lbaSize, path[level - 1] );
+            break;
+        }
+        delete( path[level - 1], inodeIndex_lbaSize );
+    }
+
+    free( block );
+    return 0;
+}
+
+int isValidInodeIndexBlock( inodeIndexBlock* inodeIndexBlockToCheck ) {
+    return ( inodeIndexBlockToCheck->signature1 == INODEINDEXSIGNATURE1 ) &&
+           ( inodeIndexBlockToCheck->signature2 == INODEINDEXSIGNATURE2 );
+}
+
+/* Allocates and writes an index block with every entry 0.
+ * Returns its location, or 0 if there was no space. */
+unsigned long private_newIndexBlock() {
+    unsigned long blockLocation = getFreeBlocks( inodeIndex_lbaSize );
+    if( blockLocation == 0 ) {
+        return 0;
+    }
+
+    inodeIndexBlock* block = calloc( inodeIndex_mallocSize, 1 );
+    block->signature1 = INODEINDEXSIGNATURE1;
+    block->signature2 = INODEINDEXSIGNATURE2;
+    volumeWrite( (void*)block, inodeIndex_lbaSize, blockLocation );
+    free( block );
+
+    return blockLocation;
+}
+
+/* Returns how many inode numbers an index block at level covers, level 0
+ * being a single entry of a leaf */
+unsigned long private_levelSpan( unsigned int level ) {
+    unsigned long span = 1;
+    for( unsigned int i = 0; i < level; i++ ) {
+        span *= inodeIndex_entriesPerBlock;
+    }
+    return span;
+}
@@ -0,0 +1,12 @@
+#ifndef INODE_INDEX_H
+#define INODE_INDEX_H
+
+#include "systemstructs.h"
+
+unsigned long allocateInodeNumber( unsigned long blockLocation );
+unsigned long allocateInodeNumbers( unsigned long blockLocation, unsigned int count );
+unsigned long getInodeLocation( unsigned long inodeNumber );
+int removeInodeNumber( unsigned long inodeNumber );
+int isValidInodeIndexBlock( inodeIndexBlock* inodeIndexBlockToCheck );
+
+#endif /* INODE_INDEX_H end guard */
@@ -0,0 +1,510 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "systemstructs.h"
+#include "filesystem.h"
+#include "inode.h"
+#include "directory.h"
+#include "pathindex.h"
+#include "nameindex.h"
+
+/* A file in the name index. entry is the path index's own copy, which
+ * stays put until the file is removed from both indexes. */
+typedef struct nameIndexFile {
+    unsigned long parentLocation;
+    directoryEntry* entry;        // NULL while the slot is free
+    unsigned int generation;      // bumped each time the slot is freed
+    long directoryNext;           // next slot in the same directory bucket
+    unsigned int postingCount;    // trigrams the name is listed under
+} nameIndexFile;
+
+/* A file whose name holds a trigram. Removing a file leaves its postings
+ * behind, and they are skipped because the slot's generation moved on
+ * until enough pile up to compact every list. */
+typedef struct nameIndexPosting {
+    unsigned long slot;
+    unsigned int generation;
+} nameIndexPosting;
+
+typedef struct nameIndexGram {
+    unsigned int gram;
+    nameIndexPosting* postings;
+    unsigned long count;
+    unsigned long capacity;
+    struct nameIndexGram* hashNext;
+} nameIndexGram;
+
+nameIndexFile* nameIndexFiles = NULL;
+unsigned long nameIndexSlotCount = 0;
+unsigned long nameIndexSlotCapacity = 0;
+unsigned long* freeNameSlots = NULL;
+unsigned long freeNameSlotCount = 0;
+
+nameIndexGram** gramBuckets = NULL;
+unsigned long gramBucketCount = 0;
+unsigned long gramCount = 0;
+unsigned long postingCount = 0;
+unsigned long stalePostingCount = 0;
+
+// directories by their own location, so a match's path can be put back
+// together from its parents
+long* directoryBuckets = NULL;
+unsigned long directoryBucketCount = 0;
+unsigned long directoryCount = 0;
+
+unsigned long private_takeSlot();
+nameIndexGram** private_findGram( unsigned int gram );
+void private_addPosting( unsigned int gram, unsigned long slot );
+void private_growGramBuckets();
+void private_compactPostings();
+long* private_findDirectory( unsigned long directoryLocation );
+void private_growDirectoryBuckets();
+nameIndexGram* private_pickCandidates( char* pattern, int isGlob, int* hasNoMatch );
+int private_isMatch( char* pattern, int isGlob, char* fileName );
+void private_printDirectoryPath( unsigned long directoryLocation );
+unsigned long private_walkDirectory( unsigned long directoryLocation, char* path, char* pattern, int isGlob );
+
+/* Adds a file the path index just took in, under every trigram of its
+ * name. Returns the slot to remove it by. */
+unsigned long addNameIndexEntry( unsigned long parentLocation, directoryEntry* entry ) {
+    if( gramBuckets == NULL ) {
+        gramBucketCount = NAME_INDEX_MIN_BUCKETS;
+        gramBuckets = calloc( gramBucketCount, sizeof( nameIndexGram* ) );
+        directoryBucketCount = NAME_INDEX_MIN_BUCKETS;
+        directoryBuckets = malloc( directoryBucketCount * sizeof( long ) );
+        memset( (void*)directoryBuckets, -1, directoryBucketCount * sizeof( long ) );
+    }
+
+    unsigned long slot = private_takeSlot();
+    nameIndexFile* file = nameIndexFiles + slot;
+    file->parentLocation = parentLocation;
+    file->entry = entry;
+    file->directoryNext = -1;
+    file->postingCount = 0;
+
+    if( entry->identifierType == IDENTIFIER_DIRECTORY ) {
+        if( directoryCount >= directoryBucketCount * 2 ) {
+            private_growDirectoryBuckets();
+        }
+        long* head = directoryBuckets + entry->childLocation % directoryBucketCount;
+        file->directoryNext = *head;
+        *head = slot;
+        directoryCount++;
+    }
+
+    unsigned char* name = (unsigned char*)entry->fileName;
+    for( unsigned long i = 0; name[i] != '\0' && name[i + 1] != '\0' && name[i + 2] != '\0'; i++ ) {
+        private_addPosting( ( name[i] << 16 ) | ( name[i + 1] << 8 ) | name[i + 2], slot );
+    }
+
+    return slot;
+}
+
+/* Removes a file by the slot addNameIndexEntry() gave it */
+void removeNameIndexEntry( unsigned long slot ) {
+    nameIndexFile* file = nameIndexFiles + slot;
+
+    if( file->entry->identifierType == IDENTIFIER_DIRECTORY ) {
+        long* link = private_findDirectory( file->entry->childLocation );
+        if( *link == (long)slot ) {
+            *link = file->directoryNext;
+            directoryCount--;
+        }
+    }
+
+    stalePostingCount += file->postingCount;
+
+    file->entry = NULL;
+    file->generation++;
+    freeNameSlots[freeNameSlotCount++] = slot;
+
+    if( stalePostingCount * 2 > postingCount ) {
+        private_compactPostings();
+    }
+}
+
+/* Drops the whole index, along with the path index it follows */
+void freeNameIndex() {
+    for( unsigned long i = 0; i < gramBucketCount; i++ ) {
+        nameIndexGram* gram = gramBuckets[i];
+        while( gram != NULL ) {
+            nameIndexGram* nextGram = gram->hashNext;
+            free( gram->postings );
+            free( gram );
+            gram = nextGram;
+        }
+    }
+    free( gramBuckets );
+    free( directoryBuckets );
+    free( nameIndexFiles );
+    free( freeNameSlots );
+
+    nameIndexFiles = NULL;
+    nameIndexSlotCount = 0;
+    nameIndexSlotCapacity = 0;
+    freeNameSlots = NULL;
+    freeNameSlotCount = 0;
+    gramBuckets = NULL;
+    gramBucketCount = 0;
+    gramCount = 0;
+    postingCount = 0;
+    stalePostingCount = 0;
+    directoryBuckets = NULL;
+    directoryBucketCount = 0;
+    directoryCount = 0;
+}
+
+/* Locate: prints the path of every file whose name matches pattern. A
+ * pattern with *, ? or [ is a glob matched against the whole name,
+ * anything else matches names that contain it. The trigrams of the
+ * pattern's literal parts pick the candidates, so only names that can
+ * match are looked at and the volume isn't read at all. While a snapshot
+ * is mounted, or if the path index had to be dropped, the directories are
+ * walked instead. Returns how many files matched. */
+unsigned long locateFiles( char* pattern ) {
+    int isGlob = strpbrk( pattern, "*?[" ) != NULL;
+    unsigned long matchCount = 0;
+
+    if( !isPathIndexReady() ) {
+        return private_walkDirectory( mainSystemInfo->rootLocation, ROOTNAME, pattern, isGlob );
+    }
+
+    int hasNoMatch = 0;
+    nameIndexGram* candidates = private_pickCandidates( pattern, isGlob, &hasNoMatch );
+    if( hasNoMatch ) {
+        return 0;
+    }
+
+    // with no trigram to go on every file is a candidate
+    unsigned long candidateCount = candidates != NULL ? candidates->count : nameIndexSlotCount;
+    for( unsigned long i = 0; i < candidateCount; i++ ) {
+        unsigned long slot = i;
+        if( candidates != NULL ) {
+            slot = candidates->postings[i].slot;
+            if( nameIndexFiles[slot].generation != candidates->postings[i].generation ) {
+                continue;
+            }
+        }
+
+        // files below a deleted directory stay until they are freed
+        nameIndexFile* file = nameIndexFiles + slot;
+        if( file->entry == NULL || !private_isMatch( pattern, isGlob, file->entry->fileName ) ||
+            !isDirectoryReachable( file->parentLocation ) ) {
+            continue;
+        }
+        private_printDirectoryPath( file->parentLocation );
+        printf( "/%s\n", file->entry->fileName );
+        matchCount++;
+    }
+
+    return matchCount;
+}
+
+/* Returns 1 if the directory can still be reached from root, 0 if it or
+ * a directory above it was deleted. Deleted trees are taken apart a bit
+ * at a time, so until then what is below them is still whole. */
+int isDirectoryReachable( unsigned long directoryLocation ) {
+    while( directoryLocation != mainSystemInfo->rootLocation ) {
+        if( directoryBuckets == NULL ) {
+            return 0;
+        }
+        long slot = *private_findDirectory( directoryLocation );
+        if( slot == -1 ) {
+            return 0;
+        }
+        directoryLocation = nameIndexFiles[slot].parentLocation;
+    }
+    return 1;
+}
+
+/* Returns the location of the directory holding the one at
+ * directoryLocation, root's own for root, or 0 if the directory isn't in
+ * the index */
+unsigned long getParentDirectory( unsigned long directoryLocation ) {
+    if( directoryLocation == mainSystemInfo->rootLocation ) {
+        return directoryLocation;
+    }
+    if( directoryBuckets == NULL ) {
+        return 0;
+    }
+    long slot = *private_findDirectory( directoryLocation );
+    return slot == -1 ? 0 : nameIndexFiles[slot].parentLocation;
+}
+
+/* Puts the absolute path of the directory back together from its parents,
+ * into path which has room for size characters.
+ * Returns 0 if successful, -1 if the directory can't be reached from root
+ * or the path doesn't fit. */
+int getDirectoryPath( unsigned long directoryLocation, char* path, unsigned long size ) {
+    if( directoryLocation == mainSystemInfo->rootLocation ) {
+        return snprintf( path, size, "%s", ROOTNAME ) < (int)size ? 0 : -1;
+    }
+    if( directoryBuckets == NULL ) {
+        return -1;
+    }
+
+    long slot = *private_findDirectory( directoryLocation );
+    if( slot == -1 || getDirectoryPath( nameIndexFiles[slot].parentLocation, path, size ) != 0 ) {
+        return -1;
+    }
+    unsigned long length = strlen( path );
+    return snprintf( path + length, size - length, "/%s", nameIndexFiles[slot].entry->fileName ) <
+           (int)( size - length ) ? 0 : -1;
+}
+
+/* Returns a free slot, making room for more if there are none */
+unsigned long private_takeSlot() {
+    if( freeNameSlotCount > 0 ) {
+        return freeNameSlots[--freeNameSlotCount];
+    }
+
+    if( nameIndexSlotCount == nameIndexSlotCapacity ) {
+        nameIndexSlotCapacity = nameIndexSlotCapacity == 0 ? NAME_INDEX_MIN_BUCKETS : nameIndexSlotCapacity * 2;
+        nameIndexFiles = realloc( nameIndexFiles, nameIndexSlotCapacity * sizeof( nameIndexFile ) );
+        freeNameSlots = realloc( freeNameSlots, nameIndexSlotCapacity * sizeof( unsigned long ) );
+    }
+    nameIndexFiles[nameIndexSlotCount].generation = 0;
+    return nameIndexSlotCount++;
+}
+
+/* Finds the hash chain slot holding the trigram, or the empty slot at the
+ * end of the chain if no name has it */
+nameIndexGram** private_findGram( unsigned int gram ) {
+    nameIndexGram** slot = gramBuckets + ( gram * 2654435761u ) % gramBucketCount;
+    while( *slot != NULL && (*slot)->gram != gram ) {
+        slot = &((*slot)->hashNext);
+    }
+    return slot;
+}
+
+void private_addPosting( unsigned int gram, unsigned long slot ) {
+    nameIndexGram** gramSlot = private_findGram( gram );
+    nameIndexGram* indexGram = *gramSlot;
+    unsigned int generation = nameIndexFiles[slot].generation;
+
+    if( indexGram == NULL ) {
+        if( gramCount >= gramBucketCount * 2 ) {
+            private_growGramBuckets();
+            gramSlot = private_findGram( gram );
+        }
+        indexGram = calloc( 1, sizeof( nameIndexGram ) );
+        indexGram->gram = gram;
+        *gramSlot = indexGram;
+        gramCount++;
+    }
+
+    // a trigram that shows up twice in one name is only listed once
+    if( indexGram->count > 0 && indexGram->postings[indexGram->count - 1].slot == slot &&
+        indexGram->postings[indexGram->count - 1].generation == generation ) {
+        return;
+    }
+
+    if( indexGram->count == indexGram->capacity ) {
+        indexGram->capacity = indexGram->capacity == 0 ? 4 : indexGram->capacity * 2;
+        indexGram->postings = realloc( indexGram->postings, indexGram->capacity * sizeof( nameIndexPosting ) );
+    }
+    indexGram->postings[indexGram->count].slot = slot;
+    indexGram->postings[indexGram->count].generation = generation;
+    indexGram->count++;
+    nameIndexFiles[slot].postingCount++;
+    postingCount++;
+}
+
+/* Doubles the trigram table so chains stay short as names come in */
+void private_growGramBuckets() {
+    nameIndexGram** oldBuckets = gramBuckets;
+    unsigned long oldBucketCount = gramBucketCount;
+
+    gramBucketCount *= 2;
+    gramBuckets = calloc( gramBucketCount, sizeof( nameIndexGram* ) );
+
+    for( unsigned long i = 0; i < oldBucketCount; i++ ) {
+        nameIndexGram* gram = oldBuckets[i];
+        while( gram != NULL ) {
+            nameIndexGram* nextGram = gram->hashNext;
+            nameIndexGram** slot = private_findGram( gram->gram );
+            gram->hashNext = *slot;
+            *slot = gram;
+            gram = nextGram;
+        }
+    }
+
+    free( oldBuckets );
+}
+
+/* Drops the postings of removed files from every list, and the trigrams
+ * no name has anymore */
+void private_compactPostings() {
+    postingCount = 0;
+
+    for( unsigned long i = 0; i < gramBucketCount; i++ ) {
+        nameIndexGram** slot = gramBuckets + i;
+        while( *slot != NULL ) {
+            nameIndexGram* gram = *slot;
+            unsigned long kept = 0;
+            for( unsigned long j = 0; j < gram->count; j++ ) {
+                if( nameIndexFiles[gram->postings[j].slot].generation == gram->postings[j].generation ) {
+                    gram->postings[kept++] = gram->postings[j];
+                }
+            }
+            gram->count = kept;
+            postingCount += kept;
+
+            if( kept == 0 ) {
+                *slot = gram->hashNext;
+                free( gram->postings );
+                free( gram );
+                gramCount--;
+            }
+            else {
+                slot = &gram->hashNext;
+            }
+        }
+    }
+
+    stalePostingCount = 0;
+}
+
+/* Finds the link pointing at the directory's slot, or the -1 at the end
+ * of its bucket if it isn't in the index */
+long* private_findDirectory( unsigned long directoryLocation ) {
+    long* link = directoryBuckets + directoryLocation % directoryBucketCount;
+    while( *link != -1 && nameIndexFiles[*link].entry->childLocation != directoryLocation ) {
+        link = &nameIndexFiles[*link].directoryNext;
+    }
+    return link;
+}
+
+void private_growDirectoryBuckets() {
+    long* oldBuckets = directoryBuckets;
+    unsigned long oldBucketCount = directoryBucketCount;
+
+    directoryBucketCount *= 2;
+    directoryBuckets = malloc( directoryBucketCount * sizeof( long ) );
+    memset( (void*)directoryBuckets, -1, directoryBucketCount * sizeof( long ) );
+
+    for( unsigned long i = 0; i < oldBucketCount; i++ ) {
+        long slot = oldBuckets[i];
+        while( slot != -1 ) {
+            long nextSlot = nameIndexFiles[slot].directoryNext;
+            long* head = directoryBuckets + nameIndexFiles[slot].entry->childLocation % directoryBucketCount;
+            nameIndexFiles[slot].directoryNext = *head;
+            *head = slot;
+            slot = nextSlot;
+        }
+    }
+
+    free( oldBuckets );
+}
+
+/* Of the trigrams in the literal runs of pattern, returns the one with
+ * the fewest names, since every match has to be among them. Returns NULL
+ * if no run is long enough to have one. Sets hasNoMatch if some trigram
+ * isn't in any name, then nothing can match. */
+nameIndexGram* private_pickCandidates( char* pattern, int isGlob, int* hasNoMatch ) {
+    nameIndexGram* best = NULL;
+    unsigned long runLength = 0;
+
+    for( unsigned long i = 0; pattern[i] != '\0'; i++ ) {
+        unsigned char c = pattern[i];
+
+        if( isGlob && ( c == '*' || c == '?' || c == '\\' ) ) {
+            runLength = 0;
+            continue;
+        }
+        if( isGlob && c == '[' ) {
+            // skip the whole set, a ] right after the [ or [! is part of it
+            unsigned long j = i + 1;
+            if( pattern[j] == '!' || pattern[j] == '^' ) {
+                j++;
+            }
+            if( pattern[j] == ']' ) {
+                j++;
+            }
+            while( pattern[j] != '\0' && pattern[j] != ']' ) {
+                j++;
+            }
+            if( pattern[j] == '\0' ) {
+                // an unclosed [ is matched as itself
+                runLength = 0;
+                continue;
+            }
+            i = j;
+            runLength = 0;
+            continue;
+        }
+
+        runLength++;
+        if( runLength < 3 ) {
+            continue;
+        }
+
+        unsigned char* gramStart = (unsigned char*)pattern + i - 2;
+        nameIndexGram* gram = *private_findGram( ( gramStart[0] << 16 ) | ( gramStart[1] << 8 ) | gramStart[2] );
+        if( gram == NULL ) {
+            *hasNoMatch = 1;
+            return NULL;
+        }
+        if( best == NULL || gram->count < best->count ) {
+            best = gram;
+        }
+    }
+
+    return best;
+}
+
+int private_isMatch( char* pattern, int isGlob, char* fileName ) {
+    if( isGlob ) {
+        return fnmatch( pattern, fileName, 0 ) == 0;
+    }
+    return strstr( fileName, pattern ) != NULL;
+}
+
+void private_printDirectoryPath( unsigned long directoryLocation ) {
+    if( directoryLocation == mainSystemInfo->rootLocation ) {
+        printf( "%s", ROOTNAME );
+        return;
+    }
+
+    long slot = *private_findDirectory( directoryLocation );
+    if( slot == -1 ) {
+        printf( "?" );
+        return;
+    }
+    private_printDirectoryPath( nameIndexFiles[slot].parentLocation );
+    printf( "/%s", nameIndexFiles[slot].entry->fileName );
+}
+
+/* Matches every file below the directory the slow way, one directory
+ * block at a time. Returns how many matched. */
+unsigned long private_walkDirectory( unsigned long directoryLocation, char* path, char* pattern, int isGlob ) {
+    unsigned long matchCount = 0;
+    inodeHandle* directory = getInode( directoryLocation );
+    if( !isValidInode( directory ) || !isDirectory( directory->inode ) ) {
+        putInode( directory );
+        return 0;
+    }
+
+    unsigned long pathLength = strlen( path );
+    directoryIterator* iterator = openDirectory( directory );
+    directoryEntry* childEntry;
+    while( ( childEntry = nextDirectoryEntry( iterator ) ) != NULL ) {
+        char* childPath = malloc( pathLength + strlen( childEntry->fileName ) + 2 );
+        sprintf( childPath, "%s/%s", path, childEntry->fileName );
+
+        if( private_isMatch( pattern, isGlob, childEntry->fileName ) ) {
+            printf( "%s\n", childPath );
+            matchCount++;
+        }
+        if( childEntry->identifierType == IDENTIFIER_DIRECTORY ) {
+            matchCount += private_walkDirectory( childEntry->childLocation, childPath, pattern, isGlob );
+        }
+        free( childPath );
+    }
+    closeDirectory( iterator );
+    putInode( directory );
+
+    return matchCount;
+}
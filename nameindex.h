@@ -0,0 +1,16 @@
+#ifndef NAME_INDEX_H
+#define NAME_INDEX_H
+
+#include "systemstructs.h"
+
+#define NAME_INDEX_MIN_BUCKETS 1024
+
+unsigned long addNameIndexEntry( unsigned long parentLocation, directoryEntry* entry );
+void removeNameIndexEntry( unsigned long slot );
+void freeNameIndex();
+unsigned long locateFiles( char* pattern );
+int isDirectoryReachable( unsigned long directoryLocation );
+unsigned long getParentDirectory( unsigned long directoryLocation );
+int getDirectoryPath( unsigned long directoryLocation, char* path, unsigned long size );
+
+#endif /* NAME_INDEX_H end guard */
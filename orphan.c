@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "systemstructs.h"
+#include "filesystem.h"
+#include "inode.h"
+#include "directory.h"
+#include "directoryhash.h"
+#include "inodeindex.h"
+#include "dentry.h"
+#include "pathindex.h"
+#include "filehandle.h"
+#include "orphan.h"
+
+// set while reclaiming, so running out of blocks partway through doesn't
+// start another pass over the same list
+int isReclaiming = 0;
+
+unsigned long private_reclaimStep();
+void private_unlinkOrphan( unsigned long previousLocation, unsigned long nextLocation );
+unsigned long private_takeLastChildren( unsigned long blockLocation, inodeHandle* directory );
+unsigned long private_freeOrphan( unsigned long blockLocation );
+
+/* Puts a file just unlinked from its directory on the orphan list, where
+ * it and everything below it wait for reclaimOrphans() to free them. This
+ * costs the same however big the tree is. The file's inode number is
+ * given up right away so handles and ids stop finding it.
+ * Returns 0 if successful, -1 if blockLocation isn't a file. */
+int orphanFile( unsigned long blockLocation ) {
+    inodeHandle* handle = getInode( blockLocation );
+    if( !isValidInode( handle ) ) {
+        putInode( handle );
+        return -1;
+    }
+
+    removeInodeNumber( handle->inode->inodeNumber );
+    handle->inode->inodeNumber = 0;
+    handle->inode->nextOrphan = mainSystemInfo->orphanHead;
+    markInodeDirty( handle );
+
+    // the header goes out before the list points at it
+    syncInode( handle );
+    putInode( handle );
+
+    mainSystemInfo->orphanHead = blockLocation;
+    volumeWrite( (void*)mainSystemInfo, system_lbaSize, 0 );
+
+    return 0;
+}
+
+/* Frees the blocks of deleted files until about blockLimit blocks are
+ * back on the free list, or all of them if blockLimit is 0. The list is
+ * kept on the volume, so whatever is left carries on after a restart.
+ * Files still open stay on the list until a pass after they are closed.
+ * Nothing is freed while a snapshot is mounted, as the volume being read
+ * is the snapshot's. Returns the number of blocks freed. */
+unsigned long reclaimOrphans( unsigned long blockLimit ) {
+    unsigned long blocksFreed = 0;
+
+    if( isReclaiming || isSnapshotMounted() ) {
+        return 0;
+    }
+
+    // the blocks go back on the free list together at the end
+    isReclaiming = 1;
+    beginFreeBatch();
+    while( blockLimit == 0 || blocksFreed < blockLimit ) {
+        unsigned long stepFreed = private_reclaimStep();
+        if( stepFreed == 0 ) {
+            break;
+        }
+        blocksFreed += stepFreed;
+    }
+    endFreeBatch();
+    isReclaiming = 0;
+
+    return blocksFreed;
+}
+
+/* For an operation that just failed: if it ran out of space, frees every
+ * deleted file so the whole operation can be tried again. failuresBefore
+ * is allocationFailures from when the operation started. The allocator
+ * doesn't do this itself, as it is called in the middle of changes to
+ * directories, indexes and cached headers that reclaiming also changes, so
+ * only call this once the failed operation has backed out.
+ * Returns 1 if blocks were freed and the operation is worth retrying. */
+int reclaimForRetry( unsigned long failuresBefore ) {
+    if( allocationFailures == failuresBefore ) {
+        return 0;
+    }
+    return reclaimOrphans( 0 ) > 0;
+}
+
+/* Works on the first file on the list that isn't open. A directory gives
+ * up the children in its last directory block first, its subdirectories
+ * going on the list ahead of it, so a tree comes apart from the bottom. A
+ * file, or a directory with nothing left in it, comes off the list and is
+ * freed. Every change to the list is on the volume before anything it
+ * pointed at is freed, so a crash can leave blocks unfreed but never free
+ * them twice. Returns the number of blocks freed, at least 1 so a caller
+ * counting blocks always gets through the list, or 0 once nothing on it
+ * can be freed. */
+unsigned long private_reclaimStep() {
+    unsigned long previousLocation = 0;
+    unsigned long blockLocation = mainSystemInfo->orphanHead;
+
+    // only files can be open, and only a few at once
+    while( blockLocation != 0 && isFileOpen( blockLocation ) ) {
+        inodeHandle* openHandle = getInode( blockLocation );
+        previousLocation = blockLocation;
+        blockLocation = openHandle->inode->nextOrphan;
+        putInode( openHandle );
+    }
+    if( blockLocation == 0 ) {
+        return 0;
+    }
+
+    inodeHandle* handle = getInode( blockLocation );
+
+    if( !isValidInode( handle ) ) {
+        printf( "ERROR: ORPHAN LIST IS DAMAGED, DROPPING THE REST OF IT\n" );
+        putInode( handle );
+        private_unlinkOrphan( previousLocation, 0 );
+        return 1;
+    }
+
+    if( isDirectory( handle->inode ) && handle->inode->childCount > 0 ) {
+        unsigned long blocksFreed = private_takeLastChildren( blockLocation, handle );
+        putInode( handle );
+        return blocksFreed + 1;
+    }
+
+    private_unlinkOrphan( previousLocation, handle->inode->nextOrphan );
+    putInode( handle );
+
+    return private_freeOrphan( blockLocation );
+}
+
+/* Points the list entry at previousLocation, or the head of the list if it
+ * is 0, at nextLocation and writes the change out */
+void private_unlinkOrphan( unsigned long previousLocation, unsigned long nextLocation ) {
+    if( previousLocation == 0 ) {
+        mainSystemInfo->orphanHead = nextLocation;
+        volumeWrite( (void*)mainSystemInfo, system_lbaSize, 0 );
+        return;
+    }
+
+    inodeHandle* previous = getInode( previousLocation );
+    previous->inode->nextOrphan = nextLocation;
+    markInodeDirty( previous );
+    syncInode( previous );
+    putInode( previous );
+}
+
+/* Takes the children in the directory's last directory block out of it.
+ * Subdirectories and open files go on the list, other files are freed
+ * along with the block. Returns the number of blocks freed. */
+unsigned long private_takeLastChildren( unsigned long blockLocation, inodeHandle* directory ) {
+    file* directoryFile = directory->inode;
+    directoryBlock* block = calloc( directory_mallocSize, 1 );
+    unsigned long lastBlockLocation = directoryFile->lastDirectoryBlock;
+    unsigned long blocksFreed = 0;
+
+    volumeRead( (void*)block, directory_lbaSize, lastBlockLocation );
+
+    // every block but the last is full, so the child count says how many
+    // children this block holds
+    unsigned int count = ( directoryFile->childCount - 1 ) % directory_childrenPerBlock + 1;
+
+    unsigned long orphanHead = mainSystemInfo->orphanHead;
+    int* isListed = calloc( count, sizeof( int ) );
+    for( unsigned int i = 0; i < count; i++ ) {
+        directoryEntry* childEntry = block->children + i;
+        if( childEntry->identifierType != IDENTIFIER_DIRECTORY && !isFileOpen( childEntry->childLocation ) ) {
+            continue;
+        }
+        isListed[i] = 1;
+        inodeHandle* child = getInode( childEntry->childLocation );
+        if( childEntry->identifierType != IDENTIFIER_DIRECTORY ) {
+            // gone from every lookup like a file deleted on its own
+            removeInodeNumber( child->inode->inodeNumber );
+            child->inode->inodeNumber = 0;
+        }
+        child->inode->nextOrphan = orphanHead;
+        markInodeDirty( child );
+        syncInode( child );
+        putInode( child );
+        orphanHead = childEntry->childLocation;
+    }
+
+    // the directory forgets the block before anything in it is freed
+    directoryFile->childCount -= count;
+    directoryFile->lastDirectoryBlock = block->prev;
+    if( block->prev == 0 ) {
+        directoryFile->firstDirectoryBlock = 0;
+    }
+    markInodeDirty( directory );
+    syncInode( directory );
+
+    if( orphanHead != mainSystemInfo->orphanHead ) {
+        mainSystemInfo->orphanHead = orphanHead;
+        volumeWrite( (void*)mainSystemInfo, system_lbaSize, 0 );
+    }
+
+    for( unsigned int i = 0; i < count; i++ ) {
+        directoryEntry* childEntry = block->children + i;
+        removePathIndexEntry( blockLocation, childEntry->fileName );
+        if( !isListed[i] ) {
+            blocksFreed += private_freeOrphan( childEntry->childLocation );
+        }
+    }
+    delete( lastBlockLocation, directory_lbaSize );
+    blocksFreed += directory_lbaSize;
+
+    free( isListed );
+    free( block );
+    return blocksFreed;
+}
+
+/* Frees a file nothing points at anymore, which for a directory means it
+ * has no children left. Returns the number of blocks freed. */
+unsigned long private_freeOrphan( unsigned long blockLocation ) {
+    inodeHandle* handle = getInode( blockLocation );
+    if( !isValidInode( handle ) ) {
+        putInode( handle );
+        return 0;
+    }
+
+    file* orphan = handle->inode;
+    unsigned long blocksFreed = file_lbaSize + orphan->blockCount;
+
+    if( isDirectory( orphan ) ) {
+        invalidateDentryDirectory( blockLocation );
+        freeHashIndex( handle );
+        freeDirectoryBlocks( handle );
+    }
+    else {
+        freeExtents( handle );
+    }
+    removeInodeNumber( orphan->inodeNumber );
+    delete( blockLocation, file_lbaSize );
+
+    // delete() already dropped it from the cache
+    putInode( handle );
+
+    return blocksFreed;
+}
@@ -0,0 +1,11 @@
+#ifndef ORPHAN_H
+#define ORPHAN_H
+
+// blocks the terminal frees each time it is idle, see reclaimOrphans()
+#define ORPHAN_RECLAIM_BLOCKS 256
+
+int orphanFile( unsigned long blockLocation );
+unsigned long reclaimOrphans( unsigned long blockLimit );
+int reclaimForRetry( unsigned long failuresBefore );
+
+#endif /* ORPHAN_H end guard */
@@ -0,0 +1,479 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "systemstructs.h"
+#include "filesystem.h"
+#include "inode.h"
+#include "directory.h"
+#include "directoryhash.h"
+#include "pathindex.h"
+#include "nameindex.h"
+
+/* A file in the in-memory path index. Every file is a node of a trie of
+ * path components, and the edges from a directory to its children are
+ * kept in one hash table on (directory location, name), so each step of a
+ * path is a single probe and a whole path costs one probe per component
+ * without touching the volume. */
+typedef struct pathIndexNode {
+    unsigned long parentLocation;
+    directoryEntry entry;
+    unsigned long record;         // where the node is kept on the volume
+    unsigned long nameSlot;       // where the name index keeps it
+    struct pathIndexNode* hashNext;
+} pathIndexNode;
+
+pathIndexNode** pathIndexBuckets = NULL;
+unsigned long pathIndexBucketCount = 0;
+unsigned long pathIndexNodeCount = 0;
+int isPathIndexLoaded = 0;
+
+// the blocks of the record chain in order, which of their records are in
+// use and how many in each block. New records go in the lowest free one, so
+// blocks left empty at the end of the chain can be given back.
+unsigned long* pathIndexBlocks = NULL;
+unsigned long pathIndexBlockCount = 0;
+unsigned char* isRecordUsed = NULL;
+unsigned int* blockRecordCounts = NULL;
+unsigned long lowestOpenBlock = 0;
+
+// the last record block touched, written back when another one is needed
+// or the index is closed
+pathIndexBlock* recordBuffer = NULL;
+unsigned long recordBufferBlock = 0;
+int isRecordBufferDirty = 0;
+
+/* Held by every entry point while it uses the hash table or the records,
+ * taken before the inode cache's lock when both are needed */
+pthread_mutex_t pathIndexLock = PTHREAD_MUTEX_INITIALIZER;
+
+void private_addEntry( unsigned long parentLocation, directoryEntry* entry );
+pathIndexNode** private_findNode( unsigned long parentLocation, char* fileName );
+void private_insertNode( pathIndexNode* node );
+void private_growBuckets();
+int private_addRecordBlock();
+unsigned long private_takeRecord();
+void private_releaseRecord( unsigned long record );
+void private_trimRecordBlocks();
+void private_appendBlock( unsigned long blockLocation );
+void private_writeRecord( unsigned long record, unsigned long parentLocation, directoryEntry* entry );
+pathIndexBlock* private_loadRecordBlock( unsigned long blockNumber );
+void private_flushRecordBuffer();
+int private_loadRecords();
+void private_rebuild();
+void private_indexDirectory( unsigned long directoryLocation );
+void private_freeIndex();
+
+/* Brings the path index into memory from its records, or rebuilds it
+ * from the directories if the volume wasn't closed cleanly, since then the
+ * records may be behind. Until the volume is closed again it is marked as
+ * not clean on the volume. Returns 0 if the records were loaded, 1 if the
+ * index was rebuilt. */
+int loadPathIndex() {
+    int returnValue = 0;
+
+    pthread_mutex_lock( &pathIndexLock );
+    recordBuffer = calloc( pathIndex_mallocSize, 1 );
+    pathIndexBucketCount = PATH_INDEX_MIN_BUCKETS;
+    pathIndexBuckets = calloc( pathIndexBucketCount, sizeof( pathIndexNode* ) );
+
+    if( !mainSystemInfo->pathIndexClean || private_loadRecords() != 0 ) {
+        private_rebuild();
+        returnValue = 1;
+    }
+    isPathIndexLoaded = 1;
+
+    mainSystemInfo->pathIndexClean = 0;
+    volumeWrite( (void*)mainSystemInfo, system_lbaSize, 0 );
+    pthread_mutex_unlock( &pathIndexLock );
+
+    return returnValue;
+}
+
+/* Writes out the last records and marks the index clean in the system
+ * info, which the caller writes, then drops the index from memory */
+void closePathIndex() {
+    pthread_mutex_lock( &pathIndexLock );
+    if( isPathIndexLoaded ) {
+        private_flushRecordBuffer();
+        mainSystemInfo->pathIndexClean = 1;
+        private_freeIndex();
+    }
+    pthread_mutex_unlock( &pathIndexLock );
+}
+
+/* Looks up fileName in the parent directory without touching the volume.
+ * Returns 1 and fills entry if the index can answer, where a childLocation
+ * of 0 means there is no such file. Returns 0 if it can't, while a
+ * snapshot with its own older directories is mounted. */
+int lookupPathIndex( unsigned long parentLocation, char* fileName, directoryEntry* entry ) {
+    pthread_mutex_lock( &pathIndexLock );
+    if( !isPathIndexReady() ) {
+        pthread_mutex_unlock( &pathIndexLock );
+        return 0;
+    }
+
+    pathIndexNode* node = *private_findNode( parentLocation, fileName );
+    if( node != NULL ) {
+        memcpy( (void*)entry, (void*)&node->entry, sizeof( directoryEntry ) );
+    }
+    else {
+        memset( (void*)entry, 0, sizeof( directoryEntry ) );
+    }
+    pthread_mutex_unlock( &pathIndexLock );
+    return 1;
+}
+
+/* Returns 1 if the index is in memory and matches the directories being
+ * looked at, 0 if it was dropped or a snapshot is mounted */
+int isPathIndexReady() {
+    return isPathIndexLoaded && !isSnapshotMounted();
+}
+
+/* Records a child just linked into the parent directory */
+void addPathIndexEntry( unsigned long parentLocation, directoryEntry* entry ) {
+    pthread_mutex_lock( &pathIndexLock );
+    private_addEntry( parentLocation, entry );
+    pthread_mutex_unlock( &pathIndexLock );
+}
+
+/* Forgets a child unlinked from the parent directory */
+void removePathIndexEntry( unsigned long parentLocation, char* fileName ) {
+    pthread_mutex_lock( &pathIndexLock );
+    if( !isPathIndexLoaded ) {
+        pthread_mutex_unlock( &pathIndexLock );
+        return;
+    }
+
+    pathIndexNode** slot = private_findNode( parentLocation, fileName );
+    pathIndexNode* node = *slot;
+    if( node == NULL ) {
+        pthread_mutex_unlock( &pathIndexLock );
+        return;
+    }
+    *slot = node->hashNext;
+    pathIndexNodeCount--;
+
+    private_writeRecord( node->record, 0, NULL );
+    private_releaseRecord( node->record );
+    removeNameIndexEntry( node->nameSlot );
+    free( node );
+
+    private_trimRecordBlocks();
+    pthread_mutex_unlock( &pathIndexLock );
+}
+
+/* addPathIndexEntry() for a caller already holding pathIndexLock */
+void private_addEntry( unsigned long parentLocation, directoryEntry* entry ) {
+    if( !isPathIndexLoaded ) {
+        return;
+    }
+    while( lowestOpenBlock < pathIndexBlockCount &&
+           blockRecordCounts[lowestOpenBlock] == pathIndex_recordsPerBlock ) {
+        lowestOpenBlock++;
+    }
+    if( lowestOpenBlock == pathIndexBlockCount && private_addRecordBlock() != 0 ) {
+        // the directories are still right, the index is rebuilt from them
+        // at the next mount
+        printf( "ERROR: NO SPACE TO GROW THE PATH INDEX\n" );
+        private_freeIndex();
+        return;
+    }
+
+    pathIndexNode* node = calloc( 1, sizeof( pathIndexNode ) );
+    node->parentLocation = parentLocation;
+    memcpy( (void*)&node->entry, (void*)entry, sizeof( directoryEntry ) );
+    node->record = private_takeRecord();
+    private_insertNode( node );
+
+    private_writeRecord( node->record, parentLocation, entry );
+}
+
+int isValidPathIndexBlock( pathIndexBlock* pathIndexBlockToCheck ) {
+    return ( pathIndexBlockToCheck->signature1 == PATHINDEXSIGNATURE1 ) &&
+           ( pathIndexBlockToCheck->signature2 == PATHINDEXSIGNATURE2 );
+}
+
+/* Finds the hash chain slot holding the child, or the empty slot at the
+ * end of the chain if there is none */
+pathIndexNode** private_findNode( unsigned long parentLocation, char* fileName ) {
+    unsigned long bucket = ( hashFileName( fileName ) ^ parentLocation ) % pathIndexBucketCount;
+    pathIndexNode** slot = pathIndexBuckets + bucket;
+
+    while( *slot != NULL ) {
+        if( (*slot)->parentLocation == parentLocation &&
+            strcmp( (*slot)->entry.fileName, fileName ) == 0 ) {
+            return slot;
+        }
+        slot = &((*slot)->hashNext);
+    }
+
+    return slot;
+}
+
+void private_insertNode( pathIndexNode* node ) {
+    if( pathIndexNodeCount >= pathIndexBucketCount * 2 ) {
+        private_growBuckets();
+    }
+    pathIndexNode** slot = private_findNode( node->parentLocation, node->entry.fileName );
+    node->hashNext = *slot;
+    *slot = node;
+    pathIndexNodeCount++;
+
+    node->nameSlot = addNameIndexEntry( node->parentLocation, &node->entry );
+}
+
+/* Doubles the hash table so chains stay short as the volume fills up */
+void private_growBuckets() {
+    pathIndexNode** oldBuckets = pathIndexBuckets;
+    unsigned long oldBucketCount = pathIndexBucketCount;
+
+    pathIndexBucketCount *= 2;
+    pathIndexBuckets = calloc( pathIndexBucketCount, sizeof( pathIndexNode* ) );
+
+    for( unsigned long i = 0; i < oldBucketCount; i++ ) {
+        pathIndexNode* node = oldBuckets[i];
+        while( node != NULL ) {
+            pathIndexNode* nextNode = node->hashNext;
+            pathIndexNode** slot = private_findNode( node->parentLocation, node->entry.fileName );
+            node->hashNext = *slot;
+            *slot = node;
+            node = nextNode;
+        }
+    }
+
+    free( oldBuckets );
+}
+
+/* Adds an empty record block to the end of the chain and makes its
+ * records free. Returns 0 if successful, -1 if there was no space. */
+int private_addRecordBlock() {
+    unsigned long blockLocation = getFreeBlocks( pathIndex_lbaSize );
+    if( blockLocation == 0 ) {
+        return -1;
+    }
+
+    if( pathIndexBlockCount == 0 ) {
+        mainSystemInfo->pathIndex = blockLocation;
+    }
+    else {
+        pathIndexBlock* lastBlock = private_loadRecordBlock( pathIndexBlockCount - 1 );
+        lastBlock->next = blockLocation;
+        isRecordBufferDirty = 1;
+    }
+
+    // the new block is written once its first records are in
+    private_flushRecordBuffer();
+    memset( (void*)recordBuffer, 0, pathIndex_mallocSize );
+    recordBuffer->signature1 = PATHINDEXSIGNATURE1;
+    recordBuffer->signature2 = PATHINDEXSIGNATURE2;
+    recordBufferBlock = blockLocation;
+    isRecordBufferDirty = 1;
+
+    private_appendBlock( blockLocation );
+    return 0;
+}
+
+/* Keeps track of one more block at the end of the chain, with every
+ * record free */
+void private_appendBlock( unsigned long blockLocation ) {
+    pathIndexBlocks = realloc( pathIndexBlocks, ( pathIndexBlockCount + 1 ) * sizeof( unsigned long ) );
+    blockRecordCounts = realloc( blockRecordCounts, ( pathIndexBlockCount + 1 ) * sizeof( unsigned int ) );
+    isRecordUsed = realloc( isRecordUsed, ( pathIndexBlockCount + 1 ) * pathIndex_recordsPerBlock );
+
+    pathIndexBlocks[pathIndexBlockCount] = blockLocation;
+    blockRecordCounts[pathIndexBlockCount] = 0;
+    memset( (void*)( isRecordUsed + pathIndexBlockCount * pathIndex_recordsPerBlock ), 0,
+            pathIndex_recordsPerBlock );
+    pathIndexBlockCount++;
+}
+
+/* Returns the first free record of lowestOpenBlock, which has one */
+unsigned long private_takeRecord() {
+    unsigned long record = lowestOpenBlock * pathIndex_recordsPerBlock;
+    while( isRecordUsed[record] ) {
+        record++;
+    }
+    isRecordUsed[record] = 1;
+    blockRecordCounts[lowestOpenBlock]++;
+    return record;
+}
+
+void private_releaseRecord( unsigned long record ) {
+    unsigned long blockNumber = record / pathIndex_recordsPerBlock;
+    isRecordUsed[record] = 0;
+    blockRecordCounts[blockNumber]--;
+    if( blockNumber < lowestOpenBlock ) {
+        lowestOpenBlock = blockNumber;
+    }
+}
+
+/* Gives back the empty blocks at the end of the chain */
+void private_trimRecordBlocks() {
+    while( pathIndexBlockCount > 0 && blockRecordCounts[pathIndexBlockCount - 1] == 0 ) {
+        unsigned long blockLocation = pathIndexBlocks[pathIndexBlockCount - 1];
+        if( recordBufferBlock == blockLocation ) {
+            recordBufferBlock = 0;
+            isRecordBufferDirty = 0;
+        }
+        pathIndexBlockCount--;
+
+        if( pathIndexBlockCount == 0 ) {
+            mainSystemInfo->pathIndex = 0;
+        }
+        else {
+            pathIndexBlock* lastBlock = private_loadRecordBlock( pathIndexBlockCount - 1 );
+            lastBlock->next = 0;
+            isRecordBufferDirty = 1;
+        }
+        delete( blockLocation, pathIndex_lbaSize );
+    }
+    if( lowestOpenBlock > pathIndexBlockCount ) {
+        lowestOpenBlock = pathIndexBlockCount;
+    }
+}
+
+/* Sets a record, or frees it if entry is NULL */
+void private_writeRecord( unsigned long record, unsigned long parentLocation, directoryEntry* entry ) {
+    pathIndexBlock* block = private_loadRecordBlock( record / pathIndex_recordsPerBlock );
+    pathIndexRecord* indexRecord = block->records + record % pathIndex_recordsPerBlock;
+
+    memset( (void*)indexRecord, 0, sizeof( pathIndexRecord ) );
+    if( entry != NULL ) {
+        indexRecord->parentLocation = parentLocation;
+        memcpy( (void*)&indexRecord->entry, (void*)entry, sizeof( directoryEntry ) );
+    }
+    isRecordBufferDirty = 1;
+}
+
+/* Makes the record buffer hold the chain's block at blockNumber */
+pathIndexBlock* private_loadRecordBlock( unsigned long blockNumber ) {
+    if( recordBufferBlock != pathIndexBlocks[blockNumber] ) {
+        private_flushRecordBuffer();
+        recordBufferBlock = pathIndexBlocks[blockNumber];
+        volumeRead( (void*)recordBuffer, pathIndex_lbaSize, recordBufferBlock );
+    }
+    return recordBuffer;
+}
+
+void private_flushRecordBuffer() {
+    if( isRecordBufferDirty ) {
+        volumeWrite( (void*)recordBuffer, pathIndex_lbaSize, recordBufferBlock );
+        isRecordBufferDirty = 0;
+    }
+}
+
+/* Reads the whole record chain into memory.
+ * Returns 0 if successful, -1 if a block of it is damaged. */
+int private_loadRecords() {
+    unsigned long blockLocation = mainSystemInfo->pathIndex;
+
+    while( blockLocation != 0 ) {
+        volumeRead( (void*)recordBuffer, pathIndex_lbaSize, blockLocation );
+        if( !isValidPathIndexBlock( recordBuffer ) ) {
+            printf( "ERROR: PATH INDEX IS DAMAGED, REBUILDING IT\n" );
+            return -1;
+        }
+
+        private_appendBlock( blockLocation );
+        unsigned long blockNumber = pathIndexBlockCount - 1;
+
+        for( unsigned long i = 0; i < pathIndex_recordsPerBlock; i++ ) {
+            pathIndexRecord* indexRecord = recordBuffer->records + i;
+            if( indexRecord->entry.childLocation == 0 ) {
+                continue;
+            }
+
+            pathIndexNode* node = calloc( 1, sizeof( pathIndexNode ) );
+            node->parentLocation = indexRecord->parentLocation;
+            memcpy( (void*)&node->entry, (void*)&indexRecord->entry, sizeof( directoryEntry ) );
+            node->record = blockNumber * pathIndex_recordsPerBlock + i;
+            private_insertNode( node );
+
+            isRecordUsed[node->record] = 1;
+            blockRecordCounts[blockNumber]++;
+        }
+
+        recordBufferBlock = blockLocation;
+        blockLocation = recordBuffer->next;
+    }
+
+    return 0;
+}
+
+/* Throws away whatever the records say and records every file found by
+ * walking the directories from root. The old chain is given back as far
+ * as it can be followed. */
+void private_rebuild() {
+    private_freeIndex();
+    recordBuffer = calloc( pathIndex_mallocSize, 1 );
+    pathIndexBucketCount = PATH_INDEX_MIN_BUCKETS;
+    pathIndexBuckets = calloc( pathIndexBucketCount, sizeof( pathIndexNode* ) );
+
+    unsigned long blockLocation = mainSystemInfo->pathIndex;
+    while( blockLocation != 0 ) {
+        volumeRead( (void*)recordBuffer, pathIndex_lbaSize, blockLocation );
+        if( !isValidPathIndexBlock( recordBuffer ) ) {
+            break;
+        }
+        unsigned long nextLocation = recordBuffer->next;
+        delete( blockLocation, pathIndex_lbaSize );
+        blockLocation = nextLocation;
+    }
+    mainSystemInfo->pathIndex = 0;
+
+    isPathIndexLoaded = 1;
+    private_indexDirectory( mainSystemInfo->rootLocation );
+    private_flushRecordBuffer();
+}
+
+void private_indexDirectory( unsigned long directoryLocation ) {
+    inodeHandle* directory = getInode( directoryLocation );
+    if( !isValidInode( directory ) || !isDirectory( directory->inode ) ) {
+        putInode( directory );
+        return;
+    }
+
+    directoryIterator* iterator = openDirectory( directory );
+    directoryEntry* childEntry;
+    while( ( childEntry = nextDirectoryEntry( iterator ) ) != NULL && isPathIndexLoaded ) {
+        private_addEntry( directoryLocation, childEntry );
+        if( childEntry->identifierType == IDENTIFIER_DIRECTORY ) {
+            private_indexDirectory( childEntry->childLocation );
+        }
+    }
+    closeDirectory( iterator );
+    putInode( directory );
+}
+
+/* Drops the in-memory index, nothing is written */
+void private_freeIndex() {
+    freeNameIndex();
+    for( unsigned long i = 0; i < pathIndexBucketCount; i++ ) {
+        pathIndexNode* node = pathIndexBuckets[i];
+        while( node != NULL ) {
+            pathIndexNode* nextNode = node->hashNext;
+            free( node );
+            node = nextNode;
+        }
+    }
+    free( pathIndexBuckets );
+    free( pathIndexBlocks );
+    free( isRecordUsed );
+    free( blockRecordCounts );
+    free( recordBuffer );
+
+    pathIndexBuckets = NULL;
+    pathIndexBucketCount = 0;
+    pathIndexNodeCount = 0;
+    pathIndexBlocks = NULL;
+    pathIndexBlockCount = 0;
+    isRecordUsed = NULL;
+    blockRecordCounts = NULL;
+    lowestOpenBlock = 0;
+    recordBuffer = NULL;
+    recordBufferBlock = 0;
+    isRecordBufferDirty = 0;
+    isPathIndexLoaded = 0;
+}
@@ -0,0 +1,16 @@
+#ifndef PATH_INDEX_H
+#define PATH_INDEX_H
+
+#include "systemstructs.h"
+
+#define PATH_INDEX_MIN_BUCKETS 1024
+
+int loadPathIndex();
+void closePathIndex();
+int isPathIndexReady();
+int lookupPathIndex( unsigned long parentLocation, char* fileName, directoryEntry* entry );
+void addPathIndexEntry( unsigned long parentLocation, directoryEntry* entry );
+void removePathIndexEntry( unsigned long parentLocation, char* fileName );
+int isValidPathIndexBlock( pathIndexBlock* pathIndexBlockToCheck );
+
+#endif /* PATH_INDEX_H end guard */
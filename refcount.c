@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fsLow.h"
+#include "systemstructs.h"
+#include "filesystem.h"
+#include "refcount.h"
+
+/* One block of the reference table at a time is kept in memory while a
+ * range is walked, since ranges are contiguous and mostly fit in one. */
+typedef struct referenceCursor {
+    referenceCount* counts;
+    unsigned long loadedBlock;
+    int isLoaded;
+    int isDirty;
+} referenceCursor;
+
+/* Held while a range is counted, since the table blocks are read, changed
+ * and written back whole and ranges of different files share them */
+pthread_mutex_t referenceTableLock = PTHREAD_MUTEX_INITIALIZER;
+
+referenceCount* private_referenceFor( referenceCursor* cursor, unsigned long blockLocation );
+void private_closeCursor( referenceCursor* cursor );
+unsigned long private_countsPerBlock();
+
+/* Allocates the reference table with every count at 0. Used when a new
+ * volume is created. Returns 0 if successful, -1 if there was no space. */
+int createReferenceTable() {
+    unsigned long volumeBlocks = mainSystemInfo->volumeSize / mainSystemInfo->lbaSize;
+    unsigned long tableBlocks =
+        ( volumeBlocks + private_countsPerBlock() - 1 ) / private_countsPerBlock();
+
+    unsigned long tableLocation = getFreeBlocks( tableBlocks );
+    if( tableLocation == 0 ) {
+        return -1;
+    }
+
+    void* zeros = calloc( tableBlocks, mainSystemInfo->lbaSize );
+    volumeWrite( zeros, tableBlocks, tableLocation );
+    free( zeros );
+
+    mainSystemInfo->referenceTable = tableLocation;
+    mainSystemInfo->referenceTableBlocks = tableBlocks;
+    return 0;
+}
+
+/* Adds a reference to every block in the range, for a file that now
+ * shares them. Returns 0 if successful, -1 if a block already has as many
+ * references as it can count, in which case nothing changed. */
+int shareBlocks( unsigned long blockLocation, unsigned long blockCount ) {
+    referenceCursor cursor = { NULL, 0, 0, 0 };
+    int returnValue = 0;
+
+    pthread_mutex_lock( &referenceTableLock );
+    for( unsigned long i = 0; i < blockCount; i++ ) {
+        if( *private_referenceFor( &cursor, blockLocation + i ) == MAX_EXTRA_REFERENCES ) {
+            returnValue = -1;
+            break;
+        }
+    }
+
+    for( unsigned long i = 0; i < blockCount && returnValue == 0; i++ ) {
+        ( *private_referenceFor( &cursor, blockLocation + i ) )++;
+        cursor.isDirty = 1;
+    }
+
+    private_closeCursor( &cursor );
+    pthread_mutex_unlock( &referenceTableLock );
+    return returnValue;
+}
+
+/* Drops a file's reference to every block in the range. Blocks no other
+ * file uses are given back to the free list, in runs. */
+int releaseBlocks( unsigned long blockLocation, unsigned long blockCount ) {
+    referenceCursor cursor = { NULL, 0, 0, 0 };
+    unsigned long runStart = 0;
+    unsigned long runLength = 0;
+
+    pthread_mutex_lock( &referenceTableLock );
+    for( unsigned long i = 0; i < blockCount; i++ ) {
+        referenceCount* count = private_referenceFor( &cursor, blockLocation + i );
+
+        if( *count > 0 ) {
+            ( *count )--;
+            cursor.isDirty = 1;
+            if( runLength > 0 ) {
+                delete( runStart, runLength );
+                runLength = 0;
+            }
+        }
+        else {
+            if( runLength == 0 ) {
+                runStart = blockLocation + i;
+            }
+            runLength++;
+        }
+    }
+
+    if( runLength > 0 ) {
+        delete( runStart, runLength );
+    }
+
+    private_closeCursor( &cursor );
+    pthread_mutex_unlock( &referenceTableLock );
+    return 0;
+}
+
+/* Returns 1 if any block in the range is used by more than one file */
+int hasSharedBlocks( unsigned long blockLocation, unsigned long blockCount ) {
+    referenceCursor cursor = { NULL, 0, 0, 0 };
+    int isShared = 0;
+
+    pthread_mutex_lock( &referenceTableLock );
+    for( unsigned long i = 0; i < blockCount && !isShared; i++ ) {
+        isShared = *private_referenceFor( &cursor, blockLocation + i ) > 0;
+    }
+
+    private_closeCursor( &cursor );
+    pthread_mutex_unlock( &referenceTableLock );
+    return isShared;
+}
+
+/* Returns the count for blockLocation, loading its table block and writing
+ * back the one before it if it was changed */
+referenceCount* private_referenceFor( referenceCursor* cursor, unsigned long blockLocation ) {
+    unsigned long tableBlock = blockLocation / private_countsPerBlock();
+
+    if( cursor->counts == NULL ) {
+        cursor->counts = malloc( mainSystemInfo->lbaSize );
+    }
+
+    if( !cursor->isLoaded || cursor->loadedBlock != tableBlock ) {
+        if( cursor->isLoaded && cursor->isDirty ) {
+            volumeWrite( (void*)cursor->counts, 1, mainSystemInfo->referenceTable + cursor->loadedBlock );
+        }
+        volumeRead( (void*)cursor->counts, 1, mainSystemInfo->referenceTable + tableBlock );
+        cursor->loadedBlock = tableBlock;
+        cursor->isLoaded = 1;
+        cursor->isDirty = 0;
+    }
+
+    return cursor->counts + ( blockLocation % private_countsPerBlock() );
+}
+
+void private_closeCursor( referenceCursor* cursor ) {
+    if( cursor->isLoaded && cursor->isDirty ) {
+        volumeWrite( (void*)cursor->counts, 1, mainSystemInfo->referenceTable + cursor->loadedBlock );
+    }
+    free( cursor->counts );
+}
+
+unsigned long private_countsPerBlock() {
+    return mainSystemInfo->lbaSize / sizeof( referenceCount );
+}
@@ -0,0 +1,15 @@
+#ifndef REFCOUNT_H
+#define REFCOUNT_H
+
+/* Data blocks can be shared between files by cp. The reference table keeps
+ * one count per block of the volume of how many extra files use it, so
+ * 0 is the usual case of a block owned by a single file. */
+typedef unsigned short referenceCount;
+#define MAX_EXTRA_REFERENCES 0xFFFF
+
+int createReferenceTable();
+int shareBlocks( unsigned long blockLocation, unsigned long blockCount );
+int releaseBlocks( unsigned long blockLocation, unsigned long blockCount );
+int hasSharedBlocks( unsigned long blockLocation, unsigned long blockCount );
+
+#endif /* REFCOUNT_H end guard */
@@ -0,0 +1,497 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fsLow.h"
+#include "systemstructs.h"
+#include "filesystem.h"
+#include "inode.h"
+#include "filehandle.h"
+#include "snapshot.h"
+#include "dentry.h"
+
+/* What is kept in memory for each valid snapshot: where every saved block
+ * is, hashed on the volume block it came from (origin + 1, so 0 marks an
+ * empty slot), and the exception block of the group being filled. */
+typedef struct snapshotState {
+    unsigned long* origins;
+    unsigned long* copies;
+    unsigned long tableSize;
+    unsigned long exceptionCount;
+    exceptionBlock* group;
+    unsigned long groupLocation;
+} snapshotState;
+
+snapshotTable* snapshots = NULL;
+snapshotState* snapshotStates[MAX_SNAPSHOTS];
+unsigned long snapshotTableLocation = 0;
+int activeSnapshotCount = 0;
+int mountedSnapshot = -1;
+
+// held while old contents are saved, so writes from several threads don't
+// fill the same exception group
+pthread_mutex_t preserveLock = PTHREAD_MUTEX_INITIALIZER;
+
+void private_preserveBlocks( unsigned long blockLocation, unsigned long blockCount );
+unsigned long private_findCopy( snapshotState* state, unsigned long origin );
+void private_addCopy( snapshotState* state, unsigned long origin, unsigned long copy );
+snapshotState* private_newState( snapshot* snapshotInfo );
+void private_loadState( int index );
+void private_freeState( int index );
+void private_startGroup( snapshotState* state, snapshot* snapshotInfo, unsigned long groupLocation );
+unsigned long private_groupCapacity( snapshot* snapshotInfo, unsigned long groupLocation );
+void private_overflowSnapshot( int index );
+int private_findSnapshot( char* name );
+void private_writeSnapshotTable();
+
+/* Reads blockCount blocks at blockLocation. With a snapshot mounted the
+ * blocks come from its view of the volume. */
+unsigned long volumeRead( void* buffer, unsigned long blockCount, unsigned long blockLocation ) {
+    if( mountedSnapshot < 0 ) {
+        return LBAread( buffer, blockCount, blockLocation );
+    }
+
+    // blocks that were never changed are read from the live volume in runs
+    snapshotState* state = snapshotStates[mountedSnapshot];
+    unsigned long runStart = 0;
+    for( unsigned long i = 0; i <= blockCount; i++ ) {
+        unsigned long copy = i < blockCount ? private_findCopy( state, blockLocation + i ) : 0;
+        if( i == blockCount || copy != 0 ) {
+            if( i > runStart ) {
+                LBAread( (char*)buffer + runStart * mainSystemInfo->lbaSize,
+                         i - runStart, blockLocation + runStart );
+            }
+            if( copy != 0 ) {
+                LBAread( (char*)buffer + i * mainSystemInfo->lbaSize, 1, copy );
+            }
+            runStart = i + 1;
+        }
+    }
+
+    return blockCount;
+}
+
+/* Writes blockCount blocks at blockLocation, first saving the old contents
+ * of any of them a snapshot has not saved yet. Nothing can be written while
+ * a snapshot is mounted. */
+unsigned long volumeWrite( void* buffer, unsigned long blockCount, unsigned long blockLocation ) {
+    if( mountedSnapshot >= 0 ) {
+        printf( "ERROR: A SNAPSHOT IS MOUNTED, THE VOLUME IS READ ONLY\n" );
+        return 0;
+    }
+
+    if( activeSnapshotCount > 0 ) {
+        pthread_mutex_lock( &preserveLock );
+        private_preserveBlocks( blockLocation, blockCount );
+        pthread_mutex_unlock( &preserveLock );
+    }
+
+    return LBAwrite( buffer, blockCount, blockLocation );
+}
+
+/* Allocates an empty snapshot table. Used when a new volume is created.
+ * Returns 0 if successful, -1 if there was no space. */
+int createSnapshotTable() {
+    unsigned long tableLocation = getFreeBlocks( snapshot_lbaSize );
+    if( tableLocation == 0 ) {
+        return -1;
+    }
+
+    snapshotTable* table = calloc( snapshot_mallocSize, 1 );
+    table->signature1 = SNAPSHOTSIGNATURE1;
+    table->signature2 = SNAPSHOTSIGNATURE2;
+    table->nextId = 1;
+    LBAwrite( (void*)table, snapshot_lbaSize, tableLocation );
+    free( table );
+
+    mainSystemInfo->snapshotTable = tableLocation;
+    return 0;
+}
+
+/* Reads the snapshot table and rebuilds the list of saved blocks of every
+ * valid snapshot from the exception blocks in its store */
+int loadSnapshots() {
+    snapshots = calloc( snapshot_mallocSize, 1 );
+    snapshotTableLocation = mainSystemInfo->snapshotTable;
+    LBAread( (void*)snapshots, snapshot_lbaSize, snapshotTableLocation );
+
+    if( !isValidSnapshotTable( snapshots ) ) {
+        printf( "ERROR: SNAPSHOT TABLE IS DAMAGED, SNAPSHOTS ARE UNAVAILABLE\n" );
+        memset( (void*)snapshots, 0, snapshot_mallocSize );
+        snapshotTableLocation = 0;
+        return -1;
+    }
+
+    for( int i = 0; i < MAX_SNAPSHOTS; i++ ) {
+        if( snapshots->snapshots[i].state == SNAPSHOT_VALID ) {
+            private_loadState( i );
+        }
+    }
+
+    return 0;
+}
+
+/* Drops the in-memory state of every snapshot, used when the volume is
+ * closed */
+void freeSnapshots() {
+    for( int i = 0; i < MAX_SNAPSHOTS; i++ ) {
+        private_freeState( i );
+    }
+    free( snapshots );
+    snapshots = NULL;
+}
+
+/* Takes a snapshot of the volume as it is now. No data is copied; the
+ * store of storeBlocks blocks is reserved for the old contents of blocks
+ * written from now on, and the snapshot stays valid until it fills up.
+ * Returns 0 if successful, -1 otherwise. */
+int createSnapshot( char* name, unsigned long storeBlocks ) {
+    if( mountedSnapshot >= 0 ) {
+        printf( "ERROR: A SNAPSHOT IS MOUNTED, THE VOLUME IS READ ONLY\n" );
+        return -1;
+    }
+    if( snapshotTableLocation == 0 ) {
+        printf( "ERROR: SNAPSHOTS ARE UNAVAILABLE\n" );
+        return -1;
+    }
+    if( strlen( name ) == 0 || strlen( name ) >= SNAPSHOT_NAME_LENGTH ) {
+        printf( "Snapshot names must be 1 to %d characters\n", SNAPSHOT_NAME_LENGTH - 1 );
+        return -1;
+    }
+    if( private_findSnapshot( name ) >= 0 ) {
+        printf( "Snapshot %s already exists\n", name );
+        return -1;
+    }
+    if( storeBlocks <= exception_lbaSize ) {
+        printf( "Snapshot store is too small\n" );
+        return -1;
+    }
+
+    int index = -1;
+    for( int i = 0; i < MAX_SNAPSHOTS && index < 0; i++ ) {
+        if( snapshots->snapshots[i].state == SNAPSHOT_UNUSED ) {
+            index = i;
+        }
+    }
+    if( index < 0 ) {
+        printf( "ERROR: NO MORE THAN %d SNAPSHOTS CAN BE KEPT\n", MAX_SNAPSHOTS );
+        return -1;
+    }
+
+    unsigned long storeLocation = getFreeBlocks( storeBlocks );
+    if( storeLocation == 0 ) {
+        printf( "ERROR: NOT ENOUGH FREE SPACE FOR THE SNAPSHOT STORE\n" );
+        return -1;
+    }
+
+    // everything still in memory goes to the volume first, so the snapshot
+    // sees the same files as the live volume
+    syncAllFiles();
+    flushInodeCache();
+    volumeWrite( (void*)mainSystemInfo, system_lbaSize, 0 );
+
+    snapshot* snapshotInfo = snapshots->snapshots + index;
+    memset( (void*)snapshotInfo, 0, sizeof( snapshot ) );
+    strcpy( snapshotInfo->name, name );
+    snapshotInfo->id = snapshots->nextId++;
+    snapshotInfo->created = time( NULL );
+    snapshotInfo->storeLocation = storeLocation;
+    snapshotInfo->storeBlocks = storeBlocks;
+    snapshotInfo->state = SNAPSHOT_VALID;
+
+    snapshotState* state = private_newState( snapshotInfo );
+    private_startGroup( state, snapshotInfo, storeLocation );
+    LBAwrite( (void*)state->group, exception_lbaSize, state->groupLocation );
+    private_writeSnapshotTable();
+
+    snapshotStates[index] = state;
+    activeSnapshotCount++;
+    return 0;
+}
+
+/* Deletes a snapshot and gives its store back to the free list.
+ * Returns 0 if successful, -1 otherwise. */
+int deleteSnapshot( char* name ) {
+    int index = private_findSnapshot( name );
+    if( index < 0 ) {
+        printf( "No snapshot named %s\n", name );
+        return -1;
+    }
+    if( mountedSnapshot >= 0 ) {
+        printf( "ERROR: A SNAPSHOT IS MOUNTED, THE VOLUME IS READ ONLY\n" );
+        return -1;
+    }
+
+    snapshot* snapshotInfo = snapshots->snapshots + index;
+    if( snapshotStates[index] != NULL ) {
+        private_freeState( index );
+        activeSnapshotCount--;
+    }
+    snapshotInfo->state = SNAPSHOT_UNUSED;
+    private_writeSnapshotTable();
+
+    delete( snapshotInfo->storeLocation, snapshotInfo->storeBlocks );
+    return 0;
+}
+
+void listSnapshots() {
+    char created[TIME_STRING_SIZE];
+    for( int i = 0; i < MAX_SNAPSHOTS; i++ ) {
+        snapshot* snapshotInfo = snapshots->snapshots + i;
+        formatTime( created, snapshotInfo->created, NO_NANOSECONDS );
+        if( snapshotInfo->state == SNAPSHOT_VALID ) {
+            printf( "%-20s created %s, %lu of %lu store blocks used%s\n",
+                    snapshotInfo->name, created,
+                    snapshotStates[i]->exceptionCount, snapshotInfo->storeBlocks,
+                    i == mountedSnapshot ? ", mounted" : "" );
+        }
+        else if( snapshotInfo->state == SNAPSHOT_OVERFLOWED ) {
+            printf( "%-20s created %s, store overflowed, no longer valid\n",
+                    snapshotInfo->name, created );
+        }
+    }
+}
+
+/* Switches the file system over to a read only view of the snapshot. Open
+ * files are closed and cached headers dropped, since they belong to the
+ * live volume. Returns 0 if successful, -1 otherwise. */
+int mountSnapshot( char* name ) {
+    int index = private_findSnapshot( name );
+    if( index < 0 || snapshots->snapshots[index].state != SNAPSHOT_VALID ) {
+        printf( "No valid snapshot named %s\n", name );
+        return -1;
+    }
+    if( mountedSnapshot >= 0 ) {
+        printf( "A snapshot is already mounted\n" );
+        return -1;
+    }
+
+    closeAllFiles();
+    freeInodeCache();
+    freeDentryCache();
+    volumeWrite( (void*)mainSystemInfo, system_lbaSize, 0 );
+
+    mountedSnapshot = index;
+    volumeRead( (void*)mainSystemInfo, system_lbaSize, 0 );
+    return 0;
+}
+
+/* Goes back to the live volume */
+int unmountSnapshot() {
+    if( mountedSnapshot < 0 ) {
+        printf( "No snapshot is mounted\n" );
+        return -1;
+    }
+
+    closeAllFiles();
+    freeInodeCache();
+    freeDentryCache();
+
+    mountedSnapshot = -1;
+    LBAread( (void*)mainSystemInfo, system_lbaSize, 0 );
+    return 0;
+}
+
+int isSnapshotMounted() {
+    return mountedSnapshot >= 0;
+}
+
+int isValidSnapshotTable( snapshotTable* snapshotTableToCheck ) {
+    return ( snapshotTableToCheck->signature1 == SNAPSHOTSIGNATURE1 ) &&
+           ( snapshotTableToCheck->signature2 == SNAPSHOTSIGNATURE2 );
+}
+
+int isValidExceptionBlock( exceptionBlock* exceptionBlockToCheck, unsigned long snapshotId ) {
+    return ( exceptionBlockToCheck->signature1 == EXCEPTIONSIGNATURE1 ) &&
+           ( exceptionBlockToCheck->signature2 == EXCEPTIONSIGNATURE2 ) &&
+           ( exceptionBlockToCheck->snapshotId == snapshotId ) &&
+           ( exceptionBlockToCheck->count <= exception_exceptionsPerBlock );
+}
+
+/* Saves the current contents of the blocks in the range to the store of
+ * every snapshot that does not have them yet. The range is read once, and
+ * each snapshot's exception block is written once after its copies. */
+void private_preserveBlocks( unsigned long blockLocation, unsigned long blockCount ) {
+    char* oldData = NULL;
+    unsigned int blockSize = mainSystemInfo->lbaSize;
+
+    for( int index = 0; index < MAX_SNAPSHOTS; index++ ) {
+        snapshotState* state = snapshotStates[index];
+        snapshot* snapshotInfo = snapshots->snapshots + index;
+        int isChanged = 0;
+
+        for( unsigned long i = 0; i < blockCount && state != NULL; i++ ) {
+            if( private_findCopy( state, blockLocation + i ) != 0 ) {
+                continue;
+            }
+            if( oldData == NULL ) {
+                oldData = malloc( blockCount * blockSize );
+                LBAread( (void*)oldData, blockCount, blockLocation );
+            }
+
+            // move on to the next group once this one is full
+            if( state->group->count == private_groupCapacity( snapshotInfo, state->groupLocation ) ) {
+                unsigned long nextLocation =
+                    state->groupLocation + exception_lbaSize + exception_exceptionsPerBlock;
+                if( private_groupCapacity( snapshotInfo, nextLocation ) == 0 ) {
+                    private_overflowSnapshot( index );
+                    state = NULL;
+                    isChanged = 0;
+                    break;
+                }
+                if( isChanged ) {
+                    LBAwrite( (void*)state->group, exception_lbaSize, state->groupLocation );
+                }
+                private_startGroup( state, snapshotInfo, nextLocation );
+            }
+
+            unsigned long copy = state->groupLocation + exception_lbaSize + state->group->count;
+            LBAwrite( (void*)( oldData + i * blockSize ), 1, copy );
+            state->group->origins[state->group->count++] = blockLocation + i;
+            private_addCopy( state, blockLocation + i, copy );
+            isChanged = 1;
+        }
+
+        if( isChanged ) {
+            LBAwrite( (void*)state->group, exception_lbaSize, state->groupLocation );
+        }
+    }
+
+    free( oldData );
+}
+
+/* Returns where the snapshot saved origin, or 0 if it hasn't */
+unsigned long private_findCopy( snapshotState* state, unsigned long origin ) {
+    unsigned long mask = state->tableSize - 1;
+    unsigned long slot = ( origin * 0x9E3779B97F4A7C15UL ) & mask;
+
+    while( state->origins[slot] != 0 ) {
+        if( state->origins[slot] == origin + 1 ) {
+            return state->copies[slot];
+        }
+        slot = ( slot + 1 ) & mask;
+    }
+    return 0;
+}
+
+void private_addCopy( snapshotState* state, unsigned long origin, unsigned long copy ) {
+    unsigned long mask = state->tableSize - 1;
+    unsigned long slot = ( origin * 0x9E3779B97F4A7C15UL ) & mask;
+
+    while( state->origins[slot] != 0 ) {
+        slot = ( slot + 1 ) & mask;
+    }
+    state->origins[slot] = origin + 1;
+    state->copies[slot] = copy;
+    state->exceptionCount++;
+}
+
+/* The hash table is sized for a full store at most half loaded, so it
+ * never has to grow */
+snapshotState* private_newState( snapshot* snapshotInfo ) {
+    snapshotState* state = calloc( 1, sizeof( snapshotState ) );
+    state->tableSize = 16;
+    while( state->tableSize < snapshotInfo->storeBlocks * 2 ) {
+        state->tableSize *= 2;
+    }
+    state->origins = calloc( state->tableSize, sizeof( unsigned long ) );
+    state->copies = calloc( state->tableSize, sizeof( unsigned long ) );
+    state->group = calloc( exception_mallocSize, 1 );
+    return state;
+}
+
+/* Walks the groups of a snapshot's store up to the first one that isn't
+ * full, which is where new copies will go */
+void private_loadState( int index ) {
+    snapshot* snapshotInfo = snapshots->snapshots + index;
+    snapshotState* state = private_newState( snapshotInfo );
+    unsigned long groupLocation = snapshotInfo->storeLocation;
+
+    while( 1 ) {
+        LBAread( (void*)state->group, exception_lbaSize, groupLocation );
+        state->groupLocation = groupLocation;
+        if( !isValidExceptionBlock( state->group, snapshotInfo->id ) ) {
+            private_startGroup( state, snapshotInfo, groupLocation );
+            break;
+        }
+
+        for( unsigned int i = 0; i < state->group->count; i++ ) {
+            private_addCopy( state, state->group->origins[i], groupLocation + exception_lbaSize + i );
+        }
+
+        unsigned long nextLocation = groupLocation + exception_lbaSize + exception_exceptionsPerBlock;
+        if( state->group->count < private_groupCapacity( snapshotInfo, groupLocation ) ||
+            private_groupCapacity( snapshotInfo, nextLocation ) == 0 ) {
+            break;
+        }
+        groupLocation = nextLocation;
+    }
+
+    snapshotStates[index] = state;
+    activeSnapshotCount++;
+}
+
+void private_freeState( int index ) {
+    snapshotState* state = snapshotStates[index];
+    if( state == NULL ) {
+        return;
+    }
+    free( state->origins );
+    free( state->copies );
+    free( state->group );
+    free( state );
+    snapshotStates[index] = NULL;
+}
+
+/* Sets up an empty exception block for the group at groupLocation */
+void private_startGroup( snapshotState* state, snapshot* snapshotInfo, unsigned long groupLocation ) {
+    memset( (void*)state->group, 0, exception_mallocSize );
+    state->group->signature1 = EXCEPTIONSIGNATURE1;
+    state->group->signature2 = EXCEPTIONSIGNATURE2;
+    state->group->snapshotId = snapshotInfo->id;
+    state->group->count = 0;
+    state->groupLocation = groupLocation;
+}
+
+/* Returns how many copies fit in the group at groupLocation, which is less
+ * than a full group at the end of the store */
+unsigned long private_groupCapacity( snapshot* snapshotInfo, unsigned long groupLocation ) {
+    unsigned long storeEnd = snapshotInfo->storeLocation + snapshotInfo->storeBlocks;
+    if( groupLocation + exception_lbaSize >= storeEnd ) {
+        return 0;
+    }
+
+    unsigned long capacity = storeEnd - groupLocation - exception_lbaSize;
+    return capacity < exception_exceptionsPerBlock ? capacity : exception_exceptionsPerBlock;
+}
+
+/* A snapshot whose store is full would miss the old contents of the next
+ * block written, so it stops being a snapshot. Its store is kept until it
+ * is deleted. */
+void private_overflowSnapshot( int index ) {
+    snapshot* snapshotInfo = snapshots->snapshots + index;
+    printf( "ERROR: SNAPSHOT %s IS FULL AND NO LONGER VALID\n", snapshotInfo->name );
+
+    private_freeState( index );
+    activeSnapshotCount--;
+    snapshotInfo->state = SNAPSHOT_OVERFLOWED;
+    private_writeSnapshotTable();
+}
+
+int private_findSnapshot( char* name ) {
+    for( int i = 0; i < MAX_SNAPSHOTS; i++ ) {
+        if( snapshots->snapshots[i].state != SNAPSHOT_UNUSED &&
+            strcmp( snapshots->snapshots[i].name, name ) == 0 ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// the table describes the snapshots rather than being part of any of them,
+// so it bypasses volumeWrite()
+void private_writeSnapshotTable() {
+    LBAwrite( (void*)snapshots, snapshot_lbaSize, snapshotTableLocation );
+}
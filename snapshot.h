@@ -0,0 +1,24 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "systemstructs.h"
+
+// All of the file system's block I/O goes through these two, so a write
+// can save a block's old contents for the snapshots before it changes and
+// a mounted snapshot can be read in place of the live volume.
+unsigned long volumeRead( void* buffer, unsigned long blockCount, unsigned long blockLocation );
+unsigned long volumeWrite( void* buffer, unsigned long blockCount, unsigned long blockLocation );
+
+int createSnapshotTable();
+int loadSnapshots();
+void freeSnapshots();
+int createSnapshot( char* name, unsigned long storeBlocks );
+int deleteSnapshot( char* name );
+void listSnapshots();
+int mountSnapshot( char* name );
+int unmountSnapshot();
+int isSnapshotMounted();
+int isValidSnapshotTable( snapshotTable* snapshotTableToCheck );
+int isValidExceptionBlock( exceptionBlock* exceptionBlockToCheck, unsigned long snapshotId );
+
+#endif /* SNAPSHOT_H end guard */
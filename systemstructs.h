@@ -8,10 +8,17 @@
 #define PERMISSION_READ 0b001
 #define PERMISSION_WRITE 0b010
 #define PERMISSION_EXECUTE 0b100
-#define NUMBER_OF_CHILDREN 64
 #define FILESIGNATURE1 0x6512F67ED9EF96A6
 #define FILESIGNATURE2 0x45A7D995E6BB8322
-#define ID_LENGTH 64
+#define HASH_SEGMENTS 32
+#define DIRECTORY_BLOCK_BYTES 4096
+#define INLINE_EXTENTS 4
+
+/* A run of contiguous data blocks belonging to a file */
+typedef struct extentStruct {
+    unsigned long startBlock;
+    unsigned long count;
+} extent;
 
 typedef struct fileStruct {
     unsigned long signature1;
@@ -20,20 +27,39 @@ typedef struct fileStruct {
                                      // 00 file, 01 directory
                                      // 10 link to file, 11 link to directory
     char fileName[256];
-    char id[64]; 
+    unsigned long inodeNumber;    // unique for the life of the volume
     unsigned int permissions : 3; // permissions to read/write/exec/etc
 					              // 001 read, 010 write, 100 execute
-    unsigned long modified;
+    unsigned long modified;           // seconds, and nanoseconds below
     unsigned long created;
+    unsigned int modifiedNanoseconds;
+    unsigned int createdNanoseconds;
     unsigned long fileSize;
-    unsigned long startingBlock;      
-    unsigned long children[NUMBER_OF_CHILDREN];
+    unsigned long blockCount;         // data blocks held in extents, 0 when
+                                      // the data is kept inline
+    unsigned int extentCount;         // the first INLINE_EXTENTS extents live
+    extent extents[INLINE_EXTENTS];   // here, the rest in a chain of
+    unsigned long firstExtentBlock;   // extentBlocks, see below
+    unsigned long lastExtentBlock;
+    unsigned long childCount;         // directories only
+    unsigned long firstDirectoryBlock; // chain of directoryBlocks holding
+    unsigned long lastDirectoryBlock;  // the children, see below
+    unsigned int hashLevel;           // name index of a directory, see
+    unsigned long hashSplit;          // hashBucket below
+    unsigned long hashSegments[HASH_SEGMENTS];
+    unsigned long nextOrphan;         // deleted but not yet freed, see
+                                      // sysInfo.orphanHead
 
     unsigned long signature2;
+
+    // Files whose data fits in the rest of the header's blocks keep it
+    // here instead of in a separate extent, see file_inlineCapacity.
+    char inlineData[];
 } file;
 
 #define SYSTEMSIGNATURE1 0x11B3DF89400A8A4E
 #define SYSTEMSIGNATURE2 0x88AADF38E9904DBC
+#define FILESYSTEM_VERSION 12
 typedef struct fileSysInfo {
     unsigned long signature1;
 	unsigned long volumeSize;
@@ -41,6 +67,18 @@ typedef struct fileSysInfo {
 	unsigned long rootLocation;
 	char volumeName[256];
 	unsigned int lbaSize;     // LBA Size in bytes per block
+	unsigned int version;     // on-disk layout, see FILESYSTEM_VERSION
+	unsigned long referenceTable;       // per block reference counts for
+	unsigned long referenceTableBlocks; // data shared between files
+	unsigned long snapshotTable;        // see snapshotTable below
+	unsigned long nextInodeNumber;      // inode numbers are never reused
+	unsigned long inodeIndex;           // root of the inodeIndexBlock tree
+	unsigned int inodeIndexDepth;
+	unsigned long pathIndex;            // first pathIndexBlock of the chain
+	unsigned int pathIndexClean;        // the volume was closed with the
+	                                    // path index up to date
+	unsigned long orphanHead;           // deleted files waiting to be freed,
+	                                    // chained through file.nextOrphan
     unsigned long signature2;
 } sysInfo;
 
@@ -55,4 +93,161 @@ typedef struct freeSpaceInfo {
 	unsigned long signature2;
 } freeSpace;
 
+#define DIRECTORYSIGNATURE1 0x5C0E13A9D47B2F61
+#define DIRECTORYSIGNATURE2 0xE2487B15A6D09C3F
+
+/* A child as recorded in its parent directory. The name and type are kept
+ * here as well as in the child's own header so listing a directory or
+ * walking a path never has to read the children's headers. */
+typedef struct directoryEntryStruct {
+    unsigned long childLocation;
+    unsigned int identifierType;
+    char fileName[256];
+} directoryEntry;
+
+/* The children of a directory live in a doubly linked chain of directory
+ * blocks of DIRECTORY_BLOCK_BYTES each. Every block but the last is kept
+ * full, so a new child always goes at the end of the last block and the
+ * header's childCount tells us how full that block is without reading it.
+ * children[] fills the rest of the block, see directory_childrenPerBlock. */
+typedef struct directoryBlockStruct {
+    unsigned long signature1;
+    unsigned long next;
+    unsigned long prev;
+    unsigned int count;
+    unsigned long signature2;
+    directoryEntry children[];
+} directoryBlock;
+
+#define EXTENTSIGNATURE1 0x3B6E90D2C18F4A57
+#define EXTENTSIGNATURE2 0xA41D7F6C0E25B9E3
+
+/* Extents past the ones kept in the header go in a doubly linked chain of
+ * one block extentBlocks. Like directory blocks every block but the last
+ * is kept full, so the header's extentCount says where the last extent is.
+ * extents[] fills the rest of the block, see extent_extentsPerBlock. */
+typedef struct extentBlockStruct {
+    unsigned long signature1;
+    unsigned long next;
+    unsigned long prev;
+    unsigned int count;
+    unsigned long signature2;
+    extent extents[];
+} extentBlock;
+
+#define HASHSIGNATURE1 0x7D21C6E04B9A3F58
+#define HASHSIGNATURE2 0x0F94B37AE6C51D82
+
+/* Each directory also keeps a linear hashing index from a child's name to
+ * the child, so a name can be looked up without scanning the directory.
+ * The index grows one bucket split at a time. Bucket 0 is segment 0 and
+ * segment k (k >= 1) holds buckets 2^(k-1) to 2^k - 1 in contiguous blocks,
+ * so a bucket's location comes straight from hashSegments in the header.
+ * Buckets that fill up chain on overflow blocks. Entries also remember
+ * where the child's directoryEntry sits in the directory block chain, which
+ * is where a hash match is confirmed against the name, and which lets a
+ * child be removed without a scan. */
+typedef struct hashEntryStruct {
+    unsigned int nameHash;
+    unsigned int slot;
+    unsigned long directoryBlock;
+    unsigned long childLocation;
+} hashEntry;
+
+typedef struct hashBucketStruct {
+    unsigned long signature1;
+    unsigned long overflow;
+    unsigned int count;
+    unsigned long signature2;
+    hashEntry entries[];
+} hashBucket;
+
+#define INODEINDEXSIGNATURE1 0x6A0F3D81C5E7924B
+#define INODEINDEXSIGNATURE2 0xB7295E4C18D3A06F
+#define INODE_INDEX_BLOCK_BYTES 4096
+
+/* Inode numbers lead to their file's header through a radix tree of index
+ * blocks, like the indirect blocks of ext2, sysInfo's inodeIndexDepth
+ * levels deep. In a leaf the entry for a number is its header location, 0
+ * once the file is deleted; in the levels above an entry is the location
+ * of the index block below. Numbers are handed out in order and never
+ * reused, so the tree only grows on the right, and gets a new root when
+ * the numbers outgrow it. entries[] fills the rest of the block, see
+ * inodeIndex_entriesPerBlock. */
+typedef struct inodeIndexBlockStruct {
+    unsigned long signature1;
+    unsigned long signature2;
+    unsigned long entries[];
+} inodeIndexBlock;
+
+#define PATHINDEXSIGNATURE1 0x3E8C17D4A9B2065F
+#define PATHINDEXSIGNATURE2 0xC5072B9E4D61F8A3
+#define PATH_INDEX_BLOCK_BYTES 4096
+
+/* The path index keeps a record of every file below root in a chain of
+ * these blocks, apart from the directories themselves, so it can be loaded
+ * into memory in one pass at mount. A record is the location of the
+ * directory the file is in and the file's directory entry, and a record
+ * whose entry has a childLocation of 0 is free. records[] fills the rest
+ * of the block, see pathIndex_recordsPerBlock. */
+typedef struct pathIndexRecordStruct {
+    unsigned long parentLocation;
+    directoryEntry entry;
+} pathIndexRecord;
+
+typedef struct pathIndexBlockStruct {
+    unsigned long signature1;
+    unsigned long next;
+    unsigned long signature2;
+    pathIndexRecord records[];
+} pathIndexBlock;
+
+#define SNAPSHOTSIGNATURE1 0x92D4E07B3A5C1F68
+#define SNAPSHOTSIGNATURE2 0x4F1B8AC63E07D295
+#define MAX_SNAPSHOTS 8
+#define SNAPSHOT_NAME_LENGTH 64
+#define SNAPSHOT_UNUSED 0
+#define SNAPSHOT_VALID 1
+#define SNAPSHOT_OVERFLOWED 2
+
+/* A snapshot is a frozen view of the whole volume as it was when it was
+ * taken. Nothing is copied then; instead the first time a block is
+ * written afterwards its old contents are saved to the snapshot's store,
+ * a run of storeBlocks blocks reserved when it was taken. Reading the
+ * snapshot reads the saved copy of a block if there is one and the live
+ * block otherwise. A snapshot whose store fills up can no longer be kept
+ * consistent and is marked overflowed. */
+typedef struct snapshotStruct {
+    char name[SNAPSHOT_NAME_LENGTH];
+    unsigned long id;
+    unsigned long created;
+    unsigned long storeLocation;
+    unsigned long storeBlocks;
+    unsigned int state;
+} snapshot;
+
+typedef struct snapshotTableStruct {
+    unsigned long signature1;
+    unsigned long nextId;
+    snapshot snapshots[MAX_SNAPSHOTS];
+    unsigned long signature2;
+} snapshotTable;
+
+#define EXCEPTIONSIGNATURE1 0xC83A16F05D9B2E47
+#define EXCEPTIONSIGNATURE2 0x3E75D0B9A1246FC8
+
+/* A store is split into groups of one exceptionBlock followed by the
+ * saved copies it lists, origins[i] being the volume block whose old
+ * contents are in the i-th block after it. snapshotId tells a group
+ * written by this snapshot apart from one left by an older snapshot that
+ * used the same blocks. origins[] fills the rest of the block, see
+ * exception_exceptionsPerBlock. */
+typedef struct exceptionBlockStruct {
+    unsigned long signature1;
+    unsigned long snapshotId;
+    unsigned int count;
+    unsigned long signature2;
+    unsigned long origins[];
+} exceptionBlock;
+
 #endif /* SYSTEM_STRUCTS_H end guard */
@@ -7,11 +7,15 @@
 #include "commands.h"
 #include "filesystem.h"
 #include "terminal.h"
+#include "orphan.h"
+#include "nameindex.h"
+#include "pathindex.h"
 
 int isStillRunning = 1;
-char currentFilePath[1025];
+char currentFilePath[PATH_BUFFER_SIZE];
+directoryHandle currentDirectory;
 char prompt[3] = "> ";
-char pathAndPrompt[1025];
+char pathAndPrompt[PATH_BUFFER_SIZE + 2];
 
 int startTerminal() {
 
@@ -22,6 +26,9 @@ int startTerminal() {
 
     initializeHashmap();
 
+    // deleted files are freed a little at a time while waiting for input
+    rl_event_hook = &reclaimWhileIdle;
+
     printf( "------------------------------------------------"
             "\n\n"
             "Type 'quit' to quit\n"
@@ -78,18 +85,81 @@ char** stringToArrayOfStrings( char* oldString ) {
     return arrayOfStrings;
 }
 
+/* Called by readline while it waits for input */
+int reclaimWhileIdle() {
+    reclaimOrphans( ORPHAN_RECLAIM_BLOCKS );
+    return 0;
+}
+
 void stopRunning() {
     isStillRunning = 0;
 }
 
 char* getCurrentFilePath() {
-    char* tempPath = malloc( 1025 * sizeof( char ) );
+    char* tempPath = malloc( PATH_BUFFER_SIZE * sizeof( char ) );
     strcpy( tempPath, currentFilePath );
     return tempPath;
 }
 
+/* Same as getCurrentFilePath() but without the copy, for callers that only
+ * read it before the next cd */
+const char* peekCurrentFilePath() {
+    return currentFilePath;
+}
+
+/* Changes directory to the absolute path given */
 void setCurrentFilePath( char* path ) {
+    directoryHandle handle;
+    if( openDirectoryHandle( NULL, path, &handle ) == 0 ) {
+        setCurrentDirectory( path, &handle );
+    }
+}
+
+/* Changes directory to an already open handle. path is only what the
+ * prompt shows, relative paths are looked up from the handle. */
+void setCurrentDirectory( char* path, directoryHandle* handle ) {
+    currentDirectory = *handle;
     strcpy( currentFilePath, path );
     strcpy( pathAndPrompt, currentFilePath );
     strcat( pathAndPrompt, prompt );
+}
+
+/* Changes directory to the one holding the current directory, found from
+ * the handle so it still works after the directory has been moved.
+ * Returns 0 if successful, -1 if the current directory no longer exists. */
+int changeToParentDirectory() {
+    if( !isPathIndexReady() ) {
+        // nothing moves while a snapshot is mounted, so the path is current
+        char path[PATH_BUFFER_SIZE];
+        strcpy( path, currentFilePath );
+        char* lastSlash = strrchr( path, '/' );
+        if( lastSlash != NULL ) {
+            *lastSlash = '\0';
+        }
+        setCurrentFilePath( path );
+        return isValidDirectoryHandle( &currentDirectory ) ? 0 : -1;
+    }
+
+    directoryHandle parent;
+    char path[PATH_BUFFER_SIZE];
+    if( openParentDirectoryHandle( &currentDirectory, &parent ) != 0 ||
+        getDirectoryPath( parent.blockLocation, path, PATH_BUFFER_SIZE ) != 0 ) {
+        return -1;
+    }
+    setCurrentDirectory( path, &parent );
+    return 0;
+}
+
+/* Rebuilds the path the prompt shows from the current directory handle,
+ * for after a move has renamed one of the directories above it */
+void refreshCurrentFilePath() {
+    char path[PATH_BUFFER_SIZE];
+    if( isPathIndexReady() && isValidDirectoryHandle( &currentDirectory ) &&
+        getDirectoryPath( currentDirectory.blockLocation, path, PATH_BUFFER_SIZE ) == 0 ) {
+        setCurrentDirectory( path, &currentDirectory );
+    }
+}
+
+directoryHandle* getCurrentDirectory() {
+    return &currentDirectory;
 }
\ No newline at end of file
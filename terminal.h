@@ -1,10 +1,21 @@
 #ifndef TERMINAL_H
 #define TERMINAL_H
 
+#include "filesystem.h"
+
+// room for the longest path the terminal works with, terminator included
+#define PATH_BUFFER_SIZE 1025
+
 int startTerminal();
 char** stringToArrayOfStrings( char* oldString );
+int reclaimWhileIdle();
 void stopRunning();
 char* getCurrentFilePath();
+const char* peekCurrentFilePath();
 void setCurrentFilePath( char* path );
+void setCurrentDirectory( char* path, directoryHandle* handle );
+int changeToParentDirectory();
+void refreshCurrentFilePath();
+directoryHandle* getCurrentDirectory();
 
 #endif /* TERMINAL_H end guard */
\ No newline at end of file